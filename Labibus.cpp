@@ -1,292 +1,483 @@
-#include <util/delay.h>
-#include <util/atomic.h>
-#include <avr/pgmspace.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-
-#include <stdlib.h>
-#include <stdio.h>
-
-#ifdef ARDUINO
-#if ARDUINO >= 100
- #include "Arduino.h"
-#else
- #include "WProgram.h"
-#endif
-#else
-#include <arduino/pins.h>
-#endif
+#include <string.h>
 
 #include "Labibus.h"
+#include "Labibus_hal.h"
+#include "Labibus_crc.h"
+#include "Labibus_num.h"
+#include "Labibus_frame.h"
 
 
-#ifdef ARDUINO
-#ifdef PERNITTENGRYNET
-#if !defined(__AVR_ATmega168__) && !defined(__AVR_ATmega328P__) \
-  && !defined(__AVR_ATmega32U4__)
-#error this AVR device is not yet supported :-(
-#endif
-#endif
-#endif
+/*
+  Space for a binary poll reply per channel. A reply with n values has a body
+  of at most 5+4n bytes, so with COBS overhead and delimiters it takes 8+4n.
+*/
+#define BIN_POLL_FRAME_SIZE 12
 
+/*
+  Device table, for our own devices and those listened to. The channels of
+  a device take consecutive slots in the channel table; our own devices also
+  have an entry in the table of served devices, with the state of their
+  polls.
+*/
+static NODE_LOCAL struct {
+  uint8_t device_id;
+  uint8_t channels;
+  /* First slot of the channels in rs485_channels[]. */
+  uint8_t slot;
+  /* Entry in served_devices[], once the device has been one of ours. */
+  uint8_t served;
+  /*
+    The flags share a byte, so the main program only changes them with
+    interrupts disabled.
+  */
+  uint8_t listen : 1;
+  uint8_t have_value : 1;
+  /* Decimals of integer values set, or of integer values wanted. */
+  uint8_t decimals : 4;
+} rs485_devices[MAX_DEVICES];
 
-static struct {
-  float sensor_value;
+/*
+  Channel table. For our own devices, the value set for the channel and its
+  value in the last poll reply, each as float or fixed-point according to
+  the value_kind and reported_kind of the device. For a listening entry, the
+  last value seen on the bus for the channel, as float and as fixed-point
+  with the decimals of the device.
+*/
+static NODE_LOCAL struct {
+  union {
+    float sensor_value;
+    int32_t sensor_fixed;
+  };
+  union {
+    float reported_value;
+    int32_t reported_fixed;
+    int32_t fixed_value;
+  };
+} rs485_channels[MAX_DEVICES];
+
+/* Our own devices. */
+static NODE_LOCAL struct {
+  /* The deadband, as given and scaled to fixed-point. */
+  float deadband;
+  int32_t deadband_fixed;
+  /* Bus clock time of the last poll, see note_poll(). */
+  uint32_t last_poll;
+  uint16_t poll_crc;
+  /* CRC of the discovery reply, which does not change after init. */
+  uint16_t discover_crc;
   uint16_t poll_interval;
-  /* A NULL description value means an unused (or listening) entry. */
+  /* Estimated time between polls and its mean deviation, see note_poll(). */
+  uint16_t poll_period, poll_dev;
+  /* Entry in rs485_devices[]. */
+  uint8_t device;
+  /* First row of the channels in served_texts[] and the poll frames. */
+  uint8_t row;
+  uint8_t poll_len;
+  uint8_t bin_len;
+  /*
+    Only changed with interrupts disabled, as for the device table. Kinds of
+    the values set and reported, and whether they differ.
+  */
+  uint8_t value_kind : 2, reported_kind : 2;
+  uint8_t changed : 1;
+  /* The descriptions and units of the channels are in flash. */
+  uint8_t progmem : 1;
+  /*
+    Polled, and the poll callback not yet called; and the number of polls
+    seen (up to 2) for the estimate.
+  */
+  uint8_t polled : 1;
+  uint8_t polls_seen : 2;
+#if SAMPLE_RINGS > 0
+  /* Sample ring number plus one, or 0 for none. */
+  uint8_t sample_ring : 4;
+#endif
+} served_devices[MAX_SERVED_DEVICES];
+
+#define VALUE_NONE 0
+#define VALUE_FLOAT 1
+#define VALUE_FIXED 2
+
+/*
+  Per channel of our own devices, one row each, consecutive for a device:
+  the description and unit; and the poll reply "!ii:P<value>|...", encoded
+  when the values are set so that it is ready to send when the poll arrives,
+  and the same reply as a binary frame, complete with CRC and delimiters.
+  The frame rows of a device are contiguous, so its replies extend over the
+  space of all its channels.
+*/
+static NODE_LOCAL struct {
   const char *description, *unit;
-  uint8_t device_id;
-  uint8_t have_value;
-  uint8_t listen;
-} rs485_devices[MAX_DEVICES];
+} served_texts[MAX_SERVED_CHANNELS];
+static NODE_LOCAL uint8_t poll_frames[MAX_SERVED_CHANNELS][POLL_FRAME_SIZE];
+static NODE_LOCAL uint8_t bin_frames[MAX_SERVED_CHANNELS][BIN_POLL_FRAME_SIZE];
 
+#if MAX_DEVICES > 127
+#error MAX_DEVICES must be at most 127
+#endif
+#if MAX_CHANNELS < 1 || MAX_CHANNELS > MAX_DEVICES
+#error MAX_CHANNELS must be from 1 to MAX_DEVICES
+#endif
+#if MAX_SERVED_DEVICES < 1 || MAX_SERVED_DEVICES > MAX_DEVICES || \
+  MAX_SERVED_CHANNELS < MAX_SERVED_DEVICES || MAX_SERVED_CHANNELS > MAX_DEVICES
+#error Need 1 <= MAX_SERVED_DEVICES <= MAX_SERVED_CHANNELS <= MAX_DEVICES
+#endif
+#if MAX_CHANNELS*POLL_FRAME_SIZE > MAX_REQ
+#error A poll reply with MAX_CHANNELS values must fit in MAX_REQ
+#endif
+#if VALUE_DECIMALS > NUM_FLOAT_DECIMALS
+#error VALUE_DECIMALS must be at most NUM_FLOAT_DECIMALS
+#endif
 
-static void
-setup_rs485_pins(void)
-{
-#ifdef ARDUINO
-  pinMode(PIN_RE, OUTPUT);
-  pinMode(PIN_DE, OUTPUT);
-#else
-  pin_mode_output(PIN_RE);
-  pin_mode_output(PIN_DE);
+#if SAMPLE_RINGS > 0
+#if SAMPLE_RING_SIZE < 1 || SAMPLE_RING_SIZE > 16 || \
+  (SAMPLE_RING_SIZE & (SAMPLE_RING_SIZE-1))
+#error SAMPLE_RING_SIZE must be a power of two, at most 16
+#endif
+#if SAMPLE_RINGS > 15
+#error SAMPLE_RINGS must be at most 15
+#endif
+/*
+  Sample rings (see labibus_enable_samples()). The last SAMPLE_RING_SIZE
+  samples with their bus clock timestamps, and the running aggregate of the
+  samples since the last 'A' request. Updated with interrupts disabled, as
+  samples may be added from interrupt handlers.
+*/
+static NODE_LOCAL struct {
+  float values[SAMPLE_RING_SIZE];
+  uint32_t times[SAMPLE_RING_SIZE];
+  /* Where the next sample goes. Runs freely, and is masked on access. */
+  uint8_t head;
+  uint8_t count;
+  uint16_t agg_count;
+  float agg_min, agg_max, agg_sum;
+} sample_rings[SAMPLE_RINGS];
+static NODE_LOCAL uint8_t num_sample_rings;
 #endif
-}
 
+/*
+  Devices are looked up by ID with a search of the device table; with
+  ID_INDEX, in constant time instead, in an index from ID to entry, which
+  holds the entry number plus one (0 for an unknown ID). Entries are only
+  ever added (or changed between served and listened), so entries, slots
+  and rows are handed out in order.
+*/
+#define NO_DEVICE 0xff
+static NODE_LOCAL uint8_t num_devices, num_slots, num_served, num_rows;
+#if ID_INDEX
+static NODE_LOCAL uint8_t id_index[128];
+#endif
 
-static void
-rs485_receive_mode(void)
+/* The entry of a device ID, or NO_DEVICE. */
+static inline uint8_t
+find_device(uint8_t id)
 {
-#ifdef ARDUINO
-  digitalWrite(PIN_DE, 0);
-  digitalWrite(PIN_RE, 0);
+#if ID_INDEX
+  if (id >= 128)
+    return NO_DEVICE;
+  return (uint8_t)(id_index[id] - 1);
 #else
-  pin_low(PIN_DE);
-  pin_low(PIN_RE);
+  uint8_t d;
+
+  for (d = 0; d < num_devices; ++d)
+    if (rs485_devices[d].device_id == id)
+      return d;
+  return NO_DEVICE;
 #endif
 }
 
-
-static void
-rs485_transmit_mode(void)
+static inline uint8_t
+lookup_device(uint8_t id, uint8_t listen)
 {
-#ifdef ARDUINO
-  digitalWrite(PIN_RE, 1);
-  digitalWrite(PIN_DE, 1);
-#else
-  pin_high(PIN_RE);
-  pin_high(PIN_DE);
-#endif
-}
+  uint8_t d = find_device(id);
 
+  if (d == NO_DEVICE || rs485_devices[d].listen != listen)
+    return NO_DEVICE;
+  return d;
+}
 
-static void
-setup_serial(void)
-{
-#if F_CPU == 16000000UL
-#if defined(__AVR_ATmega32U4__)
-  /* serial_baud_115200() */
-  UCSR1A = (UCSR1A & ~(_BV(FE1) | _BV(DOR1) | _BV(UPE1)))
-    | _BV(U2X1);
-  UBRR1 = 16;
-#else
-  /* serial_baud_115200() */
-  UCSR0A = (UCSR0A & ~(_BV(FE0) | _BV(DOR0) | _BV(UPE0)))
-    | _BV(U2X0);
-  UBRR0 = 16;
-#endif
-#else
-#error This CPU frequency is not yet supported :-(
-#endif
+static inline uint8_t
+served_device(uint8_t id)
+{
+  return lookup_device(id, 0);
+}
 
-#if defined(__AVR_ATmega32U4__)
-  /* serial_mode_8n1() */
-  UCSR1B &= ~(_BV(UCSZ12));
-  UCSR1C = (UCSR1C & ~(_BV(UPM11) | _BV(UPM10) | _BV(USBS1)))
-    | _BV(UCSZ11) | _BV(UCSZ10);
-  /* serial_transmitter_enable() */
-  UCSR1B |= _BV(TXEN1);
-  /* serial_receiver_enable() */
-  UCSR1B |= _BV(RXEN1);
-  /* serial_interrupt_rx_enable() */
-  UCSR1B |= _BV(RXCIE1);
-#else
-  /* serial_mode_8n1() */
-  UCSR0B &= ~(_BV(UCSZ02));
-  UCSR0C = (UCSR0C & ~(_BV(UPM01) | _BV(UPM00) | _BV(USBS0)))
-    | _BV(UCSZ01) | _BV(UCSZ00);
-  /* serial_transmitter_enable() */
-  UCSR0B |= _BV(TXEN0);
-  /* serial_receiver_enable() */
-  UCSR0B |= _BV(RXEN0);
-  /* serial_interrupt_rx_enable() */
-  UCSR0B |= _BV(RXCIE0);
-#endif
+static inline uint8_t
+listened_device(uint8_t id)
+{
+  return lookup_device(id, 1);
 }
 
 
-static inline void
-serial_interrupt_rx_enable(void)
+/*
+  Find the entry of an ID being configured with the given number of
+  channels: the existing one, if it has room for them, or a new one with the
+  next free slots. One of our own devices also takes an entry in
+  served_devices[] with a row per channel, the first time it is ours. Must
+  be called with interrupts disabled.
+*/
+static uint8_t
+assign_device(uint8_t id, uint8_t listen, uint8_t channels)
 {
-#if defined(__AVR_ATmega32U4__)
-  UCSR1B |= _BV(RXCIE1);
-#else
-  UCSR0B |= _BV(RXCIE0);
+  uint8_t d, served;
+
+  if (id >= 128 || channels < 1 || channels > MAX_CHANNELS)
+    return NO_DEVICE;
+  d = find_device(id);
+  if (d != NO_DEVICE)
+  {
+    if (channels > rs485_devices[d].channels)
+      return NO_DEVICE;
+    served = rs485_devices[d].served;
+  }
+  else if (num_devices < MAX_DEVICES && num_slots + channels <= MAX_DEVICES)
+    served = NO_DEVICE;
+  else
+    return NO_DEVICE;
+  if (!listen && served == NO_DEVICE)
+  {
+    if (num_served >= MAX_SERVED_DEVICES ||
+        num_rows + channels > MAX_SERVED_CHANNELS)
+      return NO_DEVICE;
+    served = num_served++;
+    served_devices[served].row = num_rows;
+    num_rows += channels;
+  }
+  if (d == NO_DEVICE)
+  {
+    d = num_devices++;
+    rs485_devices[d].slot = num_slots;
+    num_slots += channels;
+#if ID_INDEX
+    id_index[id] = d + 1;
 #endif
+  }
+  rs485_devices[d].device_id = id;
+  rs485_devices[d].channels = channels;
+  rs485_devices[d].served = served;
+  rs485_devices[d].listen = listen;
+  if (!listen)
+    served_devices[served].device = d;
+  return d;
 }
 
 
-static inline void
-serial_interrupt_rx_disable(void)
+/*
+  The reply being sent by the UDRE interrupt: the sync byte, while tx_sync
+  is set; then tx_len bytes from tx_ptr; then the trailer, up to
+  tx_trailer_len. The data goes out straight from where the reply was built
+  (tx_data), which must be left alone until tx_active clears; the trailer
+  holds the CRC and end marker of a text reply.
+*/
+static NODE_LOCAL const uint8_t *tx_data;
+static NODE_LOCAL const uint8_t *tx_ptr;
+static NODE_LOCAL uint8_t tx_len, tx_sync;
+static NODE_LOCAL uint8_t tx_trailer[6];
+static NODE_LOCAL uint8_t tx_trailer_idx, tx_trailer_len;
+/* Set from the start of a reply until its last stop bit has been sent. */
+static NODE_LOCAL volatile uint8_t tx_active;
+
+/*
+  The bus turnaround: how long after the end of a request we wait before
+  starting the reply, in bus timer ticks. See labibus_set_turnaround().
+*/
+#define DEFAULT_TURNAROUND_US 1000
+#define MAX_TURNAROUND_TICKS 32767
+/* Closer than this, it is too late to set up the timer; send right away. */
+#define MIN_ALARM_TICKS 8
+/* Longest wait for one alarm, well within the range of the bus timer. */
+#define MAX_ALARM_TICKS 16384
+static NODE_LOCAL uint16_t turnaround_ticks =
+  (uint32_t)DEFAULT_TURNAROUND_US*BUS_TIMER_TICKS_PER_MS/1000;
+/*
+  Bus clock time at which the reply being prepared is to start, normally the
+  turnaround after the end of the request; and at which the reply waiting in
+  the transmit buffer starts.
+*/
+static NODE_LOCAL uint32_t reply_at, tx_at;
+
+/* Bus statistics, see labibus_get_stats(). */
+static NODE_LOCAL struct labibus_stats bus_stats;
+
+
+/*
+  The bus clock: the bus timer, extended to 32 bits by counting its wraps.
+  At F_CPU=16MHz, it wraps after 35 minutes.
+*/
+static NODE_LOCAL volatile uint16_t bus_clock_high;
+
+ISR(BUS_TIMER_OVF_vect)
 {
-#if defined(__AVR_ATmega32U4__)
-  UCSR1B &= ~(_BV(RXCIE1));
-#else
-  UCSR0B &= ~(_BV(RXCIE0));
-#endif
+  ++bus_clock_high;
 }
 
 
-static inline uint8_t
-serial_writeable(void)
+/* Must be called with interrupts disabled. */
+static uint32_t
+bus_clock_now(void)
 {
-#if defined(__AVR_ATmega32U4__)
-  return UCSR1A & _BV(UDRE1);
-#else
-  return UCSR0A & _BV(UDRE0);
-#endif
+  uint16_t low = bus_timer_now();
+  uint16_t high = bus_clock_high;
+
+  /*
+    If the timer wrapped, but the interrupt did not run yet, count the wrap
+    here; unless the low word was read before it.
+  */
+  if (bus_timer_overflow_pending() && low < 0x8000)
+    ++high;
+  return ((uint32_t)high << 16) | low;
 }
 
 
-static inline void
-serial_write(uint8_t c)
+/*
+  Note the turnaround of a reply that is being started (see struct
+  labibus_stats). Must be called with interrupts disabled.
+*/
+static void
+note_turnaround(void)
 {
-#if defined(__AVR_ATmega32U4__)
-  UDR1 = c;
-#else
-  UDR0 = c;
-#endif
+  uint32_t t = bus_clock_now() - tx_at + turnaround_ticks;
+
+  if (t > 0xffff)
+    t = 0xffff;
+  if (t > bus_stats.turnaround_max_ticks)
+    bus_stats.turnaround_max_ticks = t;
 }
 
 
-static inline uint8_t
-serial_read(void)
+/* Take the bus and let the UDRE interrupt send the reply. */
+static void
+tx_begin(void)
 {
-#if defined(__AVR_ATmega32U4__)
-  return UDR1;
-#else
-  return UDR0;
-#endif
+  rs485_transmit_mode();
+  /*
+    The enable propagation delay of our RS485 driver is only 200 ns or so, so
+    we only need a small delay before we can start to transmit.
+  */
+  _delay_us(1);
+  serial_interrupt_udre_enable();
 }
 
 
-static void
-serial_wait_for_tx_complete(void)
+/*
+  Set the bus timer alarm for the start of the reply at tx_at, or for as far
+  towards it as one alarm goes. Returns 0 if it is time to send already.
+  Must be called with interrupts disabled.
+*/
+static uint8_t
+tx_arm(void)
 {
-#if defined(__AVR_ATmega32U4__)
-  while (!(UCSR1A & _BV(TXC1)))
-    ;
-#else
-  while (!(UCSR0A & _BV(TXC0)))
-    ;
-#endif
+  int32_t left = tx_at - bus_clock_now();
+
+  if (left <= MIN_ALARM_TICKS)
+    return 0;
+  if (left > MAX_ALARM_TICKS)
+    bus_timer_alarm(bus_timer_now() + MAX_ALARM_TICKS);
+  else
+    bus_timer_alarm(tx_at);
+  return 1;
 }
 
 
+/*
+  Start sending a reply: the sync byte, len bytes of data, and the first
+  trailer_len bytes of tx_trailer. Replies are built one at a time, once the
+  previous one has gone out (see process_frames()), so one that comes while
+  the bus is still ours is not for us to send, and is dropped.
+*/
 static void
-serial_putc(uint8_t c)
+tx_start(const uint8_t *data, uint8_t len, uint8_t trailer_len)
 {
-  while (!serial_writeable())
-    ;
+  uint8_t idle, armed;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    idle = !tx_active;
+    if (idle)
+    {
+      tx_active = 1;
+      tx_data = data;
+      tx_ptr = data;
+      tx_len = len;
+      tx_sync = 1;
+      tx_trailer_idx = 0;
+      tx_trailer_len = trailer_len;
+      ++bus_stats.replies;
+    }
+  }
+  if (!idle)
+    return;
+
   /*
-    Make sure we can use TXC (transmit complete) to wait for the char to be
-    completely transmittet before turning off RS485 transmit mode.
-
-    The TXC flag must be manually cleared (unless it gets cleared by
-    triggering an interrupt). And we need to avoid races when clearing it, so
-    that we do not risk missing that it becomes set, nor risk seeing it become
-    set by an earlier char that completes after clearing it.
-
-    So clear the TXC flag immediately after writing the last char. And disable
-    interrupts around it; this is necessary to avoid that an interrupt triggers
-    just after writing the char, delaying the clear until the last char has
-    completed, which would lose the completion event.
+    Let's give the master a bit of time to get into receive mode. The reply
+    starts from the timer interrupt once the turnaround time since the end
+    of the request has passed (or at its slot, for a range poll); if
+    preparing the reply took longer than that, it starts right away.
   */
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    serial_write(c);
-#if defined(__AVR_ATmega32U4__)
-    UCSR1A |= _BV(TXC1);
-#else
-    UCSR0A |= _BV(TXC0);
-#endif
+    tx_at = reply_at;
+    armed = tx_arm();
+    if (!armed)
+      note_turnaround();
   }
+  if (!armed)
+    tx_begin();
 }
 
 
-__attribute__((unused))
-static void
-serial_puts(char *s)
+ISR(BUS_TIMER_COMPA_vect)
 {
-  while (*s)
-    serial_putc(*s++);
+  bus_timer_alarm_cancel();
+  if (!tx_arm())
+  {
+    note_turnaround();
+    tx_begin();
+  }
 }
 
 
-/* CRC-16. */
-static const uint16_t crc16_tab[256] PROGMEM = {
-  0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
-  0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
-  0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
-  0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
-  0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
-  0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
-  0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
-  0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
-  0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
-  0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
-  0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
-  0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
-  0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
-  0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
-  0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
-  0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
-  0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
-  0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
-  0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
-  0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
-  0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
-  0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
-  0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
-  0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
-  0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
-  0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
-  0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
-  0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
-  0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
-  0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
-  0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
-  0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040
-};
 
-
-static uint32_t crc16(uint8_t byte, uint16_t crc_val)
+ISR(SERIAL_UDRE_vect)
 {
-  uint16_t tab_lookup = pgm_read_word(&crc16_tab[(uint8_t)crc_val ^ byte]);
-  return tab_lookup ^ (crc_val >> 8);
+  if (tx_sync)
+  {
+    serial_write(0xff);
+    tx_sync = 0;
+  }
+  else if (tx_len)
+  {
+    serial_write(*tx_ptr++);
+    --tx_len;
+  }
+  else
+    serial_write(tx_trailer[tx_trailer_idx++]);
+  /*
+    Clear TXC after every char, so that it only becomes set once the last
+    char has been completely transmitted. Interrupts are disabled here, so
+    no other char can complete between the write and the clear.
+  */
+  serial_clear_tx_complete();
+  if (!tx_len && tx_trailer_idx == tx_trailer_len)
+  {
+    /* All sent; wait for the last char to leave the shift register. */
+    serial_interrupt_udre_disable();
+    serial_interrupt_txc_enable();
+  }
 }
 
 
-static uint32_t crc16_buf(const uint8_t *buf, uint16_t len)
+static void notify_polls(void);
+static void reply_sent(void);
+
+ISR(SERIAL_TX_vect)
 {
-  uint16_t crc_val = 0;
-  while (len > 0)
-  {
-    crc_val = crc16(*buf, crc_val);
-    ++buf;
-    --len;
-  }
-  return crc_val;
+  /* The reply is completely sent, release the bus. */
+  rs485_receive_mode();
+  serial_interrupt_txc_disable();
+  tx_active = 0;
+  notify_polls();
+  reply_sent();
 }
 
 
@@ -340,14 +531,16 @@ quoted_append_char_to_buf(uint8_t *buf, uint8_t idx, uint8_t c)
 }
 
 
+/* Append a string, in flash if progmem is set. */
 static uint8_t
-append_to_buf(uint8_t *buf, uint8_t idx, const char *s)
+quoted_append_to_buf(uint8_t *buf, uint8_t idx, const char *s,
+                     uint8_t progmem)
 {
   char c;
 
-  while ((c = *s))
+  while ((c = progmem ? pgm_read_byte(s) : *s))
   {
-    idx = append_char_to_buf(buf, idx, c);
+    idx = quoted_append_char_to_buf(buf, idx, c);
     ++s;
   }
   return idx;
@@ -355,247 +548,1263 @@ append_to_buf(uint8_t *buf, uint8_t idx, const char *s)
 
 
 static uint8_t
-quoted_append_to_buf(uint8_t *buf, uint8_t idx, const char *s)
+append_uint_to_buf(uint8_t *buf, uint8_t idx, uint16_t x)
 {
-  char c;
+  char tmp[5];
+  uint8_t n = 0;
 
-  while ((c = *s))
+  do
   {
-    idx = quoted_append_char_to_buf(buf, idx, c);
-    ++s;
-  }
+    tmp[n++] = '0' + x % 10;
+    x /= 10;
+  } while (x);
+  while (n > 0)
+    idx = append_char_to_buf(buf, idx, tmp[--n]);
   return idx;
 }
 
 
+/* Start a reply "!ii:<type>". */
+static uint8_t
+append_header_to_buf(uint8_t *buf, uint8_t idx, uint8_t id, uint8_t type)
+{
+  idx = append_char_to_buf(buf, idx, '!');
+  idx = append_char_to_buf(buf, idx, dec2hex(id >> 4));
+  idx = append_char_to_buf(buf, idx, dec2hex(id & 0xf));
+  idx = append_char_to_buf(buf, idx, ':');
+  return append_char_to_buf(buf, idx, type);
+}
+
+
+/*
+  Send a reply: the sync byte, the data, the CRC (computed by the caller)
+  and the end marker. The data is sent from buf, see tx_start().
+
+  The sync byte is a dummy byte of all one bits. This should ensure that the
+  UART state machine can sync up to the byte boundary, as it prevents any new
+  start bit being seen for one character's time.
+*/
 static void
-send_reply(uint8_t *buf, uint8_t len)
+send_reply(const uint8_t *buf, uint8_t len, uint16_t crc)
 {
-  uint8_t i;
-  uint16_t crc = 0;
+  if (tx_active)
+    return;
+  tx_trailer[0] = dec2hex(crc >> 12);
+  tx_trailer[1] = dec2hex((uint8_t)(crc >> 8) & 0xf);
+  tx_trailer[2] = dec2hex((uint8_t)(crc >> 4) & 0xf);
+  tx_trailer[3] = dec2hex((uint8_t)crc & 0xf);
+  tx_trailer[4] = '\r';
+  tx_trailer[5] = '\n';
+  tx_start(buf, len, 6);
+}
 
-  /* Let's give the master a bit of time to get into receive mode. */
-  _delay_ms(1);
-  rs485_transmit_mode();
-  /*
-    The enable propagation delay of our RS485 driver is only 200 ns or so, so
-    we only need a small delay before we can start to transmit.
-  */
-  _delay_us(1);
-  /*
-    Send a dummy byte of all one bits. This should ensure that the UART state
-    machine can sync up to the byte boundary, as it prevents any new start bit
-    being seen for one character's time.
-  */
-  serial_putc(0xff);
-  for (i = 0; i < len; ++i)
+
+/*
+  Send a binary frame, after the sync byte. The frame is complete with CRC
+  and delimiters.
+*/
+static void
+send_binary_reply(const uint8_t *frame, uint8_t len)
+{
+  tx_start(frame, len, 0);
+}
+
+
+/*
+  Discovery reply "!ii:D<poll interval>|<description>|<unit>|b|", with a
+  description and unit pair for each channel. The last field, the only one
+  after the pairs, announces support for binary poll frames.
+*/
+static uint8_t
+encode_discover(uint8_t s, uint8_t *buf)
+{
+  uint8_t d = served_devices[s].device;
+  uint8_t row = served_devices[s].row;
+  uint8_t progmem = served_devices[s].progmem;
+  uint8_t idx, c;
+
+  idx = append_header_to_buf(buf, 0, rs485_devices[d].device_id, 'D');
+  idx = append_uint_to_buf(buf, idx, served_devices[s].poll_interval);
+  idx = append_char_to_buf(buf, idx, '|');
+  for (c = row; c < row + rs485_devices[d].channels; ++c)
   {
-    uint8_t c = buf[i];
-    crc = crc16(c, crc);
-      serial_putc(c);
-  }
-  /* Send the CRC and request end marker. */
-  serial_putc(dec2hex(crc >> 12));
-  serial_putc(dec2hex((uint8_t)(crc >> 8) & 0xf));
-  serial_putc(dec2hex((uint8_t)(crc >> 4) & 0xf));
-  serial_putc(dec2hex((uint8_t)crc & 0xf));
-  serial_putc('\r');
-  serial_putc('\n');
-  serial_wait_for_tx_complete();
-  rs485_receive_mode();
+    idx = quoted_append_to_buf(buf, idx, served_texts[c].description,
+                               progmem);
+    idx = append_char_to_buf(buf, idx, '|');
+    idx = quoted_append_to_buf(buf, idx, served_texts[c].unit, progmem);
+    idx = append_char_to_buf(buf, idx, '|');
+  }
+  idx = append_char_to_buf(buf, idx, 'b');
+  return append_char_to_buf(buf, idx, '|');
 }
 
 
-static void
-device_discover(uint8_t id, uint8_t *buf)
+/*
+  Poll reply "!ii:P<value>|<value>|...|" with n values, into a buffer of
+  n*POLL_FRAME_SIZE bytes. Values that are too long for POLL_FRAME_SIZE-6
+  chars in fixed notation are sent in exponential notation.
+*/
+static uint8_t
+encode_poll(uint8_t id, const float *values, uint8_t n, uint8_t *buf)
 {
-  uint8_t idx, i;
-  char tmp[20];
+  uint8_t idx, c;
 
-  for (i = 0; i < MAX_DEVICES; ++i)
+  idx = append_header_to_buf(buf, 0, id, 'P');
+  for (c = 0; c < n; ++c)
   {
-    if (!rs485_devices[i].description)
-      continue;
-    if (rs485_devices[i].device_id == id)
-    {
-      idx = 0;
-      sprintf(tmp, "!%02x:D%u|", id, rs485_devices[i].poll_interval);
-      idx = append_to_buf(buf, idx, tmp);
-      idx = quoted_append_to_buf(buf, idx, rs485_devices[i].description);
-      idx = append_char_to_buf(buf, idx, '|');
-      idx = quoted_append_to_buf(buf, idx, rs485_devices[i].unit);
-      idx = append_char_to_buf(buf, idx, '|');
-      send_reply(buf, idx);
-      break;
-    }
+    /* Numbers need no quoting. */
+    idx += num_format(values[c], VALUE_DECIMALS, (char *)buf + idx,
+                      POLL_FRAME_SIZE - 6);
+    buf[idx++] = '|';
   }
+  return idx;
 }
 
 
-static void
-device_poll(uint8_t id, uint8_t *buf)
+/* Poll reply of n fixed-point values, as above. */
+static uint8_t
+encode_poll_fixed(uint8_t id, const int32_t *values, uint8_t n,
+                  uint8_t decimals, uint8_t *buf)
 {
-  uint8_t idx, i;
-  char tmp[20];
+  uint8_t idx, c;
 
-  for (i = 0; i < MAX_DEVICES; ++i)
+  idx = append_header_to_buf(buf, 0, id, 'P');
+  for (c = 0; c < n; ++c)
   {
-    if (!rs485_devices[i].description)
-      continue;
-    if (rs485_devices[i].device_id == id)
-    {
-      float sensor_value;
-
-      if (!rs485_devices[i].have_value)
-        break;
-      idx = 0;
-      sprintf(tmp, "!%02x:P", id);
-      idx = append_to_buf(buf, idx, tmp);
-      /* Protect agains read/update race on float value. */
-      ATOMIC_BLOCK(ATOMIC_FORCEON)
-      {
-        sensor_value = rs485_devices[i].sensor_value;
-      }
-      dtostrf((double)sensor_value, 1, 6, tmp);
-      idx = quoted_append_to_buf(buf, idx, tmp);
-      idx = append_char_to_buf(buf, idx, '|');
-      send_reply(buf, idx);
-      rs485_devices[i].have_value = 0;
-      break;
-    }
+    idx += num_format_fixed(values[c], decimals, (char *)buf + idx);
+    buf[idx++] = '|';
   }
+  return idx;
 }
 
 
 /*
-  Process a response to the master from another device (for labibus_listen()).
-  Response format:
-    !ii:P<float value>|cccc
-  Here, ii is two hex digits giving the device id.
-  cccc is the CRC16 (in hex) of the response up to and including the '|'.
+  Binary frames.
+
+  Besides the text protocol, devices accept binary poll requests, and answer
+  them in kind. A binary frame is
+    0x00 <COBS-encoded body> 0x00
+  with the body
+    <id> <type> <payload> <crc high> <crc low>
+  Here, id is the device ID, with bit 7 set in replies. The CRC is the same
+  CRC16 as for text frames, computed over id, type and payload. COBS
+  (Consistent Overhead Byte Stuffing) removes all zero bytes from the body,
+  so 0x00 only occurs as delimiter; as text frames contain no zero bytes,
+  both formats can share the bus.
+
+  Binary frames:
+    <id> 'P'                   # Poll request
+    <id> 'C', <id> 'A', <id> 'H' # Other requests, as in text (see below)
+    <lo> 'R' <hi> <slot>       # Range poll, see process_range()
+    <lo> 'E' <hi> <slot>       # Slotted discovery, likewise
+    <id|0x80> 'P' <value>...   # Poll reply, value as IEEE 754 float, LSB first
+    <id|0x80> 'I' <d> <value>... # Poll reply, value * 10^-d, with value as
+                               # 32-bit two's complement, LSB first
+  A poll reply has one value for each channel of the device.
+
+  Devices announce support with the extra "b" field of their discovery reply,
+  so a master knows which devices it can poll in binary.
 */
-static void
-process_response(uint8_t *req, uint8_t len)
+
+/*
+  COBS-encode a body of len bytes (at most 253), and put it between frame
+  delimiters. Returns the frame length, len+3.
+*/
+static uint8_t
+cobs_frame(const uint8_t *body, uint8_t len, uint8_t *frame)
 {
-  uint8_t device_id;
-  uint8_t i;
+  uint8_t i, idx, code_idx, code;
 
-  /* Caller already checked initial part of the request string. */
-  device_id = (hex2dec(req[1]) << 4) | hex2dec(req[2]);
-  for (i = 0; i < MAX_DEVICES; ++i)
+  frame[0] = 0;
+  code_idx = 1;
+  code = 1;
+  idx = 2;
+  for (i = 0; i < len; ++i)
   {
-    float sensor_value;
-    uint16_t calc_crc, rcv_crc;
-
-    if (!rs485_devices[i].listen || rs485_devices[i].device_id != device_id)
-      continue;
-    sensor_value = atof((char *)&req[5]);
-    calc_crc = crc16_buf(req, len-4);
-    rcv_crc = ((uint16_t)hex2dec(req[len-4]) << 12) |
-      ((uint16_t)hex2dec(req[len-3]) << 8) |
-      ((uint16_t)hex2dec(req[len-2]) << 4) |
-      (uint16_t)hex2dec(req[len-1]);
-    if (calc_crc != rcv_crc)
-      return;
-    /* Protect agains read/update race. */
-    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    if (body[i] == 0)
     {
-      rs485_devices[i].sensor_value = sensor_value;
-      rs485_devices[i].have_value = 1;
+      frame[code_idx] = code;
+      code_idx = idx++;
+      code = 1;
+    }
+    else
+    {
+      frame[idx++] = body[i];
+      ++code;
     }
-    return;
   }
+  frame[code_idx] = code;
+  frame[idx++] = 0;
+  return idx;
 }
 
 
 /*
-  Process a request.
-  Request format:
-    ?ii:D|cccc                 # Discovery request
-    ?ii:P|cccc                 # Poll request
-  Here, ii is two hex digits to identify the device. Only the device owning
-  that ID may reply.
-  cccc is the CRC16 (in hex) of the request up to and including the '|'.
+  Binary poll reply with n values, into a buffer of n*BIN_POLL_FRAME_SIZE
+  bytes.
 */
-static void
-process_req(uint8_t *req, uint8_t len)
+static uint8_t
+encode_binary_poll(uint8_t id, const float *values, uint8_t n,
+                   uint8_t *frame)
 {
-  uint16_t calc_crc, rcv_crc;
-  uint8_t rcv_id;
+  uint8_t body[4 + 4*MAX_CHANNELS];
+  uint8_t len = 2 + 4*n;
+  uint16_t crc;
+
+  body[0] = id | 0x80;
+  body[1] = 'P';
+  /* Both the AVR and the host simulator are little endian. */
+  memcpy(&body[2], values, 4*n);
+  crc = crc16_buf(body, len);
+  body[len] = crc >> 8;
+  body[len+1] = crc & 0xff;
+  return cobs_frame(body, len + 2, frame);
+}
 
-  if (len > 10 &&
-      req[0] == '!' && req[3] == ':' && req[4] == 'P' && req[len-5] == '|')
-    return process_response(req, len);
 
-  if (len != 10)
-    return;
-  if (req[0] != '?' || req[5] != '|' || (req[4] != 'D' && req[4] != 'P'))
-    return;
-  calc_crc = crc16_buf(req, 6);
-  rcv_crc = ((uint16_t)hex2dec(req[6]) << 12) |
-    ((uint16_t)hex2dec(req[7]) << 8) |
-    ((uint16_t)hex2dec(req[8]) << 4) |
-    (uint16_t)hex2dec(req[9]);
-  if (calc_crc != rcv_crc)
-    return;
-  rcv_id = (hex2dec(req[1]) << 4) | hex2dec(req[2]);
-  if (req[4] == 'D')
-    device_discover(rcv_id, req);
-  else
-    device_poll(rcv_id, req);
+/* Binary poll reply of n fixed-point values, as above. */
+static uint8_t
+encode_binary_poll_fixed(uint8_t id, const int32_t *values, uint8_t n,
+                         uint8_t decimals, uint8_t *frame)
+{
+  uint8_t body[5 + 4*MAX_CHANNELS];
+  uint8_t len = 3 + 4*n;
+  uint16_t crc;
+
+  body[0] = id | 0x80;
+  body[1] = 'I';
+  body[2] = decimals;
+  memcpy(&body[3], values, 4*n);
+  crc = crc16_buf(body, len);
+  body[len] = crc >> 8;
+  body[len+1] = crc & 0xff;
+  return cobs_frame(body, len + 2, frame);
 }
 
 
-static uint8_t rcv_buf[MAX_REQ];
-static uint8_t rcv_idx;
-
 static void
-process_received_char(uint8_t c)
+device_discover(uint8_t id, uint8_t *buf)
 {
-  /* Initially, wait for start-of-request/response markers '?' / '!'. */
-  if (rcv_idx == 0 && c != '?' && c != '!')
+  uint8_t d = served_device(id);
+  uint8_t s;
+
+  if (d == NO_DEVICE)
     return;
-  if (rcv_idx >= MAX_REQ)
-  {
-    /* Too long request. */
-    rcv_idx = 0;
+  s = rs485_devices[d].served;
+  send_reply(buf, encode_discover(s, buf), served_devices[s].discover_crc);
+}
+
+
+/*
+  Poll timing, for the poll callback and labibus_time_to_poll(). The time
+  between polls is estimated as a running mean, and its deviation as the
+  running mean of the differences from it, in units of 2^POLL_TIME_SHIFT bus
+  timer ticks (about 1 ms at 16MHz), up to 65535 units.
+*/
+#define POLL_TIME_SHIFT 11
+
+static NODE_LOCAL labibus_poll_callback poll_callback;
+/* Some device has polled set. */
+static NODE_LOCAL uint8_t polls_pending;
+
+/* Divide, rounding up, so that the estimates always reach the target. */
+static inline uint16_t
+div_up(uint16_t x, uint8_t shift)
+{
+  return (x >> shift) + ((x & ((1 << shift) - 1)) != 0);
+}
+
+
+/* Note a poll of the device with entry s in served_devices[]. */
+static void
+note_poll(uint8_t s)
+{
+  uint32_t now, t;
+  uint16_t m, err;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    now = bus_clock_now();
+    t = (now - served_devices[s].last_poll) >> POLL_TIME_SHIFT;
+    m = t > 0xffff ? 0xffff : t;
+    if (served_devices[s].polls_seen == 1)
+    {
+      served_devices[s].poll_period = m;
+      served_devices[s].poll_dev = m / 2;
+    }
+    else if (served_devices[s].polls_seen == 2)
+    {
+      /* Gains of 1/8 and 1/4, as for round trip times in TCP. */
+      err = m > served_devices[s].poll_period ?
+        m - served_devices[s].poll_period : served_devices[s].poll_period - m;
+      if (m > served_devices[s].poll_period)
+        served_devices[s].poll_period += div_up(err, 3);
+      else
+        served_devices[s].poll_period -= div_up(err, 3);
+      if (err > served_devices[s].poll_dev)
+        served_devices[s].poll_dev +=
+          div_up(err - served_devices[s].poll_dev, 2);
+      else
+        served_devices[s].poll_dev -=
+          div_up(served_devices[s].poll_dev - err, 2);
+    }
+    if (served_devices[s].polls_seen < 2)
+      ++served_devices[s].polls_seen;
+    served_devices[s].last_poll = now;
+    served_devices[s].polled = 1;
+    polls_pending = 1;
+  }
+}
+
+
+/*
+  Call the poll callback for the devices polled since the last call. Called
+  when a reply has been sent, with interrupts disabled.
+*/
+static void
+notify_polls(void)
+{
+  uint8_t s;
+
+  if (!polls_pending)
+    return;
+  polls_pending = 0;
+  for (s = 0; s < num_served; ++s)
+  {
+    if (!served_devices[s].polled)
+      continue;
+    served_devices[s].polled = 0;
+    if (poll_callback)
+      poll_callback(rs485_devices[served_devices[s].device].device_id);
+  }
+}
+
+
+/* Reply to a poll of the device. Returns 1 if a reply was queued. */
+static uint8_t
+device_poll(uint8_t id, uint8_t binary)
+{
+  uint8_t d = served_device(id);
+  uint8_t s, row, slot, c;
+
+  if (d == NO_DEVICE)
+    return 0;
+  s = rs485_devices[d].served;
+  note_poll(s);
+  if (!rs485_devices[d].have_value)
+  {
+    /* Nothing to send; there is no reply to wait for. */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      if (!tx_active)
+        notify_polls();
+    }
+    return 0;
+  }
+  /*
+    The main program only updates the frames with interrupts disabled, so
+    they cannot change under us here.
+  */
+  row = served_devices[s].row;
+  if (binary)
+    send_binary_reply(bin_frames[row], served_devices[s].bin_len);
+  else
+    send_reply(poll_frames[row], served_devices[s].poll_len,
+               served_devices[s].poll_crc);
+  rs485_devices[d].have_value = 0;
+  /* What the master now has is the reference for the deadband. */
+  slot = rs485_devices[d].slot;
+  for (c = slot; c < slot + rs485_devices[d].channels; ++c)
+  {
+    if (served_devices[s].value_kind == VALUE_FLOAT)
+      rs485_channels[c].reported_value = rs485_channels[c].sensor_value;
+    else
+      rs485_channels[c].reported_fixed = rs485_channels[c].sensor_fixed;
+  }
+  served_devices[s].reported_kind = served_devices[s].value_kind;
+  served_devices[s].changed = 0;
+  return 1;
+}
+
+
+/*
+  Reply to a change request, in text (into buf, of MAX_REQ bytes) or binary:
+    !ii:C<jj><kk>...|
+    <id|0x80> 'C' <jj> <kk> ...
+  listing the IDs of all our devices whose values moved past their deadband
+  since their last poll reply. If there are more than fit, the rest follow in
+  later replies, as they stay changed until they are polled.
+*/
+static void
+device_changed(uint8_t id, uint8_t binary, uint8_t *buf)
+{
+  uint8_t s, d, idx, c;
+  uint8_t body[4 + MAX_SERVED_DEVICES];
+  uint16_t crc;
+
+  if (served_device(id) == NO_DEVICE)
+    return;
+  if (binary)
+  {
+    body[0] = id | 0x80;
+    body[1] = 'C';
+    idx = 2;
+  }
+  else
+    idx = append_header_to_buf(buf, 0, id, 'C');
+  for (s = 0; s < num_served; ++s)
+  {
+    d = served_devices[s].device;
+    if (!served_devices[s].changed || rs485_devices[d].listen)
+      continue;
+    c = rs485_devices[d].device_id;
+    if (binary)
+      body[idx++] = c;
+    else if (idx + 2 < MAX_REQ - 1)
+    {
+      buf[idx++] = dec2hex(c >> 4);
+      buf[idx++] = dec2hex(c & 0xf);
+    }
+  }
+  if (binary)
+  {
+    crc = crc16_buf(body, idx);
+    body[idx++] = crc >> 8;
+    body[idx++] = crc & 0xff;
+    send_binary_reply(buf, cobs_frame(body, idx, buf));
+  }
+  else
+  {
+    buf[idx++] = '|';
+    send_reply(buf, idx, crc16_buf(buf, idx));
+  }
+}
+
+
+#if SAMPLE_RINGS > 0
+/* The sample ring of one of our devices, or NO_DEVICE if it has none. */
+static uint8_t
+find_sample_ring(uint8_t id)
+{
+  uint8_t d = served_device(id);
+
+  if (d == NO_DEVICE || !served_devices[rs485_devices[d].served].sample_ring)
+    return NO_DEVICE;
+  return served_devices[rs485_devices[d].served].sample_ring - 1;
+}
+
+
+/*
+  Reply to an aggregate request, in text (into buf, of MAX_REQ bytes) or
+  binary:
+    !ii:A<count>|<min>|<max>|<mean>|
+    <id|0x80> 'A' <count> <min> <max> <mean>
+  with count 16 bits and the rest floats, LSB first; just the count if it
+  is zero. The aggregate starts over.
+*/
+static void
+device_aggregate(uint8_t id, uint8_t binary, uint8_t *buf)
+{
+  uint8_t r = find_sample_ring(id);
+  uint8_t idx, c;
+  uint8_t body[16];
+  uint16_t count, crc;
+  float stats[3];
+
+  if (r == NO_DEVICE)
+    return;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    count = sample_rings[r].agg_count;
+    stats[0] = sample_rings[r].agg_min;
+    stats[1] = sample_rings[r].agg_max;
+    stats[2] = sample_rings[r].agg_sum;
+    sample_rings[r].agg_count = 0;
+  }
+  if (count)
+    stats[2] /= count;
+
+  if (binary)
+  {
+    body[0] = id | 0x80;
+    body[1] = 'A';
+    memcpy(&body[2], &count, 2);
+    idx = 4;
+    if (count)
+    {
+      memcpy(&body[4], stats, 12);
+      idx = 16;
+    }
+    crc = crc16_buf(body, idx);
+    body[idx++] = crc >> 8;
+    body[idx++] = crc & 0xff;
+    send_binary_reply(buf, cobs_frame(body, idx, buf));
+    return;
+  }
+  idx = append_header_to_buf(buf, 0, id, 'A');
+  idx = append_uint_to_buf(buf, idx, count);
+  buf[idx++] = '|';
+  for (c = 0; count && c < 3; ++c)
+  {
+    idx += num_format(stats[c], VALUE_DECIMALS, (char *)buf + idx,
+                      POLL_FRAME_SIZE - 6);
+    buf[idx++] = '|';
+  }
+  send_reply(buf, idx, crc16_buf(buf, idx));
+}
+
+
+/*
+  Longest text of a sample in a history reply: age, value, and separators.
+  A text reply holds as many of the last samples as fit in MAX_REQ.
+*/
+#define HISTORY_TEXT_SAMPLE (10 + (POLL_FRAME_SIZE-6) + 2)
+#define HISTORY_TEXT_SAMPLES ((MAX_REQ - 6) / HISTORY_TEXT_SAMPLE)
+#if 7 + 8*SAMPLE_RING_SIZE > MAX_REQ
+#error A binary history reply must fit in MAX_REQ
+#endif
+
+/*
+  Reply to a history request, in text (into buf, of MAX_REQ bytes) or
+  binary:
+    !ii:H<age>|<value>|<age>|<value>|...|
+    <id|0x80> 'H' <age> <value> <age> <value> ...
+  oldest first, with ages in milliseconds as 32-bit integers and values as
+  floats, LSB first.
+*/
+static void
+device_history(uint8_t id, uint8_t binary, uint8_t *buf)
+{
+  uint8_t r = find_sample_ring(id);
+  uint8_t idx, c, n, head;
+  uint8_t body[4 + 8*SAMPLE_RING_SIZE];
+  float values[SAMPLE_RING_SIZE];
+  uint32_t times[SAMPLE_RING_SIZE];
+  uint32_t now, age;
+  uint16_t crc;
+
+  if (r == NO_DEVICE)
+    return;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    memcpy(values, sample_rings[r].values, sizeof(values));
+    memcpy(times, sample_rings[r].times, sizeof(times));
+    head = sample_rings[r].head;
+    n = sample_rings[r].count;
+    now = bus_clock_now();
+  }
+  if (!binary && n > HISTORY_TEXT_SAMPLES)
+    n = HISTORY_TEXT_SAMPLES;
+
+  if (binary)
+  {
+    body[0] = id | 0x80;
+    body[1] = 'H';
+    idx = 2;
+  }
+  else
+    idx = append_header_to_buf(buf, 0, id, 'H');
+  for (c = head - n; c != head; ++c)
+  {
+    age = (now - times[c & (SAMPLE_RING_SIZE-1)]) / BUS_TIMER_TICKS_PER_MS;
+    if (binary)
+    {
+      memcpy(&body[idx], &age, 4);
+      memcpy(&body[idx+4], &values[c & (SAMPLE_RING_SIZE-1)], 4);
+      idx += 8;
+      continue;
+    }
+    idx += num_format_fixed(age, 0, (char *)buf + idx);
+    buf[idx++] = '|';
+    idx += num_format(values[c & (SAMPLE_RING_SIZE-1)], VALUE_DECIMALS,
+                      (char *)buf + idx, POLL_FRAME_SIZE - 6);
+    buf[idx++] = '|';
+  }
+  if (binary)
+  {
+    crc = crc16_buf(body, idx);
+    body[idx++] = crc >> 8;
+    body[idx++] = crc & 0xff;
+    send_binary_reply(buf, cobs_frame(body, idx, buf));
+  }
+  else
+    send_reply(buf, idx, crc16_buf(buf, idx));
+}
+#endif
+
+
+/*
+  Reply to a statistics request with the bus statistics of the node, in text
+  (into buf, of MAX_REQ bytes) or binary:
+    !ii:S<frames>|<addressed>|...|
+    <id|0x80> 'S' <frames> <addressed> ...
+  with the fields in the order of struct labibus_stats, 16 bits LSB first.
+*/
+#define STATS_FIELDS (sizeof(struct labibus_stats) / sizeof(uint16_t))
+
+static void
+device_stats(uint8_t id, uint8_t binary, uint8_t *buf)
+{
+  uint16_t fields[STATS_FIELDS];
+  uint8_t body[4 + sizeof(fields)];
+  struct labibus_stats st;
+  uint8_t idx, c;
+  uint16_t crc;
+
+  if (served_device(id) == NO_DEVICE)
+    return;
+  labibus_get_stats(&st);
+  memcpy(fields, &st, sizeof(fields));
+  if (binary)
+  {
+    body[0] = id | 0x80;
+    body[1] = 'S';
+    memcpy(&body[2], fields, sizeof(fields));
+    idx = 2 + sizeof(fields);
+    crc = crc16_buf(body, idx);
+    body[idx++] = crc >> 8;
+    body[idx++] = crc & 0xff;
+    send_binary_reply(buf, cobs_frame(body, idx, buf));
     return;
   }
-  /* CR before LF is useful for serial debugging, but is otherwise ignored. */
-  if (c == '\r')
+  idx = append_header_to_buf(buf, 0, id, 'S');
+  for (c = 0; c < STATS_FIELDS; ++c)
+  {
+    idx = append_uint_to_buf(buf, idx, fields[c]);
+    buf[idx++] = '|';
+  }
+  send_reply(buf, idx, crc16_buf(buf, idx));
+}
+
+
+/*
+  Store the values of all channels seen on the bus from a device we listen
+  to, as one group.
+*/
+static void
+store_listened_values(uint8_t d, const float *sensor_values,
+                      const int32_t *fixed_values)
+{
+  uint8_t slot = rs485_devices[d].slot;
+  uint8_t c;
+
+  /* Protect agains read/update race. */
+  ATOMIC_BLOCK(ATOMIC_FORCEON)
+  {
+    for (c = 0; c < rs485_devices[d].channels; ++c)
+    {
+      rs485_channels[slot+c].sensor_value = sensor_values[c];
+      rs485_channels[slot+c].fixed_value = fixed_values[c];
+    }
+    rs485_devices[d].have_value = 1;
+  }
+}
+
+
+/*
+  Process a response to the master from another device (for labibus_listen()).
+  Response format:
+    !ii:P<float value>|<float value>|...|cccc
+  Here, ii is two hex digits giving the device id, and there is one value
+  per channel of the device.
+  cccc is the CRC16 (in hex) of the response up to and including the last
+  '|'. The caller already checked the format and the CRC.
+*/
+static void
+process_response(uint8_t *req, uint8_t len)
+{
+  uint8_t d = listened_device((hex2dec(req[1]) << 4) | hex2dec(req[2]));
+  float sensor_values[MAX_CHANNELS];
+  int32_t fixed_values[MAX_CHANNELS];
+  uint8_t *p, *end, *bar;
+  uint8_t c;
+
+  if (d == NO_DEVICE)
+    return;
+  p = &req[5];
+  end = &req[len-4];
+  for (c = 0; c < rs485_devices[d].channels; ++c)
+  {
+    bar = (uint8_t *)memchr(p, '|', end - p);
+    if (!bar)
+      return;
+    sensor_values[c] = num_parse((char *)p);
+    fixed_values[c] = num_parse_fixed((char *)p, rs485_devices[d].decimals);
+    p = bar + 1;
+  }
+  /* Ignore replies with more values than we expect. */
+  if (p != end)
     return;
-  /* A LF marks the end of the request. */
-  if (c == '\n')
+  store_listened_values(d, sensor_values, fixed_values);
+}
+
+
+/*
+  Process a binary poll reply from another device. The values are converted
+  through the text form, so listeners see the same values whichever format
+  the master polls with.
+*/
+static void
+process_binary_response(uint8_t *req, uint8_t len)
+{
+  uint8_t d = listened_device(req[0] & 0x7f);
+  float sensor_values[MAX_CHANNELS];
+  int32_t fixed_values[MAX_CHANNELS];
+  char text[24];
+  uint8_t c, n;
+
+  if (d == NO_DEVICE)
+    return;
+  n = rs485_devices[d].channels;
+  if (!((req[1] == 'P' && len == 4 + 4*n) ||
+        (req[1] == 'I' && len == 5 + 4*n && req[2] <= NUM_MAX_DECIMALS)))
+    return;
+  for (c = 0; c < n; ++c)
   {
-    /*
-      We have received a request.
-      Process it, with interrupts enabled (but serial reception interrupt
-      disabled), so that we do not block other interrupt processing during
-      long serial transmission.
-      Then reset the buffer, ready for the next request.
-    */
-    serial_interrupt_rx_disable();
+    if (req[1] == 'P')
+    {
+      memcpy(&sensor_values[c], &req[2 + 4*c], 4);
+      text[num_format(sensor_values[c], VALUE_DECIMALS, text,
+                      POLL_FRAME_SIZE - 6)] = '\0';
+    }
+    else
+    {
+      memcpy(&fixed_values[c], &req[3 + 4*c], 4);
+      text[num_format_fixed(fixed_values[c], req[2], text)] = '\0';
+      sensor_values[c] = num_parse(text);
+    }
+    fixed_values[c] = num_parse_fixed(text, rs485_devices[d].decimals);
+  }
+  store_listened_values(d, sensor_values, fixed_values);
+}
+
+
+/*
+  Range polls. The master polls all devices with IDs from lo to hi with one
+  request:
+    ?ll:R<hh><ssss>|cccc
+    <lo> 'R' <hi> <slot>
+  Here, ll and hh are lo and hi as two hex digits, and ssss (16 bits, LSB
+  first in binary) is the length of a time slot, in microseconds. Each device
+  in the range with a value to send replies as to a poll, in the same format
+  as the request, in its own slot: the first slot starts the turnaround after
+  the end of the request, and device id has slot id-lo. Devices without a
+  value leave their slot empty. The master must make the slots long enough
+  for the longest reply, with some margin for clock differences.
+
+  Slotted discovery works the same, with type 'E' instead of 'R': all our
+  devices in the range reply in their slots, with a short presence reply
+  (see device_present()). With the range 0 to 127, the master enumerates the
+  whole bus in one round.
+
+  A node with several devices in the range queues the reply of the next one
+  when the previous one has gone out and the bus is released. The transmit
+  complete interrupt only flags that; the reply is built by the loop of
+  process_frames(), like all others, so that the transmit buffer and the
+  device state are only ever written from one place.
+*/
+static NODE_LOCAL uint8_t range_lo, range_hi, range_binary, range_type;
+/* The next ID to consider; past range_hi when no range poll is going on. */
+static NODE_LOCAL uint8_t range_next = 128;
+static NODE_LOCAL uint32_t range_start, range_slot;
+/* Set when range_continue() is to be called from process_frames(). */
+static NODE_LOCAL volatile uint8_t range_pending;
+
+
+/*
+  The presence reply being sent; it has no request buffer to be built in.
+*/
+static NODE_LOCAL uint8_t present_buf[10];
+
+/*
+  Presence reply to a slotted discovery:
+    !ii:E<dddd>|
+    <id|0x80> 'E' <dddd>
+  where dddd is the CRC of the discovery reply of the device (16 bits, MSB
+  first in binary). The master only needs to ask for the discovery reply if
+  it has none cached for the ID with that CRC.
+*/
+static void
+device_present(uint8_t id, uint8_t binary)
+{
+  uint8_t d = served_device(id);
+  uint8_t *buf = present_buf;
+  uint8_t body[6];
+  uint8_t idx;
+  uint16_t dcrc, crc;
+
+  if (d == NO_DEVICE)
+    return;
+  dcrc = served_devices[rs485_devices[d].served].discover_crc;
+  if (binary)
+  {
+    body[0] = id | 0x80;
+    body[1] = 'E';
+    body[2] = dcrc >> 8;
+    body[3] = dcrc & 0xff;
+    crc = crc16_buf(body, 4);
+    body[4] = crc >> 8;
+    body[5] = crc & 0xff;
+    send_binary_reply(buf, cobs_frame(body, 6, buf));
+    return;
+  }
+  idx = append_header_to_buf(buf, 0, id, 'E');
+  buf[idx++] = dec2hex(dcrc >> 12);
+  buf[idx++] = dec2hex((dcrc >> 8) & 0xf);
+  buf[idx++] = dec2hex((dcrc >> 4) & 0xf);
+  buf[idx++] = dec2hex(dcrc & 0xf);
+  buf[idx++] = '|';
+  send_reply(buf, idx, crc16_buf(buf, idx));
+}
+
+
+/*
+  Queue the reply of our next device in the current range poll or slotted
+  discovery, if any. Devices of a range poll with nothing to send are
+  polled all the same, without a reply. Called from process_frames() only.
+*/
+static void
+range_continue(void)
+{
+  uint8_t id;
+
+  while (range_next <= range_hi)
+  {
+    id = range_next++;
+    if (served_device(id) == NO_DEVICE)
+      continue;
+    reply_at = range_start + (uint32_t)(id - range_lo) * range_slot;
+    if (range_type != 'R')
+    {
+      device_present(id, range_binary);
+      return;
+    }
+    if (device_poll(id, range_binary))
+      return;
+  }
+}
+
+
+static void
+process_range(uint8_t type, uint8_t lo, uint8_t hi, uint16_t slot_us,
+              uint8_t binary)
+{
+  if (lo > hi || hi >= 128)
+    return;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    range_type = type;
+    range_lo = lo;
+    range_hi = hi;
+    range_next = lo;
+    range_binary = binary;
+    range_start = reply_at;
+    range_slot = (uint32_t)slot_us*BUS_TIMER_TICKS_PER_MS/1000;
+  }
+  range_continue();
+}
+
+
+/*
+  Process a request.
+  Request format:
+    ?ii:D|cccc                 # Discovery request
+    ?ii:P|cccc                 # Poll request
+    ?ii:C|cccc                 # Change request, see device_changed()
+    ?ii:A|cccc                 # Aggregate of samples, see device_aggregate()
+    ?ii:H|cccc                 # Last samples, see device_history()
+    ?ii:S|cccc                 # Bus statistics, see device_stats()
+    ?ll:R<hh><ssss>|cccc       # Range poll, see process_range()
+    ?ll:E<hh><ssss>|cccc       # Slotted discovery, likewise
+  Here, ii is two hex digits to identify the device. Only the device owning
+  that ID may reply.
+  cccc is the CRC16 (in hex) of the request up to and including the '|'.
+
+  The crc argument is the CRC of all but the last 4 chars, computed while the
+  request was received.
+*/
+static void
+process_req(uint8_t *req, uint8_t len, uint16_t calc_crc)
+{
+  uint16_t rcv_crc;
+  uint8_t rcv_id;
+
+  if (len < 10 || req[3] != ':')
+    return;
+  rcv_crc = ((uint16_t)hex2dec(req[len-4]) << 12) |
+    ((uint16_t)hex2dec(req[len-3]) << 8) |
+    ((uint16_t)hex2dec(req[len-2]) << 4) |
+    (uint16_t)hex2dec(req[len-1]);
+  if (calc_crc != rcv_crc)
+  {
+    ++bus_stats.crc_errors;
+    return;
+  }
+
+  if (req[0] == '!')
+  {
+    if (len > 10 && req[4] == 'P' && req[len-5] == '|')
+      process_response(req, len);
+    return;
+  }
+
+  rcv_id = (hex2dec(req[1]) << 4) | hex2dec(req[2]);
+  if (len == 16 && (req[4] == 'R' || req[4] == 'E') && req[11] == '|')
+  {
+    process_range(req[4], rcv_id, (hex2dec(req[5]) << 4) | hex2dec(req[6]),
+                  ((uint16_t)hex2dec(req[7]) << 12) |
+                  ((uint16_t)hex2dec(req[8]) << 8) |
+                  ((uint16_t)hex2dec(req[9]) << 4) |
+                  (uint16_t)hex2dec(req[10]), 0);
+    return;
+  }
+  if (len != 10 || req[5] != '|')
+    return;
+  switch (req[4])
+  {
+  case 'D':
+    device_discover(rcv_id, req);
+    break;
+  case 'P':
+    device_poll(rcv_id, 0);
+    break;
+  case 'C':
+    device_changed(rcv_id, 0, req);
+    break;
+  case 'S':
+    device_stats(rcv_id, 0, req);
+    break;
+#if SAMPLE_RINGS > 0
+  case 'A':
+    device_aggregate(rcv_id, 0, req);
+    break;
+  case 'H':
+    device_history(rcv_id, 0, req);
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+
+/*
+  Process a binary frame (see above). The crc argument is the CRC of all but
+  the last 2 bytes, computed while the frame was received.
+*/
+static void
+process_binary_req(uint8_t *req, uint8_t len, uint16_t calc_crc)
+{
+  if (len < 4)
+    return;
+  if (calc_crc != (((uint16_t)req[len-2] << 8) | req[len-1]))
+  {
+    ++bus_stats.crc_errors;
+    return;
+  }
+  if (req[0] & 0x80)
+  {
+    process_binary_response(req, len);
+    return;
+  }
+  if (len == 7 && (req[1] == 'R' || req[1] == 'E'))
+  {
+    process_range(req[1], req[0], req[2], req[3] | ((uint16_t)req[4] << 8),
+                  1);
+    return;
+  }
+  if (len != 4)
+    return;
+  switch (req[1])
+  {
+  case 'P':
+    device_poll(req[0], 1);
+    break;
+  case 'C':
+    device_changed(req[0], 1, req);
+    break;
+  case 'S':
+    device_stats(req[0], 1, req);
+    break;
+#if SAMPLE_RINGS > 0
+  case 'A':
+    device_aggregate(req[0], 1, req);
+    break;
+  case 'H':
+    device_history(req[0], 1, req);
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+
+/*
+  Receive buffers. Complete frames are queued here, so that the next frame
+  can be received into a free buffer while one is being processed.
+*/
+static NODE_LOCAL uint8_t rcv_bufs[RCV_BUFS][MAX_REQ];
+static NODE_LOCAL uint8_t rcv_lens[RCV_BUFS];
+static NODE_LOCAL uint16_t rcv_crcs[RCV_BUFS];
+static NODE_LOCAL uint32_t rcv_times[RCV_BUFS];
+static NODE_LOCAL uint8_t rcv_binary[RCV_BUFS];
+static NODE_LOCAL uint8_t rcv_head, rcv_count;
+/* Set while the queue is being processed. */
+static NODE_LOCAL uint8_t rcv_busy;
+/*
+  Set while the reply to the frame at the head of the queue is being sent
+  from its buffer; the buffer is freed, and the queue processed on, once
+  the reply has gone out.
+*/
+static NODE_LOCAL uint8_t rcv_held;
+/*
+  Bus timer at the start of the receive interrupt, or of its latest stretch
+  with interrupts disabled.
+*/
+static NODE_LOCAL uint16_t rcv_isr_start;
+/* Bus clock time of the last char received. */
+static NODE_LOCAL uint32_t rcv_last;
+#define RCV_IDLE_TICKS                                          \
+  ((RCV_IDLE_US > RCV_IDLE_CHARS*SERIAL_CHAR_US ?                 \
+    (uint32_t)RCV_IDLE_US : (uint32_t)RCV_IDLE_CHARS*SERIAL_CHAR_US) \
+   * BUS_TIMER_TICKS_PER_MS / 1000)
+
+/*
+  The frame being received (see Labibus_frame.h). The buffer is only taken
+  once the header (up to the request type) is in.
+*/
+static NODE_LOCAL struct frame_rx rcv_frame;
+static NODE_LOCAL uint8_t *rcv_buf;
+static NODE_LOCAL uint8_t rcv_hdr[FRAME_TEXT_HEADER];
+static NODE_LOCAL uint16_t rcv_crc;
+
+
+/* Note how long the receive interrupt has run with interrupts disabled. */
+static inline void
+note_isr_time(void)
+{
+  uint16_t t = bus_timer_now() - rcv_isr_start;
+
+  if (t > bus_stats.isr_max_ticks)
+    bus_stats.isr_max_ticks = t;
+}
+
+/*
+  Process the queued frames, and the next reply of a range poll, with
+  interrupts enabled, so that we do not block other interrupt processing,
+  nor reception of the next frame, while the reply is prepared.
+
+  Called from the receive and transmit complete interrupts with interrupts
+  disabled. Work that comes in while we are already processing is left for
+  the running loop, so that replies are only built here, one at a time.
+*/
+static void
+process_frames(void)
+{
+  uint8_t slot;
+
+  if (rcv_busy)
+    return;
+  rcv_busy = 1;
+  while (!rcv_held && (rcv_count > 0 || range_pending))
+  {
+    if (range_pending)
+    {
+      range_pending = 0;
+      sei();
+      range_continue();
+      cli();
+      rcv_isr_start = bus_timer_now();
+      continue;
+    }
+    slot = rcv_head;
+    reply_at = rcv_times[slot] + turnaround_ticks;
+    note_isr_time();
     sei();
-    process_req(rcv_buf, rcv_idx);
+    if (rcv_binary[slot])
+      process_binary_req(rcv_bufs[slot], rcv_lens[slot], rcv_crcs[slot]);
+    else
+      process_req(rcv_bufs[slot], rcv_lens[slot], rcv_crcs[slot]);
     cli();
-    serial_interrupt_rx_enable();
-    rcv_idx = 0;
+    rcv_isr_start = bus_timer_now();
+    if (tx_active && tx_data == rcv_bufs[slot])
+      rcv_held = 1;
+    else
+    {
+      rcv_head = (rcv_head + 1) % RCV_BUFS;
+      --rcv_count;
+    }
+  }
+  rcv_busy = 0;
+}
+
+
+/*
+  A reply has gone out: free the receive buffer it was sent from, if any,
+  and go on with our next device in the range poll, if any, and the frames
+  that came in meanwhile. Called from the transmit complete interrupt.
+*/
+static void
+reply_sent(void)
+{
+  if (rcv_held)
+  {
+    rcv_held = 0;
+    rcv_head = (rcv_head + 1) % RCV_BUFS;
+    --rcv_count;
+  }
+  if (range_next <= range_hi)
+    range_pending = 1;
+  process_frames();
+}
+
+
+/* Queue the frame just received for processing. */
+static void
+queue_frame(uint8_t binary)
+{
+  uint8_t slot = (rcv_head + rcv_count) % RCV_BUFS;
+
+  rcv_lens[slot] = rcv_frame.len;
+  rcv_crcs[slot] = rcv_crc;
+  rcv_times[slot] = rcv_last;
+  rcv_binary[slot] = binary;
+  ++rcv_count;
+  process_frames();
+}
+
+
+/*
+  Is a frame with this header of interest to us? Range polls and slotted
+  discovery are for all devices in the range, so they go to every node;
+  process_range() sorts them out.
+*/
+static uint8_t
+frame_wanted(uint8_t id, uint8_t listen, uint8_t type)
+{
+  if (!listen && (type == 'R' || type == 'E'))
+    return num_devices > 0;
+  return lookup_device(id, listen) != NO_DEVICE;
+}
+
+
+/*
+  Store one char of the frame being received (after COBS decoding, for a
+  binary frame), the last of rcv_frame.len so far.
+
+  As soon as the header (device ID and type) is in, frames that are of no
+  interest to us (requests for other devices, responses from devices we do
+  not listen to) are dropped, and the rest of them skipped.
+
+  The CRC is computed on the fly, lagging behind by the size of the CRC
+  itself, so that at the end of the frame it covers everything else.
+*/
+static void
+store_received_char(uint8_t c, uint8_t events)
+{
+  uint8_t binary = (rcv_frame.mode == FRAME_RX_BINARY);
+  uint8_t hdr_len = binary ? FRAME_BIN_HEADER : FRAME_TEXT_HEADER;
+  uint8_t lag = binary ? 2 : 4;
+  uint8_t idx = rcv_frame.len - 1;
+  uint8_t id, listen, type, i;
+
+  if (idx < hdr_len)
+  {
+    rcv_hdr[idx] = c;
+    if (!(events & FRAME_HEADER))
+      return;
+    if (binary)
+    {
+      id = rcv_hdr[0] & 0x7f;
+      listen = (rcv_hdr[0] & 0x80) != 0;
+      type = rcv_hdr[1];
+    }
+    else
+    {
+      id = (hex2dec(rcv_hdr[1]) << 4) | hex2dec(rcv_hdr[2]);
+      listen = rcv_hdr[0] != '?';
+      type = rcv_hdr[4];
+    }
+    ++bus_stats.frames;
+    if (!frame_wanted(id, listen, type))
+    {
+      frame_rx_skip(&rcv_frame);
+      return;
+    }
+    ++bus_stats.addressed;
+    if (rcv_count >= RCV_BUFS)
+    {
+      ++bus_stats.dropped;
+      frame_rx_skip(&rcv_frame);
+    }
+    else
+    {
+      rcv_buf = rcv_bufs[(rcv_head + rcv_count) % RCV_BUFS];
+      memcpy(rcv_buf, rcv_hdr, hdr_len);
+      /* Catch up with the CRC of the header. */
+      for (i = 0; i + lag < hdr_len; ++i)
+        rcv_crc = crc16(rcv_buf[i], rcv_crc);
+    }
     return;
   }
   /* Save the received byte in the buffer for later processing. */
-  rcv_buf[rcv_idx++] = c;
+  rcv_buf[idx] = c;
+  if (rcv_frame.len > lag)
+    rcv_crc = crc16(rcv_buf[idx-lag], rcv_crc);
 }
 
-#if defined(__AVR_ATmega32U4__)
-ISR(USART1_RX_vect)
-#else
-ISR(USART_RX_vect)
-#endif
+
+/*
+  Receive one char from the bus, and take the frames in it (see
+  Labibus_frame.h).
+
+  A frame is abandoned as soon as a char arrives with a receive error (or
+  after one that was lost), rather than when its CRC fails at the end, and
+  when the line has been idle for RCV_IDLE_US in the middle of it.
+*/
+static void
+process_received_char(uint8_t c, uint8_t errors, uint32_t now)
 {
-  uint8_t c;
+  uint8_t events, ch;
+
+  if (now - rcv_last > RCV_IDLE_TICKS && frame_rx_abort(&rcv_frame, 1))
+    ++bus_stats.aborted;
+  rcv_last = now;
+  if (errors)
+    /* A break reads as a zero byte with a framing error. */
+    events = frame_rx_abort(&rcv_frame, c == 0 && (errors & SERIAL_FE));
+  else
+    events = frame_rx_byte(&rcv_frame, c, &ch);
+
+  if (events & FRAME_ABORTED)
+    ++bus_stats.aborted;
+  if (events & FRAME_STARTED)
+    rcv_crc = 0;
+  if (events & FRAME_TOO_LONG)
+    ++bus_stats.too_long;
+  if (events & FRAME_CHAR)
+    store_received_char(ch, events);
+  /* Binary frames end with a zero, text frames with LF. */
+  if (events & FRAME_COMPLETE)
+    queue_frame(c == 0);
+}
 
+ISR(SERIAL_RX_vect)
+{
+  uint32_t now = bus_clock_now();
+  uint8_t errors, c;
+
+  rcv_isr_start = (uint16_t)now;
+  /* The error flags are those of the char about to be read. */
+  errors = serial_read_errors();
   c = serial_read();
-  process_received_char(c);
+  if (errors & SERIAL_FE)
+    ++bus_stats.framing_errors;
+  if (errors & SERIAL_DOR)
+    ++bus_stats.data_overruns;
+  process_received_char(c, errors, now);
+  note_isr_time();
 }
 
 
@@ -603,167 +1812,606 @@ static void init_on_first_call()
 {
   /* Setup the serial port and interrupt on the first call. */
   setup_serial();
+  setup_bus_timer();
 
   setup_rs485_pins();
   rs485_receive_mode();
 }
 
 
-void
-labibus_init(uint8_t device_id, uint16_t poll_interval,
-             const char *description, const char *unit)
+/* The deadband scaled to fixed-point with the given decimals, rounded. */
+static int32_t
+scale_deadband(float deadband, uint8_t decimals)
 {
-  uint8_t i;
+  float d = deadband * (float)pgm_read_dword(&num_pow10[decimals]);
 
-  if (!description)
-    return;
+  if (!(d > 0.0f))
+    return 0;
+  if (d >= 2147483647.0f)
+    return INT32_MAX;
+  return (int32_t)(d + 0.5f);
+}
+
+
+static void
+init_channels(uint8_t device_id, uint16_t poll_interval, uint8_t channels,
+              const char * const *descriptions, const char * const *units,
+              uint8_t progmem, uint8_t decimals, float deadband)
+{
+  uint8_t d, s, row, c;
+  uint8_t buf[MAX_REQ];
+
+  for (c = 0; c < channels; ++c)
+    if (!descriptions[c] || !units[c])
+      return;
   /* Disable interrupts while changing the device table. */
   cli();
-  for (i = 0; i < MAX_DEVICES; ++i)
+  d = assign_device(device_id, 0, channels);
+  if (d != NO_DEVICE)
   {
-    if ((!rs485_devices[i].description && !rs485_devices[i].listen) ||
-        rs485_devices[i].device_id == device_id)
+    s = rs485_devices[d].served;
+    row = served_devices[s].row;
+    rs485_devices[d].have_value = 0;
+    rs485_devices[d].decimals =
+      decimals > NUM_MAX_DECIMALS ? NUM_MAX_DECIMALS : decimals;
+    served_devices[s].poll_len = 0;
+    served_devices[s].poll_interval = poll_interval;
+    served_devices[s].deadband = deadband;
+    served_devices[s].deadband_fixed =
+      scale_deadband(deadband, rs485_devices[d].decimals);
+    served_devices[s].value_kind = VALUE_NONE;
+    served_devices[s].reported_kind = VALUE_NONE;
+    served_devices[s].changed = 0;
+    served_devices[s].progmem = progmem;
+    served_devices[s].polled = 0;
+    served_devices[s].polls_seen = 0;
+    for (c = 0; c < channels; ++c)
     {
-      rs485_devices[i].sensor_value = 0.0f;
-      rs485_devices[i].poll_interval = poll_interval;
-      rs485_devices[i].description = description;
-      rs485_devices[i].unit = unit;
-      rs485_devices[i].device_id = device_id;
-      rs485_devices[i].have_value = 0;
-      rs485_devices[i].listen = 0;
-      break;
+      served_texts[row+c].description = descriptions[c];
+      served_texts[row+c].unit = units[c];
     }
+    served_devices[s].discover_crc = crc16_buf(buf, encode_discover(s, buf));
   }
 
-  if (i == 0)
+  if (d == 0)
     init_on_first_call();
   sei();
 }
 
 
 void
-labibus_set_sensor_value(uint8_t device_id, float value)
+labibus_init_channels(uint8_t device_id, uint16_t poll_interval,
+                      uint8_t channels, const char * const *descriptions,
+                      const char * const *units, uint8_t decimals,
+                      float deadband)
+{
+  init_channels(device_id, poll_interval, channels, descriptions, units, 0,
+                decimals, deadband);
+}
+
+
+void
+labibus_init_channels_P(uint8_t device_id, uint16_t poll_interval,
+                        uint8_t channels, const char * const *descriptions,
+                        const char * const *units, uint8_t decimals,
+                        float deadband)
+{
+  init_channels(device_id, poll_interval, channels, descriptions, units, 1,
+                decimals, deadband);
+}
+
+
+void
+labibus_init(uint8_t device_id, uint16_t poll_interval,
+             const char *description, const char *unit, uint8_t decimals,
+             float deadband)
+{
+  init_channels(device_id, poll_interval, 1, &description, &unit, 0,
+                decimals, deadband);
+}
+
+
+void
+labibus_init_P(uint8_t device_id, uint16_t poll_interval,
+               const char *description, const char *unit, uint8_t decimals,
+               float deadband)
+{
+  init_channels(device_id, poll_interval, 1, &description, &unit, 1,
+                decimals, deadband);
+}
+
+
+void
+labibus_set_turnaround(uint16_t microseconds)
+{
+  uint32_t ticks = (uint32_t)microseconds*BUS_TIMER_TICKS_PER_MS/1000;
+
+  if (ticks > MAX_TURNAROUND_TICKS)
+    ticks = MAX_TURNAROUND_TICKS;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    turnaround_ticks = ticks;
+  }
+}
+
+
+/*
+  Have the values set for the device d moved past the deadband from those in
+  its last poll reply? Must be called with interrupts disabled.
+*/
+static uint8_t
+past_deadband(uint8_t d)
 {
-  uint8_t i;
-  for (i = 0; i < MAX_DEVICES; ++i)
+  uint8_t s = rs485_devices[d].served;
+  uint8_t slot = rs485_devices[d].slot;
+  uint8_t c;
+  uint32_t diff;
+  float delta;
+
+  if (served_devices[s].reported_kind != served_devices[s].value_kind)
+    return 1;
+  for (c = slot; c < slot + rs485_devices[d].channels; ++c)
   {
-    if (!rs485_devices[i].description)
-      continue;
-    if (rs485_devices[i].device_id != device_id)
-      continue;
-    /* Protect agains read/update race on float value. */
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    if (served_devices[s].value_kind == VALUE_FLOAT)
     {
-      rs485_devices[i].sensor_value = value;
+      delta = rs485_channels[c].sensor_value -
+        rs485_channels[c].reported_value;
+      /* Written so that nan counts as changed. */
+      if (!(delta <= served_devices[s].deadband &&
+            -delta <= served_devices[s].deadband))
+        return 1;
+    }
+    else
+    {
+      /* The difference of two int32 always fits in a uint32. */
+      if (rs485_channels[c].sensor_fixed > rs485_channels[c].reported_fixed)
+        diff = (uint32_t)rs485_channels[c].sensor_fixed -
+          (uint32_t)rs485_channels[c].reported_fixed;
+      else
+        diff = (uint32_t)rs485_channels[c].reported_fixed -
+          (uint32_t)rs485_channels[c].sensor_fixed;
+      if (diff > (uint32_t)served_devices[s].deadband_fixed)
+        return 1;
     }
-    rs485_devices[i].have_value = 1;
-    return;
   }
+  return 0;
 }
 
-void
-labibus_wait_for_poll(uint8_t device_id)
+
+/*
+  Install the encoded poll replies of the device d, with the values they
+  hold (either values or fixed_values, the other is NULL). Atomically, so
+  that a poll never sees a partial frame; and once the last poll reply of
+  the device, which is sent straight from its frames, has gone out.
+*/
+static void
+install_poll_frames(uint8_t d, const uint8_t *frame, uint8_t len,
+                    const uint8_t *bin_frame, uint8_t bin_len,
+                    const float *values, const int32_t *fixed_values)
 {
-  uint8_t i;
+  uint8_t s = rs485_devices[d].served;
+  uint8_t row = served_devices[s].row;
+  uint8_t slot = rs485_devices[d].slot;
+  uint16_t crc = crc16_buf(frame, len);
+  uint8_t c;
 
-  for (i = 0; i < MAX_DEVICES; ++i)
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    if (!rs485_devices[i].description)
-      continue;
-    if (rs485_devices[i].device_id == device_id)
+    while (tx_active &&
+           (tx_data == poll_frames[row] || tx_data == bin_frames[row]))
     {
-      NONATOMIC_BLOCK(NONATOMIC_RESTORESTATE)
+      NONATOMIC_BLOCK(NONATOMIC_FORCEOFF)
       {
-        while (rs485_devices[i].have_value)
-          ;
+        cpu_relax();
       }
     }
+    memcpy(poll_frames[row], frame, len);
+    memcpy(bin_frames[row], bin_frame, bin_len);
+    served_devices[s].poll_len = len;
+    served_devices[s].poll_crc = crc;
+    served_devices[s].bin_len = bin_len;
+    rs485_devices[d].have_value = 1;
+    for (c = 0; c < rs485_devices[d].channels; ++c)
+    {
+      if (values)
+        rs485_channels[slot+c].sensor_value = values[c];
+      else
+        rs485_channels[slot+c].sensor_fixed = fixed_values[c];
+    }
+    served_devices[s].value_kind = values ? VALUE_FLOAT : VALUE_FIXED;
+    served_devices[s].changed = past_deadband(d);
   }
 }
 
 
-bool
-labibus_check_for_poll(uint8_t device_id)
+/* Set the values of all channels of our device d. */
+static void
+set_sensor_values(uint8_t d, const float *values)
+{
+  uint8_t id = rs485_devices[d].device_id;
+  uint8_t n = rs485_devices[d].channels;
+  uint8_t len, bin_len;
+  uint8_t frame[MAX_CHANNELS*POLL_FRAME_SIZE];
+  uint8_t bin_frame[MAX_CHANNELS*BIN_POLL_FRAME_SIZE];
+
+  /*
+    Encode the reply now, so that it is ready to go out as soon as the poll
+    arrives.
+  */
+  len = encode_poll(id, values, n, frame);
+  bin_len = encode_binary_poll(id, values, n, bin_frame);
+  install_poll_frames(d, frame, len, bin_frame, bin_len, values, NULL);
+}
+
+
+/* Set the fixed-point values of all channels of our device d. */
+static void
+set_sensor_values_i32(uint8_t d, const int32_t *values)
+{
+  uint8_t id = rs485_devices[d].device_id;
+  uint8_t n = rs485_devices[d].channels;
+  uint8_t decimals = rs485_devices[d].decimals;
+  uint8_t len, bin_len;
+  uint8_t frame[MAX_CHANNELS*POLL_FRAME_SIZE];
+  uint8_t bin_frame[MAX_CHANNELS*BIN_POLL_FRAME_SIZE];
+
+  len = encode_poll_fixed(id, values, n, decimals, frame);
+  bin_len = encode_binary_poll_fixed(id, values, n, decimals, bin_frame);
+  install_poll_frames(d, frame, len, bin_frame, bin_len, NULL, values);
+}
+
+
+/* One of our devices with a single channel. */
+static uint8_t
+single_channel_device(uint8_t device_id)
+{
+  uint8_t d = served_device(device_id);
+
+  if (d != NO_DEVICE && rs485_devices[d].channels != 1)
+    return NO_DEVICE;
+  return d;
+}
+
+
+void
+labibus_set_sensor_value(uint8_t device_id, float value)
+{
+  uint8_t d = single_channel_device(device_id);
+
+  if (d != NO_DEVICE)
+    set_sensor_values(d, &value);
+}
+
+
+void
+labibus_set_sensor_value_i32(uint8_t device_id, int32_t value)
+{
+  uint8_t d = single_channel_device(device_id);
+
+  if (d != NO_DEVICE)
+    set_sensor_values_i32(d, &value);
+}
+
+
+void
+labibus_set_sensor_value_i16(uint8_t device_id, int16_t value)
+{
+  labibus_set_sensor_value_i32(device_id, value);
+}
+
+
+void
+labibus_set_sensor_values(uint8_t device_id, const float *values)
+{
+  uint8_t d = served_device(device_id);
+
+  if (d != NO_DEVICE)
+    set_sensor_values(d, values);
+}
+
+
+void
+labibus_set_sensor_values_i32(uint8_t device_id, const int32_t *values)
+{
+  uint8_t d = served_device(device_id);
+
+  if (d != NO_DEVICE)
+    set_sensor_values_i32(d, values);
+}
+
+
+void
+labibus_enable_samples(uint8_t device_id)
 {
-  uint8_t i;
+#if SAMPLE_RINGS > 0
+  uint8_t d = single_channel_device(device_id);
+  uint8_t s;
 
-  for (i = 0; i < MAX_DEVICES; ++i)
+  if (d == NO_DEVICE)
+    return;
+  s = rs485_devices[d].served;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    if (!rs485_devices[i].description)
-      continue;
-    if (rs485_devices[i].device_id == device_id)
-      return rs485_devices[i].have_value ? false : true;
+    if (!served_devices[s].sample_ring && num_sample_rings < SAMPLE_RINGS)
+    {
+      sample_rings[num_sample_rings].head = 0;
+      sample_rings[num_sample_rings].count = 0;
+      sample_rings[num_sample_rings].agg_count = 0;
+      served_devices[s].sample_ring = ++num_sample_rings;
+    }
+  }
+#else
+  (void)device_id;
+#endif
+}
+
+
+void
+labibus_add_sample(uint8_t device_id, float value)
+{
+#if SAMPLE_RINGS > 0
+  uint8_t r = find_sample_ring(device_id);
+  uint8_t h;
+
+  if (r == NO_DEVICE)
+    return;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    h = sample_rings[r].head++ & (SAMPLE_RING_SIZE-1);
+    sample_rings[r].values[h] = value;
+    sample_rings[r].times[h] = bus_clock_now();
+    if (sample_rings[r].count < SAMPLE_RING_SIZE)
+      ++sample_rings[r].count;
+    /* The aggregate stops at 65535 samples, rather than wrap. */
+    if (sample_rings[r].agg_count == 0)
+    {
+      sample_rings[r].agg_min = value;
+      sample_rings[r].agg_max = value;
+      sample_rings[r].agg_sum = value;
+      sample_rings[r].agg_count = 1;
+    }
+    else if (sample_rings[r].agg_count < 0xffff)
+    {
+      if (value < sample_rings[r].agg_min)
+        sample_rings[r].agg_min = value;
+      if (value > sample_rings[r].agg_max)
+        sample_rings[r].agg_max = value;
+      sample_rings[r].agg_sum += value;
+      ++sample_rings[r].agg_count;
+    }
+  }
+#else
+  (void)device_id;
+  (void)value;
+#endif
+}
+
+
+void
+labibus_wait_for_poll(uint8_t device_id)
+{
+  uint8_t d = served_device(device_id);
+
+  if (d == NO_DEVICE)
+    return;
+  NONATOMIC_BLOCK(NONATOMIC_RESTORESTATE)
+  {
+    while (rs485_devices[d].have_value)
+      cpu_relax();
+  }
+}
+
+
+void
+labibus_set_poll_callback(labibus_poll_callback callback)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    poll_callback = callback;
+  }
+}
+
+
+uint16_t
+labibus_time_to_poll(uint8_t device_id)
+{
+  uint8_t d = served_device(device_id);
+  uint8_t s;
+  uint32_t early, next;
+  int32_t left;
+
+  if (d == NO_DEVICE)
+    return 0;
+  s = rs485_devices[d].served;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    /* The next poll is unlikely to come more than two deviations early. */
+    early = 2 * (uint32_t)served_devices[s].poll_dev;
+    next = served_devices[s].poll_period > early ?
+      (uint32_t)(served_devices[s].poll_period - early) << POLL_TIME_SHIFT :
+      0;
+    left = served_devices[s].last_poll + next - bus_clock_now();
+    if (served_devices[s].polls_seen < 2)
+      left = 0;
   }
-  return true;
+  if (left <= 0)
+    return 0;
+  left /= BUS_TIMER_TICKS_PER_MS;
+  return left > 0xffff ? 0xffff : left;
+}
+
+
+bool
+labibus_check_for_poll(uint8_t device_id)
+{
+  uint8_t d = served_device(device_id);
+
+  if (d == NO_DEVICE)
+    return true;
+  return rs485_devices[d].have_value ? false : true;
 }
 
 
 void
-labibus_listen(uint8_t device_id)
+labibus_listen_channels(uint8_t device_id, uint8_t channels, uint8_t decimals)
 {
-  uint8_t i;
+  uint8_t d, slot, c;
 
   /* Disable interrupts while changing the device table. */
   cli();
-  for (i = 0; i < MAX_DEVICES; ++i)
+  d = assign_device(device_id, 1, channels);
+  if (d != NO_DEVICE)
   {
-    if ((!rs485_devices[i].description && !rs485_devices[i].listen) ||
-        rs485_devices[i].device_id == device_id)
+    rs485_devices[d].decimals =
+      decimals > NUM_MAX_DECIMALS ? NUM_MAX_DECIMALS : decimals;
+    rs485_devices[d].have_value = 0;
+    slot = rs485_devices[d].slot;
+    for (c = slot; c < slot + channels; ++c)
     {
-      rs485_devices[i].sensor_value = -1.0f;
-      rs485_devices[i].poll_interval = 0;
-      rs485_devices[i].description = NULL;
-      rs485_devices[i].unit = NULL;
-      rs485_devices[i].device_id = device_id;
-      rs485_devices[i].have_value = 0;
-      rs485_devices[i].listen = 1;
-      break;
+      rs485_channels[c].sensor_value = -1.0f;
+      rs485_channels[c].fixed_value = -1;
     }
   }
 
-  if (i == 0)
+  if (d == 0)
     init_on_first_call();
   sei();
 }
 
 
-bool
-labibus_check_data(uint8_t device_id)
+void
+labibus_listen(uint8_t device_id, uint8_t decimals)
+{
+  labibus_listen_channels(device_id, 1, decimals);
+}
+
+
+uint16_t
+labibus_get_dropped_frames(void)
 {
-  uint8_t i;
+  uint16_t dropped;
 
-  for (i = 0; i < MAX_DEVICES; ++i)
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    if (!rs485_devices[i].listen)
-      continue;
-    if (rs485_devices[i].device_id == device_id)
-      return rs485_devices[i].have_value ? true : false;
+    dropped = bus_stats.dropped;
+  }
+  return dropped;
+}
+
+
+void
+labibus_get_stats(struct labibus_stats *stats)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    *stats = bus_stats;
+  }
+}
+
+
+void
+labibus_clear_stats(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    memset(&bus_stats, 0, sizeof(bus_stats));
   }
-  return false;
+}
+
+
+bool
+labibus_check_data(uint8_t device_id)
+{
+  uint8_t d = listened_device(device_id);
+
+  if (d == NO_DEVICE)
+    return false;
+  return rs485_devices[d].have_value ? true : false;
 }
 
 
 float
 labibus_get_data(uint8_t device_id)
 {
-  uint8_t i;
+  uint8_t d = listened_device(device_id);
+  float sensor_value;
 
-  for (i = 0; i < MAX_DEVICES; ++i)
+  if (d == NO_DEVICE)
+    return -1.0f;
+  /* Protect agains read/update race on float value and flags. */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    if (!rs485_devices[i].listen)
-      continue;
-    if (rs485_devices[i].device_id == device_id)
-    {
-      float sensor_value;
+    sensor_value = rs485_channels[rs485_devices[d].slot].sensor_value;
+    rs485_devices[d].have_value = 0;
+  }
+  return sensor_value;
+}
 
-      rs485_devices[i].have_value = 0;
-      /* Protect agains read/update race on float value. */
-      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-      {
-        sensor_value = rs485_devices[i].sensor_value;
-      }
-      return sensor_value;
-    }
+
+int32_t
+labibus_get_data_i32(uint8_t device_id)
+{
+  uint8_t d = listened_device(device_id);
+  int32_t fixed_value;
+
+  if (d == NO_DEVICE)
+    return -1;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    fixed_value = rs485_channels[rs485_devices[d].slot].fixed_value;
+    rs485_devices[d].have_value = 0;
+  }
+  return fixed_value;
+}
+
+
+int16_t
+labibus_get_data_i16(uint8_t device_id)
+{
+  int32_t v = labibus_get_data_i32(device_id);
+
+  if (v > INT16_MAX)
+    return INT16_MAX;
+  if (v < INT16_MIN)
+    return INT16_MIN;
+  return v;
+}
+
+
+uint8_t
+labibus_get_data_channels(uint8_t device_id, float *values)
+{
+  uint8_t d = listened_device(device_id);
+  uint8_t c, n;
+
+  if (d == NO_DEVICE)
+    return 0;
+  n = rs485_devices[d].channels;
+  /* All from the same reply. */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    for (c = 0; c < n; ++c)
+      values[c] = rs485_channels[rs485_devices[d].slot + c].sensor_value;
+    rs485_devices[d].have_value = 0;
+  }
+  return n;
+}
+
+
+uint8_t
+labibus_get_data_channels_i32(uint8_t device_id, int32_t *values)
+{
+  uint8_t d = listened_device(device_id);
+  uint8_t c, n;
+
+  if (d == NO_DEVICE)
+    return 0;
+  n = rs485_devices[d].channels;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    for (c = 0; c < n; ++c)
+      values[c] = rs485_channels[rs485_devices[d].slot + c].fixed_value;
+    rs485_devices[d].have_value = 0;
   }
-  return -1.0f;
+  return n;
 }
@@ -1,18 +1,115 @@
+#ifndef LABIBUS_H
+#define LABIBUS_H
+
 #include <stdint.h>
 
 /*
   Arduino library for Labisense RS485 network.
+
+  The library uses the USART (USART1 on ATmega32U4) and Timer1.
 */
 
 #define PIN_DE 7
 #define PIN_RE 6
 /* RO er 0, DI er 1. */
 
+/*
+  RAM is sized at compile time; each of these can also be given on the
+  compiler command line (-DMAX_DEVICES=...).
+
+  Number of devices (served and listened to) per node, at most 127; each
+  channel of a device also takes one of them (see MAX_CHANNELS). 13 bytes
+  each.
+*/
+#ifndef MAX_DEVICES
 #define MAX_DEVICES 10
+#endif
+/*
+  Number of our own devices (see labibus_init()), and of their channels all
+  together: 28 bytes per device, and 40 per channel, mostly for its poll
+  replies, which are kept ready to send.
+*/
+#ifndef MAX_SERVED_DEVICES
+#define MAX_SERVED_DEVICES 2
+#endif
+#ifndef MAX_SERVED_CHANNELS
+#define MAX_SERVED_CHANNELS 4
+#endif
+/*
+  Set to 1 to look devices up by ID in constant time, with an index of 128
+  bytes, rather than by going through the device table, which takes a few
+  microseconds per device for each frame on the bus.
+*/
+#ifndef ID_INDEX
+#define ID_INDEX 0
+#endif
 
 #define MAX_DESCRIPTION 140
 #define MAX_UNIT 20
 #define MAX_REQ (20+MAX_DESCRIPTION+MAX_UNIT)
+/*
+  Decimals of the values in text poll replies, at most 6. Only the first 7
+  significant digits carry information; the rest are padded with zeros.
+*/
+#define VALUE_DECIMALS 6
+/*
+  Space for the pre-encoded poll reply of each device. Values longer than
+  POLL_FRAME_SIZE-6 chars in fixed notation are sent in exponential notation.
+*/
+#define POLL_FRAME_SIZE 24
+/*
+  Maximum number of channels of one device (see labibus_init_channels()).
+  Each channel takes one of the MAX_DEVICES slots, and for our own devices
+  one of the MAX_SERVED_CHANNELS. A poll reply with all channel values, and
+  the discovery reply with all descriptions and units, must fit in MAX_REQ.
+*/
+#define MAX_CHANNELS 6
+
+/*
+  Sample rings, for devices that sample faster than they are polled (see
+  labibus_enable_samples()). SAMPLE_RINGS is the number of devices that can
+  have one, SAMPLE_RING_SIZE the number of samples kept in each, a power of
+  two, at most 16. Each ring takes 8*SAMPLE_RING_SIZE+16 bytes of RAM, so
+  the feature is off by default: with 0, the rings and the aggregate and
+  history requests are left out. Can also be given on the compiler command
+  line (-DSAMPLE_RINGS=...).
+*/
+#ifndef SAMPLE_RINGS
+#define SAMPLE_RINGS 0
+#endif
+#define SAMPLE_RING_SIZE 8
+
+/*
+  Number of receive buffers (each MAX_REQ bytes). With two, the next frame is
+  received while the previous one is processed; with one, a frame that comes
+  in before the previous one has been processed is dropped (see
+  labibus_get_dropped_frames()). A reply to a request is sent straight from
+  the request's buffer, which stays taken until it is sent.
+*/
+#ifndef RCV_BUFS
+#define RCV_BUFS 1
+#endif
+
+/*
+  Bus baud rate, 8N1. The UART divider is picked at compile time from F_CPU
+  (see Labibus_hal.h); a rate the clock can't make within 2.5% is an error.
+  With a 16MHz crystal, 250000, 500000 and 1000000 are exact, while 115200 is
+  2.1% off. At 1000000 there are only 160 CPU cycles per received char, so
+  keep the loop's interrupt-disabled sections short. Can also be given on the
+  compiler command line (-DLABIBUS_BAUD=...).
+*/
+#ifndef LABIBUS_BAUD
+#define LABIBUS_BAUD 115200
+#endif
+
+/*
+  Receive idle timeout, in microseconds, and at least RCV_IDLE_CHARS char
+  times at the baud rate. A frame that has had no char for this long is
+  abandoned, so that the rest of a broken frame is not taken for part of the
+  next one. Must be longer than any pause the master makes within a frame.
+*/
+#define RCV_IDLE_US 500
+#define RCV_IDLE_CHARS 3
 
 
 /*
@@ -32,9 +129,88 @@
   Once configured, a serial receive interrupt will listen for requests from
   the master, and reply with latest data set with labibus_set_sensor_value(),
   if any.
+
+  The decimals (at most 9) give the scale of values set with the integer
+  functions labibus_set_sensor_value_i16() and _i32(): the value sent is the
+  integer times 10^-decimals. For example, with 2 decimals, a temperature is
+  set in centi-degrees.
+
+  The deadband is for report-by-exception: the device counts as changed only
+  once its value has moved more than the deadband away from the value in the
+  last poll reply (with 0, any different value counts). The master can then
+  ask a node which of its devices changed, with a single request to any of
+  them:
+    ?ii:C|cccc -> !ii:C<jj><kk>...|cccc
+  where jj, kk... are the IDs (two hex digits each) of the changed devices,
+  none if nothing changed; and only poll those.
 */
 extern void labibus_init(uint8_t device_id, uint16_t poll_interval,
-                         const char *description, const char *unit);
+                         const char *description, const char *unit,
+                         uint8_t decimals = 0, float deadband = 0.0f);
+
+/*
+  Configure a new device with several channels (2 to MAX_CHANNELS), such as
+  the temperature and humidity of one sensor. The master gets all channel
+  values in a single poll reply. Otherwise like labibus_init(), with one
+  description and one unit per channel, from the given arrays; the arrays
+  themselves need not stay valid after the call, but the strings must.
+  The discovery reply lists all descriptions and units, so keep them short.
+  The device counts as changed when any channel moves past the deadband.
+
+  Set the values with labibus_set_sensor_values() or _values_i32(); the
+  single value functions are ignored for a multi-channel device.
+*/
+extern void labibus_init_channels(uint8_t device_id, uint16_t poll_interval,
+                                  uint8_t channels,
+                                  const char * const *descriptions,
+                                  const char * const *units,
+                                  uint8_t decimals = 0,
+                                  float deadband = 0.0f);
+
+/*
+  Like labibus_init() and labibus_init_channels(), but with the descriptions
+  and units in flash (PROGMEM), where they are read from when the master asks
+  for them, so that they take no RAM. For labibus_init_channels_P(), the
+  arrays of pointers are in RAM, and need not stay valid after the call.
+  On Arduino, labibus_init() also takes F("...") strings.
+*/
+extern void labibus_init_P(uint8_t device_id, uint16_t poll_interval,
+                           const char *description, const char *unit,
+                           uint8_t decimals = 0, float deadband = 0.0f);
+extern void labibus_init_channels_P(uint8_t device_id,
+                                    uint16_t poll_interval, uint8_t channels,
+                                    const char * const *descriptions,
+                                    const char * const *units,
+                                    uint8_t decimals = 0,
+                                    float deadband = 0.0f);
+
+#ifdef ARDUINO
+class __FlashStringHelper;
+
+static inline void
+labibus_init(uint8_t device_id, uint16_t poll_interval,
+             const __FlashStringHelper *description,
+             const __FlashStringHelper *unit, uint8_t decimals = 0,
+             float deadband = 0.0f)
+{
+  labibus_init_P(device_id, poll_interval, (const char *)description,
+                 (const char *)unit, decimals, deadband);
+}
+#endif
+
+
+/*
+  Set the bus turnaround time, in microseconds. This is how long after the
+  end of a request from the master a reply is started, to give the master
+  time to switch its RS485 transceiver into receive mode. The default is
+  1000 microseconds. The maximum is 32767 timer ticks (16 milliseconds at
+  F_CPU=16MHz).
+
+  The delay is timed by the bus timer (Timer1), so the CPU is free to do other
+  work while a reply is waiting to be sent. The turnaround applies to all
+  devices configured with labibus_init(), as they share the same bus.
+*/
+extern void labibus_set_turnaround(uint16_t microseconds);
 
 
 /*
@@ -47,9 +223,56 @@ extern void labibus_init(uint8_t device_id, uint16_t poll_interval,
   used when the master request the value. If it is called less often than the
   poll interval, then polls will be skipped (at most one value will be sent
   per call to labibus_set_sensor_value()).
+
+  Poll replies are sent straight from where the value is kept, so if the
+  last one of the device is still waiting for its turn or going out, this
+  waits for it (with interrupts enabled).
 */
 extern void labibus_set_sensor_value(uint8_t device_id, float value);
 
+/*
+  Supply a sensor value as a fixed-point number, scaled by the decimals given
+  to labibus_init(). Otherwise like labibus_set_sensor_value(), but the reply
+  is encoded straight from the integer, without any floating point.
+*/
+extern void labibus_set_sensor_value_i16(uint8_t device_id, int16_t value);
+extern void labibus_set_sensor_value_i32(uint8_t device_id, int32_t value);
+
+/*
+  Supply the values of all channels of a device configured with
+  labibus_init_channels(), one per channel. They are sent together on the
+  next poll.
+*/
+extern void labibus_set_sensor_values(uint8_t device_id, const float *values);
+extern void labibus_set_sensor_values_i32(uint8_t device_id,
+                                          const int32_t *values);
+
+/*
+  Give a single-channel device a sample ring, so that it can take samples
+  with labibus_add_sample() faster than the master polls. Does nothing if
+  all SAMPLE_RINGS are taken, or if SAMPLE_RINGS is 0.
+
+  Besides the usual poll, the master can then ask for:
+    ?ii:A|cccc -> !ii:A<count>|<min>|<max>|<mean>|cccc
+      The number, minimum, maximum and mean of the samples added since the
+      last such request (just "!ii:A0|" if there were none).
+    ?ii:H|cccc -> !ii:H<age>|<value>|<age>|<value>|...|cccc
+      The last samples (at most SAMPLE_RING_SIZE, as many as fit in one
+      reply), oldest first, each with its age in milliseconds when the reply
+      was made.
+  The samples are independent of the value set with labibus_set_sensor_value()
+  for the usual poll.
+*/
+extern void labibus_enable_samples(uint8_t device_id);
+
+/*
+  Add a sample to the ring of a device. Takes constant time, and is safe to
+  call from an interrupt handler (for example an ADC conversion interrupt).
+  Timestamps come from the bus timer, and wrap after 35 minutes at
+  F_CPU=16MHz.
+*/
+extern void labibus_add_sample(uint8_t device_id, float value);
+
 /*
   Wait for the master device to poll this slave device for its sensor value.
 
@@ -71,7 +294,8 @@ extern void labibus_set_sensor_value(uint8_t device_id, float value);
   disabled for long).
 
   Note that this function temporarily enables interrupts for the duration of
-  the call, if they were disabled upon entry.
+  the call, if they were disabled upon entry. labibus_set_poll_callback()
+  does the same without keeping the main loop waiting.
 */
 extern void labibus_wait_for_poll(uint8_t device_id);
 
@@ -85,12 +309,44 @@ extern void labibus_wait_for_poll(uint8_t device_id);
 */
 extern bool labibus_check_for_poll(uint8_t device_id);
 
+/*
+  Have a function called after each poll of one of our devices, once the
+  reply has been sent and the bus released (also when there was no value to
+  send). This is the quiet time for slow sensor reads, as the next poll of
+  that device is furthest away. Pass NULL to stop.
+
+  The function is called from the serial interrupt, with interrupts
+  disabled, so it must be short: set a flag for the main loop, for example.
+*/
+typedef void (*labibus_poll_callback)(uint8_t device_id);
+extern void labibus_set_poll_callback(labibus_poll_callback callback);
+
+/*
+  How long, in milliseconds, the main loop can be busy before the next poll
+  of a device is to be expected, predicted from the times of its previous
+  polls. Returns 0 when a poll may arrive any time now, and also until two
+  polls have been seen.
+*/
+extern uint16_t labibus_time_to_poll(uint8_t device_id);
+
 /*
   Listen for activity from another device on the bus. After calling this
   function, labibus_check_data() and labibus_get_data() can be used to access
   values reported by another device.
+
+  The decimals (at most 9) give the scale of the values returned by
+  labibus_get_data_i16() and _i32().
+*/
+extern void labibus_listen(uint8_t device_id, uint8_t decimals = 0);
+
+/*
+  Listen to a device with several channels (at most MAX_CHANNELS, matching
+  the labibus_init_channels() of the device). Replies with a different
+  number of values are ignored. labibus_get_data() and friends give the
+  first channel; labibus_get_data_channels() gives them all.
 */
-extern void labibus_listen(uint8_t device_id);
+extern void labibus_listen_channels(uint8_t device_id, uint8_t channels,
+                                    uint8_t decimals = 0);
 
 /*
   Check if any new data is available from a device that was previously
@@ -104,3 +360,74 @@ extern bool labibus_check_data(uint8_t device_id);
   listening to with labibus_listen().
 */
 extern float labibus_get_data(uint8_t device_id);
+/*
+  Get the latest data seen from another device, as a fixed-point number
+  scaled by the decimals given to labibus_listen(), rounded half away from
+  zero. Values out of range saturate.
+*/
+extern int16_t labibus_get_data_i16(uint8_t device_id);
+extern int32_t labibus_get_data_i32(uint8_t device_id);
+/*
+  Get the latest values of all channels of a device listened to, as a group
+  from the same reply, into values[] (room for the number of channels given
+  to labibus_listen_channels()). Returns the number of channels, or 0 if the
+  device is not listened to.
+*/
+extern uint8_t labibus_get_data_channels(uint8_t device_id, float *values);
+extern uint8_t labibus_get_data_channels_i32(uint8_t device_id,
+                                             int32_t *values);
+
+/*
+  Get the number of frames addressed to (or listened for by) this node that
+  were lost because all receive buffers were busy. The count wraps around at
+  65536.
+*/
+extern uint16_t labibus_get_dropped_frames(void);
+
+/*
+  Bus statistics of this node, to spot a degrading bus segment before values
+  go missing. The counts wrap around at 65536; the times are the worst seen,
+  in bus timer ticks (F_CPU/8, so 0.5 microseconds at 16MHz).
+
+  The master can read them remotely from any device of the node, in the
+  order of the fields:
+    ?ii:S|cccc -> !ii:S<frames>|<addressed>|...|<aborted>|cccc
+  New counters are only ever added at the end, so that a master reading the
+  fields it knows need not change.
+*/
+struct labibus_stats {
+  /* Frames seen on the bus, whoever they were for. */
+  uint16_t frames;
+  /* Of these, requests to our devices and replies from devices we listen to. */
+  uint16_t addressed;
+  /* Frames addressed to us that failed the CRC check. */
+  uint16_t crc_errors;
+  /* Frames addressed to us that were too long for the receive buffer. */
+  uint16_t too_long;
+  /* Frames addressed to us lost with all receive buffers busy. */
+  uint16_t dropped;
+  /* Chars received with a framing error (FE), eg. from a collision. */
+  uint16_t framing_errors;
+  /* Chars lost because the receive interrupt was late (DOR). */
+  uint16_t data_overruns;
+  /* Replies sent. */
+  uint16_t replies;
+  /* Longest time the receive interrupt ran with interrupts disabled. */
+  uint16_t isr_max_ticks;
+  /*
+    Longest time from the end of a request to the start of its reply (for a
+    range poll, from the start of the slot, plus the turnaround).
+  */
+  uint16_t turnaround_max_ticks;
+  /*
+    Frames abandoned part way, on a receive error, a pause of RCV_IDLE_US, or
+    the start of another frame.
+  */
+  uint16_t aborted;
+};
+
+/* Get a consistent copy of the statistics; clear them all. */
+extern void labibus_get_stats(struct labibus_stats *stats);
+extern void labibus_clear_stats(void);
+
+#endif  /* LABIBUS_H */
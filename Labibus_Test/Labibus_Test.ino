@@ -16,9 +16,26 @@
 
 DHT dht(DHTPIN, DHTTYPE);
 
+// One device with two channels, sent together in one poll reply. The strings
+// stay in flash, to save RAM.
+const char temperature[] PROGMEM = "Temperature in room 4";
+const char humidity[] PROGMEM = "Humidity in room 4";
+const char celsius[] PROGMEM = "degree C";
+const char percent[] PROGMEM = "%rel";
+const char *descriptions[2] = { temperature, humidity };
+const char *units[2] = { celsius, percent };
+
+// Set by the poll callback, from the serial interrupt. Start with a reading.
+volatile bool polled = true;
+
+void on_poll(uint8_t device_id) {
+  polled = true;
+}
+
 void setup() {
   //Serial.begin(9600); 
-  labibus_init(40, 10, "Temperature in room 4", "degree C");
+  labibus_init_channels_P(40, 10, 2, descriptions, units);
+  labibus_set_poll_callback(on_poll);
  
   pinMode(10,OUTPUT);
   pinMode(11,OUTPUT);
@@ -26,10 +43,20 @@ void setup() {
   digitalWrite(11,HIGH); //VCC PIN
   
   dht.begin();
+  // Give the sensor and the bus time to settle before the first read.
+  delay(2000);
 }
 
 void loop() {
-  delay(2000);
+  // Read the sensor right after a poll, when the next one is furthest away,
+  // so that the read (which disables interrupts) does not make us miss it.
+  // Polls come every 10 s, well over the 2 s the DHT needs between reads.
+  if (!polled) {
+    // Nothing to do until the next poll; do not spin.
+    delay(10);
+    return;
+  }
+  polled = false;
 
   // Reading temperature or humidity takes about 250 milliseconds!
   // Sensor readings may also be up to 2 seconds 'old' (its a very slow sensor)
@@ -39,7 +66,8 @@ void loop() {
   // Read temperature as Fahrenheit
   float f = dht.readTemperature(true);
   
-  // Check if any reads failed and exit early (to try again).
+  // Check if any reads failed and exit early (to try again after the next
+  // poll).
   if (isnan(h) || isnan(t) || isnan(f)) {
     //Serial.println("Failed to read from DHT sensor!");
     return;
@@ -51,6 +79,7 @@ void loop() {
   //Serial.print("Temperature: "); 
   //Serial.print(t);
   //Serial.println(" *C ");
-  labibus_set_sensor_value(40, t);
+  float values[2] = { t, h };
+  labibus_set_sensor_values(40, values);
 }
 
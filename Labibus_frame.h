@@ -0,0 +1,206 @@
+/*
+  Framing of the bytes received from the bus into Labibus frames.
+
+  Text frames start with '?' or '!' and end with LF; the quoting ensures that
+  '?' and '!' only occur at the start of a frame, and CR is ignored. Binary
+  frames are COBS encoded between zero delimiters, and zero never occurs in
+  text frames. A frame is abandoned when a start marker arrives in the middle
+  of it (its end was lost), on a receive error or a pause (see
+  frame_rx_abort()), and when it grows longer than MAX_REQ chars.
+
+  frame_rx_byte() takes one byte at a time and tells what it does to the
+  frame being received, so that the receiver of the library and the framer
+  of bus captures (host/capture.h) split the bytes into frames in exactly the
+  same way, and count the same frames, too long frames and aborted frames.
+  What to do with the chars of a frame is up to the caller, which may also
+  skip the rest of a frame once its header is in (frame_rx_skip()).
+
+  Shared between the AVR library and the host-side tools.
+*/
+
+#ifndef LABIBUS_FRAME_H
+#define LABIBUS_FRAME_H
+
+#include <stdint.h>
+
+#include "Labibus.h"
+
+
+/* Modes of the framer. */
+#define FRAME_RX_IDLE 0       /* Waiting for the start of a frame. */
+#define FRAME_RX_TEXT 1       /* In a text frame. */
+#define FRAME_RX_BIN_START 2  /* After the opening delimiter of a binary frame. */
+#define FRAME_RX_BINARY 3     /* In a binary frame. */
+#define FRAME_RX_SKIP 4       /* Ignoring a binary frame, until its delimiter. */
+
+/* Length of the header (up to the type) of text and binary frames. */
+#define FRAME_TEXT_HEADER 5
+#define FRAME_BIN_HEADER 2
+
+/* What a byte did, as bits of the result of frame_rx_byte(). */
+#define FRAME_ABORTED 0x01   /* Abandoned the frame being received. */
+#define FRAME_STARTED 0x02   /* Started a frame (the mode tells its kind). */
+#define FRAME_CHAR 0x04      /* Gave the next char of the frame. */
+#define FRAME_HEADER 0x08    /* Completed the header with that char. */
+#define FRAME_TOO_LONG 0x10  /* Made the frame too long: it is dropped. */
+#define FRAME_ENDED 0x20     /* Ended the frame with its end marker, */
+#define FRAME_COMPLETE 0x40  /* and the frame is long enough to take. */
+
+struct frame_rx {
+  uint8_t mode;
+  /* Chars of the frame so far (after COBS decoding, for a binary frame). */
+  uint8_t len;
+  /*
+    COBS decoding: the number of bytes left in the current block, and
+    whether a zero byte follows it.
+  */
+  uint8_t cobs_left, cobs_zero;
+};
+
+
+/*
+  Skip the rest of the frame being received: a text frame up to the start of
+  the next one, a binary frame up to its closing delimiter.
+*/
+static inline void
+frame_rx_skip(struct frame_rx *f)
+{
+  f->mode = f->mode == FRAME_RX_TEXT ? FRAME_RX_IDLE : FRAME_RX_SKIP;
+}
+
+
+/*
+  Abandon the frame being received, after a byte with a receive error or a
+  pause of the receive idle timeout. The rest of a binary frame is skipped
+  up to its closing delimiter, unless brk is set (the line went idle, or was
+  held low), in which case the next zero byte opens a new frame. Returns
+  FRAME_ABORTED if there was a frame, 0 otherwise.
+*/
+static inline uint8_t
+frame_rx_abort(struct frame_rx *f, uint8_t brk)
+{
+  if (f->mode == FRAME_RX_IDLE || f->mode == FRAME_RX_SKIP)
+  {
+    if (brk)
+      f->mode = FRAME_RX_IDLE;
+    return 0;
+  }
+  f->mode = (f->mode == FRAME_RX_TEXT || brk) ? FRAME_RX_IDLE : FRAME_RX_SKIP;
+  return FRAME_ABORTED;
+}
+
+
+/* Take the next char of the frame, unless that makes it too long. */
+static inline uint8_t
+frame_rx_store(struct frame_rx *f)
+{
+  if (f->len >= MAX_REQ)
+  {
+    frame_rx_skip(f);
+    return FRAME_TOO_LONG;
+  }
+  ++f->len;
+  if (f->len == (f->mode == FRAME_RX_TEXT ? FRAME_TEXT_HEADER
+                 : FRAME_BIN_HEADER))
+    return FRAME_CHAR | FRAME_HEADER;
+  return FRAME_CHAR;
+}
+
+
+/*
+  Take a byte received without error. With FRAME_CHAR, *out is the char,
+  the last of the f->len chars of the frame.
+*/
+static inline uint8_t
+frame_rx_byte(struct frame_rx *f, uint8_t c, uint8_t *out)
+{
+  uint8_t events = 0;
+
+  if (f->mode == FRAME_RX_TEXT && (c == '?' || c == '!'))
+    events = frame_rx_abort(f, 1);
+
+  if (c == 0)
+  {
+    /* End of a binary frame, if the last COBS block is complete. */
+    if (f->mode == FRAME_RX_BINARY && f->cobs_left == 0 && f->len >= 4)
+    {
+      f->mode = FRAME_RX_IDLE;
+      return FRAME_ENDED | FRAME_COMPLETE;
+    }
+    if (f->mode == FRAME_RX_SKIP)
+    {
+      f->mode = FRAME_RX_IDLE;
+      return 0;
+    }
+    /*
+      Start of a binary frame. A frame cut short is abandoned: its zero can
+      only be the delimiter of the next one.
+    */
+    if (f->mode == FRAME_RX_BINARY || f->mode == FRAME_RX_TEXT)
+      events = FRAME_ABORTED;
+    f->mode = FRAME_RX_BIN_START;
+    f->len = 0;
+    f->cobs_left = 0;
+    f->cobs_zero = 0;
+    return events | FRAME_STARTED;
+  }
+
+  switch (f->mode)
+  {
+  case FRAME_RX_IDLE:
+    if (c != '?' && c != '!')
+      break;
+    f->mode = FRAME_RX_TEXT;
+    f->len = 0;
+    *out = c;
+    events |= FRAME_STARTED | frame_rx_store(f);
+    break;
+
+  case FRAME_RX_TEXT:
+    /* CR before LF is useful for serial debugging, but is otherwise ignored. */
+    if (c == '\r')
+      break;
+    if (c == '\n')
+    {
+      f->mode = FRAME_RX_IDLE;
+      return f->len > FRAME_TEXT_HEADER ? FRAME_ENDED | FRAME_COMPLETE
+        : FRAME_ENDED;
+    }
+    *out = c;
+    events = frame_rx_store(f);
+    break;
+
+  case FRAME_RX_BIN_START:
+    f->mode = FRAME_RX_BINARY;
+    /* Fall through. */
+  case FRAME_RX_BINARY:
+    /*
+      Each COBS block starts with a code byte, one more than the number of
+      data bytes that follow. Unless the code is 0xff, the block is followed
+      by a zero byte, except at the end of the frame.
+    */
+    if (f->cobs_left == 0)
+    {
+      if (f->cobs_zero)
+      {
+        *out = 0;
+        events = frame_rx_store(f);
+      }
+      f->cobs_left = c - 1;
+      f->cobs_zero = (c != 0xff);
+    }
+    else
+    {
+      --f->cobs_left;
+      *out = c;
+      events = frame_rx_store(f);
+    }
+    break;
+
+  default:
+    break;
+  }
+  return events;
+}
+
+#endif  /* LABIBUS_FRAME_H */
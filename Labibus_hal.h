@@ -0,0 +1,359 @@
+/*
+  Hardware abstraction for the Labibus library.
+
+  Labibus.cpp only talks to the hardware through the functions and macros
+  defined here: the serial port, the RS485 driver/receiver enable pins,
+  delays, and interrupt masking (cli()/sei()/ATOMIC_BLOCK and ISR()).
+
+  When compiled with LABIBUS_HOST defined, the same names are provided by the
+  simulated RS485 bus in host/, so the protocol code can be run and timed on
+  a Linux host. Otherwise this is the AVR implementation.
+*/
+
+#ifdef LABIBUS_HOST
+
+#include "host/sim_hal.h"
+
+#else
+
+#include <util/delay.h>
+#include <util/atomic.h>
+#include <avr/pgmspace.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#ifdef ARDUINO
+#if ARDUINO >= 100
+ #include "Arduino.h"
+#else
+ #include "WProgram.h"
+#endif
+#else
+#include <arduino/pins.h>
+#endif
+
+
+#ifdef ARDUINO
+#ifdef PERNITTENGRYNET
+#if !defined(__AVR_ATmega168__) && !defined(__AVR_ATmega328P__) \
+  && !defined(__AVR_ATmega32U4__)
+#error this AVR device is not yet supported :-(
+#endif
+#endif
+#endif
+
+
+/*
+  Storage class for the library's mutable state. On the host, every simulated
+  node runs in its own thread and gets its own copy.
+*/
+#define NODE_LOCAL
+
+#if defined(__AVR_ATmega32U4__)
+#define SERIAL_RX_vect USART1_RX_vect
+#define SERIAL_UDRE_vect USART1_UDRE_vect
+#define SERIAL_TX_vect USART1_TX_vect
+#else
+#define SERIAL_RX_vect USART_RX_vect
+#define SERIAL_UDRE_vect USART_UDRE_vect
+#define SERIAL_TX_vect USART_TX_vect
+#endif
+#define BUS_TIMER_COMPA_vect TIMER1_COMPA_vect
+#define BUS_TIMER_OVF_vect TIMER1_OVF_vect
+
+
+/* Called in the body of busy-wait loops. */
+static inline void
+cpu_relax(void)
+{
+}
+
+
+static void
+setup_rs485_pins(void)
+{
+#ifdef ARDUINO
+  pinMode(PIN_RE, OUTPUT);
+  pinMode(PIN_DE, OUTPUT);
+#else
+  pin_mode_output(PIN_RE);
+  pin_mode_output(PIN_DE);
+#endif
+}
+
+
+static void
+rs485_receive_mode(void)
+{
+#ifdef ARDUINO
+  digitalWrite(PIN_DE, 0);
+  digitalWrite(PIN_RE, 0);
+#else
+  pin_low(PIN_DE);
+  pin_low(PIN_RE);
+#endif
+}
+
+
+static void
+rs485_transmit_mode(void)
+{
+#ifdef ARDUINO
+  digitalWrite(PIN_RE, 1);
+  digitalWrite(PIN_DE, 1);
+#else
+  pin_high(PIN_RE);
+  pin_high(PIN_DE);
+#endif
+}
+
+
+/*
+  UART divider for LABIBUS_BAUD, worked out by the preprocessor. The baud rate
+  is F_CPU/(div*(UBRR+1)), with div 16, or 8 with U2X set. Normal speed samples
+  each bit more often and is used when it is close enough; the error is in
+  tenths of a percent.
+*/
+#define SERIAL_UBRR_FOR(div) \
+  ((F_CPU + (div)*LABIBUS_BAUD/2) / ((div)*LABIBUS_BAUD) - 1)
+#define SERIAL_BAUD_FOR(div) (F_CPU / ((div)*(SERIAL_UBRR_FOR(div) + 1)))
+#define SERIAL_ERROR_FOR(div) \
+  ((SERIAL_BAUD_FOR(div) > LABIBUS_BAUD \
+    ? SERIAL_BAUD_FOR(div) - LABIBUS_BAUD \
+    : LABIBUS_BAUD - SERIAL_BAUD_FOR(div)) * 1000 / LABIBUS_BAUD)
+#define SERIAL_MAX_ERROR 25
+
+#if F_CPU < 8UL*LABIBUS_BAUD
+#error LABIBUS_BAUD is too fast for F_CPU
+#elif SERIAL_UBRR_FOR(8) > 4095
+#error LABIBUS_BAUD is too slow for F_CPU
+#elif F_CPU >= 16UL*LABIBUS_BAUD && SERIAL_UBRR_FOR(16) <= 4095 \
+  && SERIAL_ERROR_FOR(16) <= SERIAL_MAX_ERROR
+#define SERIAL_U2X 0
+#define SERIAL_UBRR SERIAL_UBRR_FOR(16)
+#elif SERIAL_ERROR_FOR(8) <= SERIAL_MAX_ERROR
+#define SERIAL_U2X 1
+#define SERIAL_UBRR SERIAL_UBRR_FOR(8)
+#else
+#error F_CPU can not make LABIBUS_BAUD within 2.5%
+#endif
+
+/* Time of one char (10 bits) on the wire, in microseconds, rounded up. */
+#define SERIAL_CHAR_US ((10000000UL + LABIBUS_BAUD - 1) / LABIBUS_BAUD)
+
+
+static void
+setup_serial(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  UCSR1A = (UCSR1A & ~(_BV(FE1) | _BV(DOR1) | _BV(UPE1) | _BV(U2X1)))
+    | (SERIAL_U2X ? _BV(U2X1) : 0);
+  UBRR1 = SERIAL_UBRR;
+#else
+  UCSR0A = (UCSR0A & ~(_BV(FE0) | _BV(DOR0) | _BV(UPE0) | _BV(U2X0)))
+    | (SERIAL_U2X ? _BV(U2X0) : 0);
+  UBRR0 = SERIAL_UBRR;
+#endif
+
+#if defined(__AVR_ATmega32U4__)
+  /* serial_mode_8n1() */
+  UCSR1B &= ~(_BV(UCSZ12));
+  UCSR1C = (UCSR1C & ~(_BV(UPM11) | _BV(UPM10) | _BV(USBS1)))
+    | _BV(UCSZ11) | _BV(UCSZ10);
+  /* serial_transmitter_enable() */
+  UCSR1B |= _BV(TXEN1);
+  /* serial_receiver_enable() */
+  UCSR1B |= _BV(RXEN1);
+  /* serial_interrupt_rx_enable() */
+  UCSR1B |= _BV(RXCIE1);
+#else
+  /* serial_mode_8n1() */
+  UCSR0B &= ~(_BV(UCSZ02));
+  UCSR0C = (UCSR0C & ~(_BV(UPM01) | _BV(UPM00) | _BV(USBS0)))
+    | _BV(UCSZ01) | _BV(UCSZ00);
+  /* serial_transmitter_enable() */
+  UCSR0B |= _BV(TXEN0);
+  /* serial_receiver_enable() */
+  UCSR0B |= _BV(RXEN0);
+  /* serial_interrupt_rx_enable() */
+  UCSR0B |= _BV(RXCIE0);
+#endif
+}
+
+
+static inline void
+serial_interrupt_rx_enable(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  UCSR1B |= _BV(RXCIE1);
+#else
+  UCSR0B |= _BV(RXCIE0);
+#endif
+}
+
+
+static inline void
+serial_interrupt_rx_disable(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  UCSR1B &= ~(_BV(RXCIE1));
+#else
+  UCSR0B &= ~(_BV(RXCIE0));
+#endif
+}
+
+
+static inline void
+serial_interrupt_udre_enable(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  UCSR1B |= _BV(UDRIE1);
+#else
+  UCSR0B |= _BV(UDRIE0);
+#endif
+}
+
+
+static inline void
+serial_interrupt_udre_disable(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  UCSR1B &= ~(_BV(UDRIE1));
+#else
+  UCSR0B &= ~(_BV(UDRIE0));
+#endif
+}
+
+
+static inline void
+serial_interrupt_txc_enable(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  UCSR1B |= _BV(TXCIE1);
+#else
+  UCSR0B |= _BV(TXCIE0);
+#endif
+}
+
+
+static inline void
+serial_interrupt_txc_disable(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  UCSR1B &= ~(_BV(TXCIE1));
+#else
+  UCSR0B &= ~(_BV(TXCIE0));
+#endif
+}
+
+
+static inline void
+serial_write(uint8_t c)
+{
+#if defined(__AVR_ATmega32U4__)
+  UDR1 = c;
+#else
+  UDR0 = c;
+#endif
+}
+
+
+static inline uint8_t
+serial_read(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  return UDR1;
+#else
+  return UDR0;
+#endif
+}
+
+
+/*
+  Receive error flags of the char in the receive buffer, which must be read
+  before the char itself: framing error, data overrun (a char was lost
+  before this one was read) and parity error.
+*/
+#if defined(__AVR_ATmega32U4__)
+#define SERIAL_FE _BV(FE1)
+#define SERIAL_DOR _BV(DOR1)
+#define SERIAL_UPE _BV(UPE1)
+#else
+#define SERIAL_FE _BV(FE0)
+#define SERIAL_DOR _BV(DOR0)
+#define SERIAL_UPE _BV(UPE0)
+#endif
+
+static inline uint8_t
+serial_read_errors(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  return UCSR1A & (SERIAL_FE | SERIAL_DOR | SERIAL_UPE);
+#else
+  return UCSR0A & (SERIAL_FE | SERIAL_DOR | SERIAL_UPE);
+#endif
+}
+
+
+/* The TXC flag is cleared by writing a one to it. */
+static inline void
+serial_clear_tx_complete(void)
+{
+#if defined(__AVR_ATmega32U4__)
+  UCSR1A |= _BV(TXC1);
+#else
+  UCSR0A |= _BV(TXC0);
+#endif
+}
+
+
+/*
+  The bus timer is Timer1, free-running at F_CPU/8. It timestamps bus events
+  and schedules replies with its compare A interrupt. Its overflow interrupt
+  counts wraps, to extend it into a longer clock.
+*/
+#define BUS_TIMER_TICKS_PER_MS (F_CPU/8/1000)
+
+static void
+setup_bus_timer(void)
+{
+  /* Normal mode, clk/8. */
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+  TIMSK1 &= ~(_BV(OCIE1A));
+  TIMSK1 |= _BV(TOIE1);
+}
+
+
+static inline uint16_t
+bus_timer_now(void)
+{
+  return TCNT1;
+}
+
+
+/* Has the timer wrapped without the overflow interrupt having run yet? */
+static inline uint8_t
+bus_timer_overflow_pending(void)
+{
+  return TIFR1 & _BV(TOV1);
+}
+
+
+/* Trigger the compare interrupt when the timer reaches `at`. */
+static inline void
+bus_timer_alarm(uint16_t at)
+{
+  OCR1A = at;
+  TIFR1 = _BV(OCF1A);
+  TIMSK1 |= _BV(OCIE1A);
+}
+
+
+static inline void
+bus_timer_alarm_cancel(void)
+{
+  TIMSK1 &= ~(_BV(OCIE1A));
+}
+
+#endif  /* !LABIBUS_HOST */
@@ -0,0 +1,636 @@
+/*
+  Number formatting and parsing for the Labibus text protocol.
+
+  num_format() gives the text of the avr-libc dtostrf() call (and, for
+  values too large for it, the dtostre() call) that poll replies used to be
+  encoded with: fixed notation, at most 7 significant digits, the remaining
+  decimals padded with zeros. num_parse() replaces atof() on such text.
+
+  Both only use 32-bit integer arithmetic, with at most a single float
+  multiply or divide, so that nothing wider has to be pulled in on the AVR.
+  In the fixed-point range of poll values (up to NUM_FLOAT_DECIMALS
+  decimals), and up to 10^20, num_format() rounds the digits correctly, as
+  host printf() does; num_parse() rounds correctly to float for up to 7
+  significant digits with exponents up to 9 (the values in fixed notation
+  that num_format() gives), and for the integers and fixed-point values of
+  32 bits. Beyond that, both work from a 32-bit approximation, which can be
+  one off in the last digit, or the last bit of the float, near a tie.
+  'make num-size' in host/ compares the flash used with that of the libc
+  functions.
+
+  Shared between the AVR library and the host-side tools.
+*/
+
+#ifndef LABIBUS_NUM_H
+#define LABIBUS_NUM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef LABIBUS_HOST
+#include "host/pgmspace.h"
+#else
+#include <avr/pgmspace.h>
+#endif
+
+
+/* Most decimals num_format() supports. */
+#define NUM_FLOAT_DECIMALS 6
+/* Most decimals of the fixed-point functions. */
+#define NUM_MAX_DECIMALS 9
+
+static const uint32_t num_pow10[10] PROGMEM = {
+  1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL,
+  100000000UL, 1000000000UL
+};
+
+#define NUM_HUGE 0xffffffffUL
+
+/*
+  10^(2^i) and 10^-(2^i), for i from 0 to 5, as m * 2^e with m of 32 bits,
+  its top bit set, rounded to nearest.
+*/
+static const uint32_t num_pow10_ext_m[2][6] PROGMEM = {
+  { 0xa0000000UL, 0xc8000000UL, 0x9c400000UL, 0xbebc2000UL, 0x8e1bc9bfUL,
+    0x9dc5ada8UL },
+  { 0xcccccccdUL, 0xa3d70a3dUL, 0xd1b71759UL, 0xabcc7712UL, 0xe69594bfUL,
+    0xcfb11eadUL }
+};
+static const int16_t num_pow10_ext_e[2][6] PROGMEM = {
+  { -28, -25, -18, -5, 22, 75 },
+  { -35, -38, -45, -58, -85, -138 }
+};
+
+
+/*
+  x / 2^s, rounded to nearest, ties to even, for 1 <= s <= 32. sticky is set
+  if x was cut short, that is, if the value is a bit more than x.
+*/
+static uint32_t
+num_round(uint32_t x, uint8_t s, uint8_t sticky)
+{
+  uint32_t half = 1UL << (s - 1);
+  uint32_t rem = x & (half + half - 1);
+  uint32_t q = x >> (s - 1) >> 1;
+
+  if (rem > half || (rem == half && (sticky || (q & 1))))
+    ++q;
+  return q;
+}
+
+
+/*
+  n * 2^zeros / div, rounded down, with the remainder in *rem. div must be
+  below 2^31, and the quotient fit in 32 bits. This is long division, a bit
+  at a time, so that nothing wider than 32 bits is needed.
+*/
+static uint32_t
+num_div(uint32_t n, uint8_t zeros, uint32_t div, uint32_t *rem)
+{
+  uint32_t q = 0, r = 0;
+  uint8_t i;
+
+  for (i = 32 + zeros; i > 0; --i)
+  {
+    r = (r << 1) | (n >> 31);
+    n <<= 1;
+    q <<= 1;
+    if (r >= div)
+    {
+      r -= div;
+      q |= 1;
+    }
+  }
+  *rem = r;
+  return q;
+}
+
+
+/*
+  The top 32 bits of a * b, for a and b with their top bit set, shifted so
+  that the top bit is set. Adds the binary exponent of the result to *e, and
+  sets *sticky if a bit was dropped.
+*/
+static uint32_t
+num_mul_ext(uint32_t a, uint32_t b, int16_t *e, uint8_t *sticky)
+{
+  uint16_t ah = a >> 16, al = a, bh = b >> 16, bl = b;
+  uint32_t hi = (uint32_t)ah * bh, low = (uint32_t)al * bl;
+  uint32_t mid1 = (uint32_t)ah * bl, mid2 = (uint32_t)al * bh;
+  /* Bits 16 to 31 of the product, and the carry out of them. */
+  uint32_t t = (low >> 16) + (mid1 & 0xffff) + (mid2 & 0xffff);
+
+  hi += (mid1 >> 16) + (mid2 >> 16) + (t >> 16);
+  *e += 32;
+  if (!(hi >> 31))
+  {
+    hi = (hi << 1) | ((t >> 15) & 1);
+    --*e;
+    t <<= 1;
+  }
+  if ((t & 0xffff) || (low & 0xffff))
+    *sticky = 1;
+  return hi;
+}
+
+
+/*
+  10^q as m * 2^*e, for |q| below 64, with m of 32 bits (its top bit set),
+  which can be a few units off in the last place for q below 0 or above 13.
+*/
+static uint32_t
+num_pow10_ext(int8_t q, int16_t *e, uint8_t *sticky)
+{
+  uint32_t m = 0x80000000UL;
+  uint8_t neg = q < 0, i;
+
+  *e = -31;
+  if (neg)
+    q = -q;
+  for (i = 0; q; ++i, q >>= 1)
+    if (q & 1)
+    {
+      m = num_mul_ext(m, pgm_read_dword(&num_pow10_ext_m[neg][i]), e, sticky);
+      *e += (int16_t)pgm_read_word(&num_pow10_ext_e[neg][i]);
+    }
+  return m;
+}
+
+
+/*
+  m * 10^q * 2^e, rounded to nearest integer, ties to even (as printf does),
+  for m below 2^24 and q at most NUM_FLOAT_DECIMALS, so that m * 5^q fits
+  in 38 bits. Returns NUM_HUGE if that is 2^24 or more.
+*/
+static uint32_t
+num_scale(uint32_t m, int16_t e, uint8_t q)
+{
+  uint32_t p = pgm_read_dword(&num_pow10[q]) >> q;
+  /* m * 5^q = hi * 2^16 + lo */
+  uint32_t hi = (m >> 16) * p, lo = (m & 0xffff) * p;
+  uint8_t s;
+
+  e += q;
+  if (e >= 0)
+  {
+    if ((hi >> 8) || e >= 24)
+      return NUM_HUGE;
+    lo += hi << 16;
+    return (lo >> (24 - e)) ? NUM_HUGE : lo << e;
+  }
+  if (e < -38)
+    return 0;
+  s = -e;
+  if (s < 7)
+  {
+    if (hi >> (8 + s))
+      return NUM_HUGE;
+    return num_round((hi << 16) + lo, s, 0);
+  }
+  /* Drop the low 6 bits, so that it fits in 32 bits. */
+  return num_round((hi << 10) + (lo >> 6), s - 6, (lo & 63) != 0);
+}
+
+
+/*
+  m * 2^e / 10^j, rounded to nearest integer, ties to even, for values of at
+  least 10^7 (so e is not negative, but for j = 1) and m below 2^24. Exact
+  by long division for j up to 13 (values up to 10^20); beyond that, from
+  the approximation of 10^-j.
+*/
+static uint32_t
+num_scale_down(uint32_t m, int16_t e, uint8_t j)
+{
+  uint32_t div, n, r;
+  int16_t zeros = e - j, x;
+  uint8_t sticky = 0;
+
+  if (j <= 13)
+  {
+    for (div = 1; j > 0; --j)
+      div *= 5;
+    if (zeros < 0)
+    {
+      div <<= -zeros;
+      zeros = 0;
+    }
+    n = num_div(m, zeros, div, &r);
+    if (r > div - r || (r == div - r && (n & 1)))
+      ++n;
+    return n;
+  }
+  n = num_pow10_ext(-(int8_t)j, &x, &sticky);
+  x += e - 8;
+  n = num_mul_ext(m << 8, n, &x, &sticky);
+  return num_round(n, -x, sticky);
+}
+
+
+/* The 7 decimal digits of n < 10^7, with leading zeros. */
+static void
+num_digits(uint32_t n, char *dig)
+{
+  uint32_t p;
+  uint8_t i;
+  char d;
+
+  for (i = 0; i < 7; ++i)
+  {
+    p = pgm_read_dword(&num_pow10[6 - i]);
+    for (d = '0'; n >= p; ++d)
+      n -= p;
+    dig[i] = d;
+  }
+}
+
+
+static uint8_t
+num_put_str(char *buf, uint8_t idx, const char *s)
+{
+  while (*s)
+    buf[idx++] = *s++;
+  return idx;
+}
+
+
+/*
+  Format a value like dtostrf(value, 1, prec, buf) from avr-libc: fixed
+  notation with prec (at most NUM_FLOAT_DECIMALS) decimals, of which only
+  the first 7 significant digits are kept, the rest zeros. If that is longer
+  than max chars, format it like dtostre(value, buf, 6, 0) instead. max must
+  be at least prec + 9.
+
+  Returns the length; the text is not zero terminated.
+*/
+static uint8_t
+num_format(float value, uint8_t prec, char *buf, uint8_t max)
+{
+  uint32_t bits, m, n;
+  int16_t e, k = 0;
+  uint8_t idx = 0, z = 0, lead, len, total, i;
+  int8_t j;
+  char dig[7];
+
+  memcpy(&bits, &value, sizeof(bits));
+  m = bits & 0x7fffffUL;
+  e = (bits >> 23) & 0xff;
+  if (e == 0xff && m)
+    return num_put_str(buf, 0, "nan");
+  if (bits >> 31)
+    buf[idx++] = '-';
+  if (e == 0xff)
+    return num_put_str(buf, idx, "inf");
+  if (e == 0)
+    e = -149;
+  else
+  {
+    m |= 1UL << 23;
+    e -= 150;
+  }
+
+  /*
+    Round to prec decimals. If that gives more than 7 digits, round to 7
+    significant digits instead: find the decimal exponent k of the value
+    (after rounding), starting from an estimate from the binary exponent.
+  */
+  n = num_scale(m, e, prec);
+  if (n >= 10000000UL)
+  {
+    k = ((int32_t)(e + 23) * 1233) >> 12;
+    for (;;)
+    {
+      n = k <= 6 ? num_scale(m, e, 6 - k) : num_scale_down(m, e, k - 6);
+      if (n >= 10000000UL)
+        ++k;
+      else if (n < 1000000UL)
+        --k;
+      else
+        break;
+    }
+    z = prec + k - 6;
+  }
+  num_digits(n, dig);
+
+  /*
+    The value is the digits, followed by z zeros, with prec of them after
+    the decimal point. Pad with leading zeros to have one before it.
+  */
+  for (lead = 0; lead < 7 && dig[lead] == '0'; ++lead)
+    ;
+  len = 7 - lead + z;
+  total = len > prec ? len : prec + 1;
+  if (idx + total + (prec ? 1 : 0) <= max)
+  {
+    for (i = 0; i < total; ++i)
+    {
+      if (i == total - prec)
+        buf[idx++] = '.';
+      j = i + len - total;
+      buf[idx++] = (j < 0 || j >= 7 - lead) ? '0' : dig[lead + j];
+    }
+    return idx;
+  }
+
+  /* Exponential notation, "d.dddddde+xx". */
+  buf[idx++] = dig[0];
+  buf[idx++] = '.';
+  for (i = 1; i < 7; ++i)
+    buf[idx++] = dig[i];
+  buf[idx++] = 'e';
+  buf[idx++] = k < 0 ? '-' : '+';
+  if (k < 0)
+    k = -k;
+  buf[idx++] = '0' + k / 10;
+  buf[idx++] = '0' + k % 10;
+  return idx;
+}
+
+
+/*
+  q * 2^e, plus a bit less than one unit if sticky, as the nearest float
+  (ties to even).
+*/
+static float
+num_make_float(uint32_t q, int16_t e, uint8_t sticky, uint8_t neg)
+{
+  uint32_t m, bits;
+  int16_t lsb;
+  uint8_t len;
+  float f;
+
+  for (len = 0; len < 32 && (q >> len); ++len)
+    ;
+  /* Exponent of the lowest mantissa bit, at least that of subnormals. */
+  lsb = e + len - 24;
+  if (lsb < -149)
+    lsb = -149;
+  if (lsb <= e)
+    m = q << (e - lsb);
+  else if (lsb - e > 32)
+    m = 0;
+  else
+    m = num_round(q, lsb - e, sticky);
+  if (m >> 24)
+  {
+    m >>= 1;
+    ++lsb;
+  }
+  if (m < (1UL << 23))
+    bits = m;
+  else if (lsb + 150 >= 0xff)
+    bits = 0x7f800000UL;
+  else
+    bits = ((uint32_t)(lsb + 150) << 23) | (m & 0x7fffffUL);
+  if (neg)
+    bits |= 0x80000000UL;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+
+/* A decimal number as scanned from text: d * 10^q, or nan/inf. */
+struct num_dec {
+  uint32_t d;
+  int16_t q;
+  /* Non-zero digits were dropped after the first 9 or 10 (d is a bit low). */
+  uint8_t sticky;
+  uint8_t neg;
+  /* 'n' for nan, 'i' for inf, else 0. */
+  uint8_t special;
+};
+
+
+/* d = d * 10 + digit, unless that does not fit in 32 bits. */
+static uint8_t
+num_push_digit(uint32_t *d, uint8_t digit)
+{
+  if (*d > 429496729UL || (*d == 429496729UL && digit > 5))
+    return 0;
+  *d = *d * 10 + digit;
+  return 1;
+}
+
+
+/*
+  Scan a decimal number, in fixed or exponential notation, or "nan"/"inf".
+  Scanning stops at the first char that does not belong to the number.
+*/
+static void
+num_scan(const char *s, struct num_dec *n)
+{
+  uint32_t d = 0, t;
+  int16_t q = 0, x;
+  uint8_t zeros = 0, point = 0, sticky = 0, eneg, i;
+
+  n->neg = 0;
+  if (*s == '-' || *s == '+')
+    n->neg = (*s++ == '-');
+  n->special = 0;
+  if (s[0] == 'n' && s[1] == 'a' && s[2] == 'n')
+    n->special = 'n';
+  else if (s[0] == 'i' && s[1] == 'n' && s[2] == 'f')
+    n->special = 'i';
+
+  /*
+    Significant digits go into d as long as it fits in 32 bits (at least 9
+    digits); zeros are only multiplied in when a non-zero digit follows them.
+  */
+  for (;; ++s)
+  {
+    if (*s == '.' && !point)
+    {
+      point = 1;
+      continue;
+    }
+    if (*s < '0' || *s > '9')
+      break;
+    if (point)
+      --q;
+    if (*s == '0')
+    {
+      if (d)
+        ++zeros;
+      continue;
+    }
+    t = d;
+    for (i = 0; i < zeros && num_push_digit(&t, 0); ++i)
+      ;
+    if (i == zeros && num_push_digit(&t, *s - '0'))
+      d = t;
+    else
+    {
+      q += zeros + 1;
+      sticky = 1;
+    }
+    zeros = 0;
+  }
+  q += zeros;
+  if (*s == 'e' || *s == 'E')
+  {
+    ++s;
+    eneg = 0;
+    if (*s == '-' || *s == '+')
+      eneg = (*s++ == '-');
+    for (x = 0; *s >= '0' && *s <= '9'; ++s)
+      if (x < 1000)
+        x = x*10 + (*s - '0');
+    q += eneg ? -x : x;
+  }
+  n->d = d;
+  n->q = q;
+  n->sticky = sticky;
+}
+
+
+/*
+  Parse a decimal number (see num_scan()) like atof(), but rounding
+  correctly to float (see the top of the file for the limits).
+*/
+static float
+num_parse(const char *s)
+{
+  struct num_dec n;
+  uint32_t d, p, t, rem, bits;
+  int16_t q, e;
+  int8_t zeros;
+  uint8_t shift, sticky, neg;
+  float f;
+
+  num_scan(s, &n);
+  d = n.d;
+  q = n.q;
+  sticky = n.sticky;
+  neg = n.neg;
+  if (n.special)
+  {
+    bits = n.special == 'n' ? 0x7fc00000UL : 0x7f800000UL;
+    if (neg)
+      bits |= 0x80000000UL;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+  }
+
+  if (d == 0)
+    return neg ? -0.0f : 0.0f;
+  /* Both d and 10^|q| are exact floats, so one operation rounds right. */
+  if (!sticky && ((d < (1UL << 24) && q >= -9 && q <= 9) || q == 0))
+  {
+    if (q >= 0)
+      f = (float)d * (float)pgm_read_dword(&num_pow10[q]);
+    else
+      f = (float)d / (float)pgm_read_dword(&num_pow10[-q]);
+    return neg ? -f : f;
+  }
+  /*
+    Longer fixed-point values: d / 5^-q, by long division to at least 26
+    bits, and then the 2^q.
+  */
+  if (!sticky && q < 0 && q >= -9)
+  {
+    p = pgm_read_dword(&num_pow10[-q]) >> -q;
+    /* 27 zeros, plus the bits of p, less those of d. */
+    zeros = 27;
+    for (t = p; t; t >>= 1)
+      ++zeros;
+    for (t = d; t; t >>= 1)
+      --zeros;
+    if (zeros < 0)
+      zeros = 0;
+    d = num_div(d, zeros, p, &rem);
+    return num_make_float(d, q - zeros, rem != 0, neg);
+  }
+
+  if (q > 39)
+    return num_make_float(1, 128, 0, neg);
+  if (q < -55)
+    return neg ? -0.0f : 0.0f;
+  for (shift = 0; !(d >> 31); ++shift)
+    d <<= 1;
+  p = num_pow10_ext(q, &e, &sticky);
+  e -= shift;
+  d = num_mul_ext(d, p, &e, &sticky);
+  return num_make_float(d, e, sticky, neg);
+}
+
+/*
+  Format the fixed-point value v * 10^-decimals (decimals at most
+  NUM_MAX_DECIMALS), with exactly that many decimals. Needs up to 12 chars.
+  Returns the length; the text is not zero terminated.
+*/
+static uint8_t
+num_format_fixed(int32_t v, uint8_t decimals, char *buf)
+{
+  uint32_t u, p;
+  uint8_t idx = 0, i, started = 0;
+  char d;
+
+  if (v < 0)
+  {
+    buf[idx++] = '-';
+    u = -(uint32_t)v;
+  }
+  else
+    u = v;
+  /* The 10 digits of u, skipping leading zeros down to the units. */
+  for (i = 10; i-- > 0;)
+  {
+    p = pgm_read_dword(&num_pow10[i]);
+    for (d = '0'; u >= p; ++d)
+      u -= p;
+    if (i + 1 == decimals)
+    {
+      if (!started)
+        buf[idx++] = '0';
+      buf[idx++] = '.';
+      started = 1;
+    }
+    if (d != '0' || started || i == 0)
+    {
+      buf[idx++] = d;
+      started = 1;
+    }
+  }
+  return idx;
+}
+
+
+/*
+  Parse a decimal number (see num_scan()) into a fixed-point value with the
+  given number of decimals (at most NUM_MAX_DECIMALS), rounding half away
+  from zero. Out of range values saturate, and nan gives 0.
+*/
+static int32_t
+num_parse_fixed(const char *s, uint8_t decimals)
+{
+  struct num_dec n;
+  uint32_t x, p;
+  int16_t q;
+
+  num_scan(s, &n);
+  if (n.special == 'n')
+    return 0;
+  q = n.q + decimals;
+  if (n.special == 'i' || (n.d && q > 9))
+    x = NUM_HUGE;
+  else if (q >= 0)
+  {
+    for (x = n.d; q > 0 && num_push_digit(&x, 0); --q)
+      ;
+    if (q > 0)
+      x = NUM_HUGE;
+  }
+  else if (q < -9)
+    x = 0;
+  else
+  {
+    p = pgm_read_dword(&num_pow10[-q]);
+    x = n.d / p;
+    if (2*(n.d - x*p) >= p)
+      ++x;
+  }
+  if (n.neg)
+    return x >= 0x80000000UL ? INT32_MIN : -(int32_t)x;
+  return x >= 0x7fffffffUL ? INT32_MAX : (int32_t)x;
+}
+
+#endif  /* LABIBUS_NUM_H */
@@ -1,4 +1,5 @@
 #include <util/delay.h>
+#include <avr/pgmspace.h>
 
 #include "Labibus.h"
 
@@ -8,7 +9,8 @@ main(int argc, char *argv[])
   float val1, val2;
 
   labibus_init( 9, 10, "Temperature room 2", "degree C");
-  labibus_init(11, 60, "Humidity 2", "%rel");
+  /* Strings in flash take no RAM. */
+  labibus_init_P(11, 60, PSTR("Humidity 2"), PSTR("%rel"));
 
   val1 = 0.0f;
   val2 = 10.0f;
@@ -0,0 +1,615 @@
+/*
+  Poll-cycle benchmark on the simulated RS485 bus.
+
+  Runs a number of slave nodes, each serving one sensor with the Labibus
+  library, and a master that polls them round-robin for the given amount of
+  virtual time, after discovering them all. Reports the time taken by
+  discovery, the poll rate, and the master's view of the slave turnaround
+  (end of request to start of reply).
+
+  Odd-numbered slaves set float values, even-numbered ones set fixed-point
+  values with 2 decimals through the integer API. Every fourth slave has two
+  channels, a temperature and a humidity 50 above it, sent in one reply.
+  Single-channel slaves with IDs divisible by 3 are configured with
+  labibus_init_P() (on the host, "flash" is ordinary memory).
+
+  One more node listens to the replies of as many of the first slaves as fit
+  in MAX_DEVICES slots, and counts the values it sees, checking that the
+  float and fixed-point views of each value agree, and that the channels of
+  a reply belong together.
+
+  Slave 1 also adds every value it sets to a sample ring. Once per cycle the
+  master asks it for the aggregate and history of its samples, and checks
+  them against the steady ramp of the values. It also reads the bus
+  statistics of slave 1's node, which are reported at the end.
+
+  With format "binary", the master polls the slaves that announce support
+  for it with binary frames, instead of text.
+
+  The slaves have a deadband of DEADBAND. With strategy "sweep", the master
+  asks each slave which of its devices changed past the deadband, and only
+  polls those, instead of polling every device every cycle. With strategy
+  "range", it polls all of them with a single range poll per cycle, and they
+  reply in time slots.
+
+  Every slave has a poll callback, which checks the time of each poll
+  against what labibus_time_to_poll() predicted after the previous one: a
+  poll before that is early, and the predicted wait over the actual time
+  between polls is the quiet window the slave could use.
+
+  Discovery is either a scan, a discovery request to each of the 128 IDs,
+  or slotted: one slotted discovery request for all IDs, after which only
+  the IDs found (and not in the cache, which starts out empty) are asked for
+  their descriptions. The presence replies are checked against the CRC of
+  the discovery replies.
+
+  With noise_ppm, that many chars in a million are garbled at each receiver,
+  to see how quickly the nodes recover from broken frames.
+
+  Usage: bus_bench [nodes [seconds [baud [turnaround_us [format [strategy
+                   [discovery [noise_ppm]]]]]]]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Labibus.h"
+#include "Labibus_crc.h"
+#include "sim_hal.h"
+#include "sim_bus.h"
+#include "master.h"
+
+
+struct slave {
+  uint8_t id;
+  char name[16];
+  char description[40];
+};
+
+static struct {
+  uint32_t discovered, enumerated, presence_mismatches;
+  uint64_t discover_time, enumerate_time;
+  uint32_t polls, replies, timeouts, bad;
+  uint32_t cycles;
+  uint64_t turnaround_sum, turnaround_max;
+  uint64_t cycle_sum, cycle_max;
+  uint32_t listened_polls, heard, fixed_mismatches, group_mismatches;
+  uint32_t aggregates, aggregated, histories, history_samples, sample_errors;
+  uint32_t sweeps, changed;
+  uint32_t ranges;
+  uint32_t node_stats_reads;
+  uint32_t poll_callbacks, predictions, early_polls;
+  double quiet_sum;
+  /* The last bus statistics of slave 1, as in struct labibus_stats. */
+  struct labibus_stats node;
+} stats;
+
+#define SLAVE_CHANNELS(id) ((id) % 4 == 0 ? 2 : 1)
+/* The values go up by 25 per second, so they pass this every 0.4 s. */
+#define DEADBAND 10.0f
+
+static uint8_t num_slaves;
+static bool listened[128];
+static uint16_t turnaround_us = 1000;
+static bool use_binary;
+enum strategy { STRATEGY_POLL, STRATEGY_SWEEP, STRATEGY_RANGE };
+static enum strategy strategy;
+static const char *const strategy_names[] = { "poll", "sweep", "range" };
+static uint32_t baud = LABIBUS_BAUD;
+static bool slotted_discovery = true;
+static uint32_t noise_ppm;
+static bool slave_binary[128];
+/*
+  The master, on the host port. Its devices hold what slotted discovery
+  found, and it holds the last good reply (binary replies COBS-decoded).
+*/
+static struct master bus;
+/* Per slave: the time of its last poll, and of its next one as predicted. */
+static uint64_t last_polled[128], predicted_poll[128];
+
+
+/* Poll callback of the slaves; runs in the thread of the slave. */
+static void
+on_poll(uint8_t id)
+{
+  uint64_t now = sim_now();
+  uint16_t wait;
+
+  ++stats.poll_callbacks;
+  if (predicted_poll[id])
+  {
+    ++stats.predictions;
+    if (now < predicted_poll[id])
+      ++stats.early_polls;
+    stats.quiet_sum += (double)(predicted_poll[id] - last_polled[id]) /
+      (now - last_polled[id]);
+  }
+  last_polled[id] = now;
+  wait = labibus_time_to_poll(id);
+  predicted_poll[id] = wait ? now + wait * 1000000ULL : 0;
+}
+
+
+static void
+slave_main(void *arg)
+{
+  struct slave *s = (struct slave *)arg;
+  const char *descriptions[2] = { s->description, "Simulated humidity" };
+  const char *units[2] = { "degree C", "%rel" };
+  float val = s->id;
+  int32_t centi = s->id * 100;
+  int32_t centis[2];
+
+  if (SLAVE_CHANNELS(s->id) == 1 && s->id % 3 == 0)
+    labibus_init_P(s->id, 10, s->description, PSTR("degree C"), 2, DEADBAND);
+  else if (SLAVE_CHANNELS(s->id) == 1)
+    labibus_init(s->id, 10, s->description, "degree C", 2, DEADBAND);
+  else
+    labibus_init_channels(s->id, 10, 2, descriptions, units, 2, DEADBAND);
+  labibus_set_turnaround(turnaround_us);
+  labibus_set_poll_callback(on_poll);
+  if (s->id == 1)
+    labibus_enable_samples(s->id);
+  for (;;)
+  {
+    if (s->id == 1)
+      labibus_add_sample(s->id, val);
+    if (SLAVE_CHANNELS(s->id) == 2)
+    {
+      centis[0] = centi;
+      centis[1] = centi + 5000;
+      labibus_set_sensor_values_i32(s->id, centis);
+    }
+    else if (s->id & 1)
+      labibus_set_sensor_value(s->id, val);
+    else
+      labibus_set_sensor_value_i32(s->id, centi);
+    _delay_ms(5);
+    val += 0.125f;
+    centi += 25;
+  }
+}
+
+
+static void
+listener_main(void *)
+{
+  uint8_t id, n, slots, c;
+  float vals[2];
+  int32_t fixed[2];
+
+  slots = 0;
+  for (n = 0; n < num_slaves; ++n)
+  {
+    if (slots + SLAVE_CHANNELS(n + 1) > MAX_DEVICES)
+      break;
+    slots += SLAVE_CHANNELS(n + 1);
+    labibus_listen_channels(n + 1, SLAVE_CHANNELS(n + 1), 3);
+    listened[n + 1] = true;
+  }
+  for (;;)
+  {
+    for (id = 1; id <= n; ++id)
+    {
+      if (!labibus_check_data(id))
+        continue;
+      labibus_get_data_channels(id, vals);
+      if (labibus_get_data_channels_i32(id, fixed) != SLAVE_CHANNELS(id))
+        ++stats.group_mismatches;
+      for (c = 0; c < SLAVE_CHANNELS(id); ++c)
+        if (fixed[c] != (int32_t)(vals[c] * 1000.0f + 0.5f))
+          ++stats.fixed_mismatches;
+      if (SLAVE_CHANNELS(id) == 2 && vals[1] != vals[0] + 50.0f)
+        ++stats.group_mismatches;
+      ++stats.heard;
+    }
+    _delay_ms(1);
+  }
+}
+
+
+/*
+  Send a request and wait for the reply. Returns the turnaround in ns, or 0
+  on timeout or bad reply. Discovery replies are checked for binary support.
+*/
+static uint64_t
+transact(uint8_t id, uint8_t type)
+{
+  uint64_t t;
+
+  switch (master_transact(&bus, id, type, use_binary && slave_binary[id], &t))
+  {
+  case MASTER_TIMEOUT:
+    ++stats.timeouts;
+    return 0;
+  case MASTER_BAD:
+    ++stats.bad;
+    return 0;
+  }
+  if (type == 'D')
+    slave_binary[id] = master_parse_discover(&bus.devices[id], bus.reply,
+                                             bus.reply_len) &&
+      bus.devices[id].binary;
+  return t;
+}
+
+
+/*
+  Get the next number of a text reply, from p up to the next '|', and move
+  p past it.
+*/
+static float
+next_field(const uint8_t **p)
+{
+  float v = strtof((const char *)*p, NULL);
+
+  *p = (const uint8_t *)memchr(*p, '|', 64) + 1;
+  return v;
+}
+
+
+/*
+  Ask slave 1 for the aggregate and history of its samples. Its values go up
+  by 0.125 every 5 ms, so the aggregate must span (count-1) steps with the
+  mean halfway, and the history must be a run of steps with ages 5 ms apart.
+*/
+static void
+check_samples(void)
+{
+  bool binary = use_binary && slave_binary[1];
+  const uint8_t *p;
+  uint32_t count, age, prev_age = 0;
+  float stats3[3], v, prev = 0.0f;
+  uint8_t n, i;
+
+  if (transact(1, 'A'))
+  {
+    ++stats.aggregates;
+    if (binary)
+    {
+      count = bus.reply[2] | (bus.reply[3] << 8);
+      if (count)
+        memcpy(stats3, &bus.reply[4], 12);
+    }
+    else
+    {
+      p = &bus.reply[5];
+      count = next_field(&p);
+      for (i = 0; count && i < 3; ++i)
+        stats3[i] = next_field(&p);
+    }
+    stats.aggregated += count;
+    if (count && (stats3[1] - stats3[0] != (count - 1) * 0.125f ||
+                  fabsf(stats3[2] - (stats3[0] + stats3[1]) / 2) > 1e-3f))
+      ++stats.sample_errors;
+  }
+
+  if (transact(1, 'H'))
+  {
+    ++stats.histories;
+    n = binary ? (bus.reply_len - 4) / 8 : 0;
+    p = &bus.reply[5];
+    for (i = 0; binary ? i < n : p < bus.reply + bus.reply_len - 4; ++i)
+    {
+      if (binary)
+      {
+        memcpy(&age, &bus.reply[2 + 8*i], 4);
+        memcpy(&v, &bus.reply[6 + 8*i], 4);
+      }
+      else
+      {
+        age = next_field(&p);
+        v = next_field(&p);
+      }
+      if (i > 0 && (v != prev + 0.125f || prev_age - age < 4 ||
+                    prev_age - age > 6))
+        ++stats.sample_errors;
+      prev = v;
+      prev_age = age;
+      ++stats.history_samples;
+    }
+  }
+}
+
+
+/* Ask slave 1 for the bus statistics of its node. */
+static void
+read_node_stats(void)
+{
+  bool binary = use_binary && slave_binary[1];
+  uint16_t fields[sizeof(struct labibus_stats) / 2];
+  const uint8_t *p = &bus.reply[5];
+  uint8_t i;
+
+  if (!transact(1, 'S'))
+    return;
+  if (binary && bus.reply_len != 4 + sizeof(fields))
+    return;
+  for (i = 0; i < sizeof(fields) / 2; ++i)
+  {
+    if (binary)
+      memcpy(&fields[i], &bus.reply[2 + 2*i], 2);
+    else
+      fields[i] = next_field(&p);
+  }
+  memcpy(&stats.node, fields, sizeof(fields));
+  ++stats.node_stats_reads;
+}
+
+
+static void
+poll(uint8_t id)
+{
+  uint64_t t;
+
+  ++stats.polls;
+  if (!(t = transact(id, 'P')))
+    return;
+  ++stats.replies;
+  if (listened[id])
+    ++stats.listened_polls;
+  stats.turnaround_sum += t;
+  if (t > stats.turnaround_max)
+    stats.turnaround_max = t;
+}
+
+
+/* Ask a slave which of its devices changed, and poll those. */
+static void
+sweep(uint8_t id)
+{
+  bool binary = use_binary && slave_binary[id];
+  uint8_t ids[MAX_DEVICES], n = 0, i;
+
+  ++stats.sweeps;
+  if (!transact(id, 'C'))
+    return;
+  if (binary)
+    for (i = 2; i + 2 < bus.reply_len && n < MAX_DEVICES; ++i)
+      ids[n++] = bus.reply[i];
+  else
+    for (i = 5; i + 6 < bus.reply_len && n < MAX_DEVICES; i += 2)
+      if (master_hex_byte(&bus.reply[i]) >= 0)
+        ids[n++] = master_hex_byte(&bus.reply[i]);
+  stats.changed += n;
+  for (i = 0; i < n; ++i)
+    poll(ids[i]);
+}
+
+
+/*
+  Longest replies in the bench, in chars with the sync byte: two fixed-point
+  channels, "!ii:P627.00|677.00|cccc\r\n", and in binary an 'I' frame with
+  two values. The slots of range polls take that, plus a margin, as those of
+  slotted discovery do for the presence replies.
+*/
+#define RANGE_TEXT_CHARS 27
+#define RANGE_BINARY_CHARS 17
+
+static uint16_t
+range_slot_us(uint8_t type)
+{
+  uint32_t chars;
+
+  if (type == 'E')
+    chars = use_binary ? MASTER_PRESENCE_BINARY_CHARS :
+      MASTER_PRESENCE_TEXT_CHARS;
+  else
+    chars = use_binary ? RANGE_BINARY_CHARS : RANGE_TEXT_CHARS;
+  return master_slot_us(&bus, chars);
+}
+
+
+/* Count the range poll replies of listened slaves. */
+static void
+range_reply(struct master *, uint8_t id, void *)
+{
+  if (listened[id])
+    ++stats.listened_polls;
+}
+
+
+/*
+  Send a range poll ('R') or slotted discovery ('E') for devices lo to hi,
+  and collect the replies. Returns the number of good replies.
+*/
+static uint32_t
+range_request(uint8_t type, uint8_t lo, uint8_t hi)
+{
+  return master_range(&bus, type, lo, hi, range_slot_us(type), use_binary,
+                      type == 'R' ? range_reply : NULL, NULL, &stats.bad);
+}
+
+
+/* Poll devices lo to hi with one range poll. */
+static void
+range_poll(uint8_t lo, uint8_t hi)
+{
+  ++stats.ranges;
+  stats.polls += hi - lo + 1;
+  stats.replies += range_request('R', lo, hi);
+}
+
+
+/*
+  Discover the devices on the bus. In a real master, a cache kept across
+  restarts would save most of the discovery requests after slotted discovery.
+*/
+static void
+discover(void)
+{
+  uint64_t start = sim_now();
+  uint16_t id;
+
+  if (!slotted_discovery)
+  {
+    for (id = 0; id < 128; ++id)
+      if (transact(id, 'D'))
+        ++stats.discovered;
+    stats.discover_time = sim_now() - start;
+    return;
+  }
+  stats.enumerated = range_request('E', 0, 127);
+  stats.enumerate_time = sim_now() - start;
+  for (id = 0; id < 128; ++id)
+  {
+    if (!bus.devices[id].present || !transact(id, 'D'))
+      continue;
+    ++stats.discovered;
+    if (crc16_buf(bus.reply, bus.reply_len - 4) !=
+        bus.devices[id].presence_crc)
+      ++stats.presence_mismatches;
+  }
+  stats.discover_time = sim_now() - start;
+}
+
+
+static void
+master_main(void *)
+{
+  uint8_t id;
+  uint64_t start, d;
+
+  master_init(&bus, &sim_master_port, baud, turnaround_us);
+  /* Give the slaves time to start up and get a first value. */
+  sim_delay_ns(20000000ULL);
+
+  discover();
+  /* Empty IDs time out in a scan; only count the timeouts of polls. */
+  stats.timeouts = 0;
+
+  for (;;)
+  {
+    start = sim_now();
+    if (strategy == STRATEGY_RANGE)
+      range_poll(1, num_slaves);
+    for (id = 1; strategy != STRATEGY_RANGE && id <= num_slaves; ++id)
+    {
+      if (strategy == STRATEGY_SWEEP)
+        sweep(id);
+      else
+        poll(id);
+    }
+    check_samples();
+    read_node_stats();
+    d = sim_now() - start;
+    ++stats.cycles;
+    stats.cycle_sum += d;
+    if (d > stats.cycle_max)
+      stats.cycle_max = d;
+  }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t seconds = 10;
+  struct slave *slaves;
+  struct sim_wire_stats ws;
+  uint8_t i;
+
+  num_slaves = 32;
+  if (argc > 1)
+    num_slaves = atoi(argv[1]);
+  if (argc > 2)
+    seconds = atoi(argv[2]);
+  if (argc > 3)
+    baud = atoi(argv[3]);
+  if (argc > 4)
+    turnaround_us = atoi(argv[4]);
+  if (argc > 5)
+    use_binary = strcmp(argv[5], "binary") == 0;
+  if (argc > 6)
+  {
+    while (strategy <= STRATEGY_RANGE &&
+           strcmp(argv[6], strategy_names[strategy]) != 0)
+      strategy = (enum strategy)(strategy + 1);
+  }
+  if (argc > 7)
+    slotted_discovery = strcmp(argv[7], "slotted") == 0;
+  if (argc > 8)
+    noise_ppm = atoi(argv[8]);
+  if (num_slaves < 1 || num_slaves > 127 ||
+      (argc > 5 && !use_binary && strcmp(argv[5], "text") != 0) ||
+      strategy > STRATEGY_RANGE ||
+      (argc > 7 && !slotted_discovery && strcmp(argv[7], "scan") != 0))
+  {
+    fprintf(stderr, "Usage: %s [nodes(1-127) [seconds [baud "
+            "[turnaround_us [text|binary [poll|sweep|range "
+            "[scan|slotted [noise_ppm]]]]]]]]\n", argv[0]);
+    return 1;
+  }
+
+  sim_init(baud);
+  sim_set_noise(noise_ppm);
+  slaves = (struct slave *)calloc(num_slaves, sizeof(*slaves));
+  for (i = 0; i < num_slaves; ++i)
+  {
+    slaves[i].id = i + 1;
+    snprintf(slaves[i].name, sizeof(slaves[i].name), "slave%u", i + 1);
+    snprintf(slaves[i].description, sizeof(slaves[i].description),
+             "Simulated temperature %u", i + 1);
+    sim_add_node(slaves[i].name, SIM_NODE_AVR, slave_main, &slaves[i]);
+  }
+  sim_add_node("listener", SIM_NODE_AVR, listener_main, NULL);
+  sim_add_node("master", SIM_NODE_HOST, master_main, NULL);
+  sim_run((uint64_t)seconds * 1000000000ULL);
+  sim_get_wire_stats(&ws);
+
+  printf("%u nodes, %u baud, %u us turnaround, %u s simulated, %s %s\n",
+         num_slaves, baud, turnaround_us, seconds,
+         use_binary ? "binary" : "text", strategy_names[strategy]);
+  if (slotted_discovery)
+    printf("enumerate:  %u devices in %.2f ms, %u us slots, "
+           "%u presence mismatches\n", stats.enumerated,
+           stats.enumerate_time / 1e6, range_slot_us('E'),
+           stats.presence_mismatches);
+  printf("discovery:  %u devices in %.2f ms (%s)\n", stats.discovered,
+         stats.discover_time / 1e6, slotted_discovery ? "slotted" : "scan");
+  printf("polls:      %u (%u replies, %u timeouts, %u bad)\n",
+         stats.polls, stats.replies, stats.timeouts, stats.bad);
+  printf("poll rate:  %.1f polls/s\n", (double)stats.replies / seconds);
+  if (strategy == STRATEGY_SWEEP)
+    printf("sweeps:     %u, %u changed devices\n", stats.sweeps,
+           stats.changed);
+  if (strategy == STRATEGY_RANGE)
+    printf("ranges:     %u, %u us slots\n", stats.ranges,
+           range_slot_us('R'));
+  /* Range polls have no turnaround of their own to measure. */
+  if (stats.replies && strategy != STRATEGY_RANGE)
+    printf("turnaround: %.1f us mean, %.1f us max\n",
+           stats.turnaround_sum / 1e3 / stats.replies,
+           stats.turnaround_max / 1e3);
+  if (stats.cycles)
+    printf("cycle:      %.2f ms mean, %.2f ms max (%u full cycles)\n",
+           stats.cycle_sum / 1e6 / stats.cycles, stats.cycle_max / 1e6,
+           stats.cycles);
+  printf("listener:   %u of %u replies heard, %u fixed-point mismatches, "
+         "%u channel group mismatches\n", stats.heard, stats.listened_polls,
+         stats.fixed_mismatches, stats.group_mismatches);
+  printf("samples:    %u aggregates of %u samples, %u histories of %u "
+         "samples, %u errors\n", stats.aggregates, stats.aggregated,
+         stats.histories, stats.history_samples, stats.sample_errors);
+  if (stats.predictions)
+    printf("prediction: %u poll callbacks, %u predictions, %u early, "
+           "%.1f%% of the time between polls predicted quiet\n",
+           stats.poll_callbacks, stats.predictions, stats.early_polls,
+           100.0 * stats.quiet_sum / stats.predictions);
+  if (stats.node_stats_reads)
+    printf("node 1:     %u frames, %u addressed, %u CRC errors, %u too long, "
+           "%u dropped, %u FE, %u DOR, %u aborted, %u replies, "
+           "%.1f us ISR max, %.1f us turnaround max\n", stats.node.frames,
+           stats.node.addressed, stats.node.crc_errors, stats.node.too_long,
+           stats.node.dropped, stats.node.framing_errors,
+           stats.node.data_overruns, stats.node.aborted, stats.node.replies,
+           stats.node.isr_max_ticks * 8e6 / F_CPU,
+           stats.node.turnaround_max_ticks * 8e6 / F_CPU);
+  printf("wire:       %u chars, %u collisions, %u overruns, %u noise hits\n",
+         ws.chars, ws.collisions, ws.overruns, ws.noise);
+
+  sim_shutdown();
+  return 0;
+}
@@ -0,0 +1,287 @@
+/*
+  Labibus bus captures, see capture.h.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "capture.h"
+
+
+#define FILE_HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 20
+
+
+void
+capture_init(struct capture_framer *f, uint32_t baud,
+             void (*emit)(void *arg, const struct capture_record *r,
+                          const uint8_t *data),
+             void *arg)
+{
+  uint64_t chars_us = (uint64_t)RCV_IDLE_CHARS * 10 * 1000000 / baud;
+
+  memset(f, 0, sizeof(*f));
+  f->idle_us = chars_us > RCV_IDLE_US ? chars_us : RCV_IDLE_US;
+  f->emit = emit;
+  f->arg = arg;
+}
+
+
+/* Hand over the record being collected, if any, and start over. */
+static void
+end_record(struct capture_framer *f, uint8_t flags)
+{
+  if (f->rec.len)
+  {
+    f->rec.flags |= flags;
+    f->emit(f->arg, &f->rec, f->data);
+  }
+  f->rec.len = 0;
+  f->rec.kind = CAPTURE_GARBAGE;
+  f->rec.flags = 0;
+}
+
+
+static void
+append(struct capture_framer *f, uint8_t c, uint64_t time_us)
+{
+  if (f->rec.len == CAPTURE_MAX_LEN)
+    /* Only garbage gets this long. */
+    end_record(f, 0);
+  if (!f->rec.len)
+    f->rec.start_us = time_us;
+  f->rec.end_us = time_us;
+  f->data[f->rec.len++] = c;
+}
+
+
+/* Start a frame, after the garbage before it, if it is not a sync byte. */
+static void
+start_frame(struct capture_framer *f, uint8_t kind)
+{
+  uint8_t flags = 0;
+
+  if (f->rec.kind != CAPTURE_GARBAGE)
+    end_record(f, 0);
+  if (f->rec.len == 1 && f->data[0] == 0xff)
+  {
+    f->rec.len = 0;
+    flags = CAPTURE_SYNC;
+  }
+  end_record(f, 0);
+  f->rec.kind = kind;
+  f->rec.flags = flags;
+}
+
+
+/*
+  The bytes go through the framer of the library (Labibus_frame.h), with the
+  frames counted as the library does in store_received_char() and
+  process_received_char(); a record ends where the frame ends or is
+  abandoned.
+*/
+void
+capture_feed(struct capture_framer *f, uint8_t c, uint8_t errors,
+             uint64_t time_us)
+{
+  uint8_t events, ch;
+
+  if (time_us - f->last_us > f->idle_us)
+  {
+    events = frame_rx_abort(&f->rx, 1);
+    if (events & FRAME_ABORTED)
+      ++f->aborted;
+    /* Garbage ends at a pause too. */
+    end_record(f, events & FRAME_ABORTED ? CAPTURE_IDLE : 0);
+  }
+  f->last_us = time_us;
+
+  if (errors)
+  {
+    append(f, c, time_us);
+    f->rec.flags |= CAPTURE_ERROR;
+    /* A break reads as a zero byte with a framing error. */
+    if (frame_rx_abort(&f->rx, c == 0 && (errors & CAPTURE_FE)))
+    {
+      ++f->aborted;
+      end_record(f, 0);
+    }
+    return;
+  }
+
+  events = frame_rx_byte(&f->rx, c, &ch);
+  if (events & FRAME_ABORTED)
+  {
+    /* Cut short by the start of the next frame. */
+    ++f->aborted;
+    end_record(f, 0);
+  }
+  if (events & FRAME_STARTED)
+    start_frame(f, f->rx.mode == FRAME_RX_TEXT ? CAPTURE_TEXT
+                : CAPTURE_BINARY);
+  append(f, c, time_us);
+  if (events & FRAME_HEADER)
+    ++f->frames;
+  if (events & FRAME_TOO_LONG)
+  {
+    ++f->too_long;
+    end_record(f, CAPTURE_TOO_LONG);
+  }
+  if (events & FRAME_ENDED)
+    end_record(f, events & FRAME_COMPLETE ? CAPTURE_COMPLETE : 0);
+}
+
+
+void
+capture_flush(struct capture_framer *f)
+{
+  end_record(f, 0);
+  f->rx.mode = FRAME_RX_IDLE;
+}
+
+
+bool
+capture_frame_info(const struct capture_record *r, const uint8_t *data,
+                   struct capture_frame *info)
+{
+  uint8_t buf[CAPTURE_MAX_LEN];
+  uint16_t len;
+  int n;
+
+  if (r->kind == CAPTURE_TEXT)
+  {
+    n = r->len < 5 ? -1 : master_hex_byte(data + 1);
+    if (n < 0 || n > 127)
+      return false;
+    info->reply = data[0] == '!';
+    info->id = n;
+    info->type = data[4];
+    return true;
+  }
+  if (r->kind != CAPTURE_BINARY)
+    return false;
+  /* What there is after the opening delimiter, up to the closing one. */
+  len = r->len - 1;
+  if (len > 0 && data[r->len - 1] == 0)
+    --len;
+  memcpy(buf, data + 1, len);
+  n = master_cobs_decode(buf, len);
+  if (n < 2)
+    return false;
+  info->reply = buf[0] & 0x80;
+  info->id = buf[0] & 0x7f;
+  info->type = buf[1];
+  return true;
+}
+
+
+int
+capture_frame_body(const struct capture_record *r, const uint8_t *data,
+                   uint8_t *buf)
+{
+  uint16_t i, n = 0;
+
+  if (!(r->flags & CAPTURE_COMPLETE))
+    return -1;
+  if (r->kind == CAPTURE_BINARY)
+  {
+    memcpy(buf, data + 1, r->len - 2);
+    return master_cobs_decode(buf, r->len - 2);
+  }
+  /* The library ignores CR anywhere in a text frame. */
+  for (i = 0; i < r->len; ++i)
+    if (data[i] != '\r' && data[i] != '\n')
+      buf[n++] = data[i];
+  return n;
+}
+
+
+int64_t
+capture_latency_us(const struct capture_record *req,
+                   const struct capture_record *reply, uint32_t baud)
+{
+  int64_t char_us = (10 * 1000000 + baud / 2) / baud;
+
+  return (int64_t)reply->start_us -
+    (reply->flags & CAPTURE_SYNC ? char_us : 0) -
+    ((int64_t)req->end_us + char_us);
+}
+
+
+static void
+put_le(uint8_t *p, uint64_t x, uint8_t size)
+{
+  uint8_t i;
+
+  for (i = 0; i < size; ++i)
+    p[i] = x >> (8 * i);
+}
+
+
+static uint64_t
+get_le(const uint8_t *p, uint8_t size)
+{
+  uint64_t x = 0;
+  uint8_t i;
+
+  for (i = 0; i < size; ++i)
+    x |= (uint64_t)p[i] << (8 * i);
+  return x;
+}
+
+
+int
+capture_write_header(FILE *f, uint32_t baud)
+{
+  uint8_t h[FILE_HEADER_SIZE];
+
+  memset(h, 0, sizeof(h));
+  memcpy(h, CAPTURE_MAGIC, 8);
+  put_le(h + 8, baud, 4);
+  return fwrite(h, sizeof(h), 1, f) == 1 ? 0 : -1;
+}
+
+
+int
+capture_write(FILE *f, const struct capture_record *r, const uint8_t *data)
+{
+  uint8_t h[RECORD_HEADER_SIZE];
+
+  put_le(h, r->start_us, 8);
+  put_le(h + 8, r->end_us, 8);
+  put_le(h + 16, r->len, 2);
+  h[18] = r->kind;
+  h[19] = r->flags;
+  if (fwrite(h, sizeof(h), 1, f) != 1 ||
+      fwrite(data, 1, r->len, f) != r->len)
+    return -1;
+  return 0;
+}
+
+
+bool
+capture_read_header(FILE *f, uint32_t *baud)
+{
+  uint8_t h[FILE_HEADER_SIZE];
+
+  if (fread(h, sizeof(h), 1, f) != 1 || memcmp(h, CAPTURE_MAGIC, 8) != 0)
+    return false;
+  *baud = get_le(h + 8, 4);
+  return *baud > 0;
+}
+
+
+bool
+capture_read(FILE *f, struct capture_record *r, uint8_t *data)
+{
+  uint8_t h[RECORD_HEADER_SIZE];
+
+  if (fread(h, sizeof(h), 1, f) != 1)
+    return false;
+  r->start_us = get_le(h, 8);
+  r->end_us = get_le(h + 8, 8);
+  r->len = get_le(h + 16, 2);
+  r->kind = h[18];
+  r->flags = h[19];
+  return r->len <= CAPTURE_MAX_LEN && fread(data, 1, r->len, f) == r->len;
+}
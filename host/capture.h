@@ -0,0 +1,127 @@
+/*
+  Labibus bus captures: everything seen on the wire, in frames, with times.
+
+  The framer splits the bytes received into records with the framing code
+  of the library (Labibus_frame.h), as a node that takes every frame: text
+  frames run from '?' or '!' to the end of line, and binary frames between
+  zero delimiters; a frame is cut short by a receive error, by a pause of
+  the receive idle timeout (RCV_IDLE_US, and at least RCV_IDLE_CHARS char
+  times), by a new start marker (a zero in a binary frame with its last COBS
+  block incomplete is one), or by growing longer than MAX_REQ after COBS
+  decoding. Bytes outside of frames are kept as garbage records; the sync
+  byte (0xff) just before a reply is not, but is flagged in the reply. The
+  framer counts frames, and those too long or aborted, as the library does
+  in its bus statistics; capture_bench checks that they agree.
+
+  A capture file has a header (the magic and the baud rate) and then the
+  records, each with the times of the start bits of its first and last byte
+  in microseconds from the start of the capture, its kind and flags, and its
+  bytes as they were on the wire. Numbers are little endian.
+*/
+
+#ifndef LABIBUS_CAPTURE_H
+#define LABIBUS_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "master.h"
+#include "Labibus_frame.h"
+
+
+#define CAPTURE_MAGIC "LBCAPTR1"
+/* The longest record; longer garbage is split. */
+#define CAPTURE_MAX_LEN 256
+
+/* Kinds of records. */
+#define CAPTURE_GARBAGE 0
+#define CAPTURE_TEXT 1
+#define CAPTURE_BINARY 2
+
+/* Flags of records. */
+#define CAPTURE_COMPLETE 0x01  /* A whole frame, as the library takes it. */
+#define CAPTURE_SYNC 0x02      /* Came after a sync byte. */
+#define CAPTURE_ERROR 0x04     /* Has a byte with a receive error. */
+#define CAPTURE_IDLE 0x08      /* Cut short by a pause. */
+#define CAPTURE_TOO_LONG 0x10  /* Cut short at MAX_REQ. */
+
+/* Framing error, as in the UART status register (and SIM_FE). */
+#define CAPTURE_FE 0x10
+
+struct capture_record {
+  uint64_t start_us, end_us;
+  uint16_t len;
+  uint8_t kind;
+  uint8_t flags;
+};
+
+/* A frame record, as far as it could be decoded. */
+struct capture_frame {
+  uint8_t id;
+  uint8_t type;
+  bool reply;
+};
+
+struct capture_framer {
+  /* The pause that ends a frame, and the time of the last byte. */
+  uint64_t idle_us;
+  uint64_t last_us;
+  /* The frame being received, as the library receives it. */
+  struct frame_rx rx;
+  /* The record being collected. */
+  struct capture_record rec;
+  uint8_t data[CAPTURE_MAX_LEN];
+  /* As in struct labibus_stats. */
+  uint32_t frames, too_long, aborted;
+  /* Called with each record as it ends. */
+  void (*emit)(void *arg, const struct capture_record *r,
+               const uint8_t *data);
+  void *arg;
+};
+
+
+extern void capture_init(struct capture_framer *f, uint32_t baud,
+                         void (*emit)(void *arg,
+                                      const struct capture_record *r,
+                                      const uint8_t *data),
+                         void *arg);
+/*
+  Feed a byte received at the given time, with its receive errors (the bits
+  of the UART status register, 0 if none). capture_flush() ends the record
+  being collected, at the end of a capture.
+*/
+extern void capture_feed(struct capture_framer *f, uint8_t c, uint8_t errors,
+                         uint64_t time_us);
+extern void capture_flush(struct capture_framer *f);
+
+/*
+  Find the device, type and direction of a frame record. Returns false for
+  garbage, and frames too short or broken to tell.
+*/
+extern bool capture_frame_info(const struct capture_record *r,
+                               const uint8_t *data,
+                               struct capture_frame *info);
+/*
+  The body of a complete frame, as master_check_reply() and
+  master_check_binary_reply() take it: a text frame without the end of line,
+  or a binary frame decoded into buf. Returns the length, or -1.
+*/
+extern int capture_frame_body(const struct capture_record *r,
+                              const uint8_t *data, uint8_t *buf);
+
+/*
+  The latency of a reply: from the end of the request to the first byte of
+  the reply (its sync byte, if it had one), in microseconds.
+*/
+extern int64_t capture_latency_us(const struct capture_record *req,
+                                  const struct capture_record *reply,
+                                  uint32_t baud);
+
+/* Write and read capture files. Return -1 or false on failure, or at EOF. */
+extern int capture_write_header(FILE *f, uint32_t baud);
+extern int capture_write(FILE *f, const struct capture_record *r,
+                         const uint8_t *data);
+extern bool capture_read_header(FILE *f, uint32_t *baud);
+extern bool capture_read(FILE *f, struct capture_record *r, uint8_t *data);
+
+#endif  /* LABIBUS_CAPTURE_H */
@@ -0,0 +1,355 @@
+/*
+  Checks the framer of bus captures (capture.h) against the receiver of the
+  library: the same bytes go over the simulated bus to a listener node and
+  into a framer, and the frames, too long frames and aborted frames they
+  count must agree, as must the complete frames of the framer and the CRC
+  errors of the listener.
+
+  The bytes are poll replies from the devices listened to, text and binary,
+  intact and broken in the ways of a real bus: cut short by the next frame,
+  paused for longer than the receive idle timeout, garbled by a second
+  driver (a receive error), or too long; with garbage and sync bytes between
+  them. The CRCs are all wrong, so that the listener takes each complete
+  frame for a CRC error.
+
+  The framer takes every frame, while the library skips those that are not
+  addressed to it, so the stream is made of frames addressed to the
+  listener only. A binary frame cut short takes in what comes after it, up
+  to the opening delimiter of the next frame, if not past it; and after one
+  paused or garbled part way (a garbled zero reads as a break), the rest of
+  it may come in between frames, and its closing delimiter then opens a
+  frame. So the next frame is binary, without garbage before it, and its
+  own delimiter starts over; and so is the one after a frame that came
+  after one cut short. Binary frames have no '?' or '!' in them, which
+  would open a text frame when the start of the binary frame was lost;
+  garbage has no end of line, which would end a text frame cut short.
+
+  The counters of the library are 16 bits, which limits the frames sent.
+
+  The simulation is deterministic: the same seed gives the same stream.
+
+  Usage: capture_bench [frames [baud [seed]]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Labibus.h"
+#include "Labibus_crc.h"
+#include "sim_hal.h"
+#include "sim_bus.h"
+#include "master.h"
+#include "capture.h"
+
+
+/* Devices 1 to LISTENED are listened to. */
+#define LISTENED MAX_DEVICES
+/* So that none of the counters of the listener wraps. */
+#define MAX_FRAMES 30000
+
+/* The ways of breaking a frame. */
+#define INTACT 0
+#define CUT_SHORT 1
+#define PAUSED 2
+#define GARBLED 3
+#define TOO_LONG 4
+#define NUM_KINDS 5
+
+static const char *const kind_names[NUM_KINDS] = {
+  "intact", "cut short", "paused", "garbled", "too long"
+};
+
+/* Bytes sent from a node in one go, at a time of the plan. */
+struct burst {
+  uint64_t at_ns;
+  uint16_t len;
+  uint8_t data[2 * CAPTURE_MAX_LEN];
+};
+
+struct sender {
+  struct burst *bursts;
+  uint32_t num_bursts;
+};
+
+static struct sender frames_sender, collider;
+static uint64_t char_ns, idle_ns, plan_end_ns;
+static uint32_t kinds[NUM_KINDS][2];
+static uint32_t garbage_bytes, sync_bytes;
+
+static struct capture_framer framer;
+static uint32_t complete;
+static struct labibus_stats stats;
+static volatile bool done;
+
+
+static uint8_t
+random_byte(void)
+{
+  return rand() >> 7;
+}
+
+
+/* A poll reply from the device, with a payload of len chars, or bytes. */
+static uint16_t
+make_frame(uint8_t *buf, uint8_t id, bool binary, uint16_t len)
+{
+  uint8_t body[CAPTURE_MAX_LEN];
+  static const char digits[] = "0123456789.-|";
+  uint16_t crc, n, i;
+
+  if (binary)
+  {
+    body[0] = 0x80 | id;
+    body[1] = 'R';
+    for (i = 0; i < len; ++i)
+      body[2 + i] = random_byte();
+    crc = crc16_buf(body, 2 + len) ^ 1;
+    body[2 + len] = crc >> 8;
+    body[3 + len] = crc & 0xff;
+    return master_cobs_frame(body, 4 + len, buf);
+  }
+  buf[0] = '!';
+  buf[1] = master_dec2hex(id >> 4);
+  buf[2] = master_dec2hex(id & 0xf);
+  buf[3] = ':';
+  buf[4] = 'R';
+  n = 5;
+  for (i = 0; i < len; ++i)
+    buf[n++] = digits[rand() % (sizeof(digits) - 1)];
+  buf[n++] = '|';
+  crc = crc16_buf(buf, n) ^ 1;
+  for (i = 0; i < 4; ++i)
+    buf[n++] = master_dec2hex((crc >> (12 - 4 * i)) & 0xf);
+  buf[n++] = '\r';
+  buf[n++] = '\n';
+  return n;
+}
+
+
+static struct burst *
+new_burst(struct sender *s, uint64_t at_ns)
+{
+  struct burst *b = &s->bursts[s->num_bursts++];
+
+  b->at_ns = at_ns;
+  b->len = 0;
+  return b;
+}
+
+
+/* When the next burst may start: a char time after the end of this one. */
+static uint64_t
+end_burst(const struct burst *b)
+{
+  return b->at_ns + (b->len + 1) * char_ns;
+}
+
+
+static void
+plan(uint32_t num_frames)
+{
+  uint8_t frame[CAPTURE_MAX_LEN];
+  struct burst *b, *c;
+  uint16_t payload, len, cut, i;
+  uint8_t kind, id;
+  bool binary, reopened = false, after_cut = false;
+  uint32_t n;
+
+  frames_sender.bursts = (struct burst *)
+    malloc(2 * (num_frames + 1) * sizeof(struct burst));
+  collider.bursts = (struct burst *)
+    malloc((num_frames + 1) * sizeof(struct burst));
+  b = new_burst(&frames_sender, 1000000);
+  for (n = 0; n < num_frames; ++n)
+  {
+    /* The last frame is intact, so that the last record is complete. */
+    kind = n + 1 < num_frames ? rand() % NUM_KINDS : INTACT;
+    if (kind != INTACT && rand() % 2)
+      kind = INTACT;
+    binary = reopened || rand() % 2;
+    id = 1 + rand() % LISTENED;
+    payload = kind == TOO_LONG ? MAX_REQ + rand() % 32 : rand() % 40;
+    do
+      len = make_frame(frame, id, binary, payload);
+    while (binary && (memchr(frame, '?', len) || memchr(frame, '!', len)));
+    ++kinds[kind][binary];
+
+    if (!reopened)
+    {
+      if (rand() % 4 == 0)
+        for (i = 1 + rand() % 8; i > 0; --i)
+        {
+          do
+            b->data[b->len] = random_byte();
+          while (b->data[b->len] == 0 || b->data[b->len] == '?' ||
+                 b->data[b->len] == '!' || b->data[b->len] == '\n');
+          ++b->len;
+          ++garbage_bytes;
+        }
+      if (rand() % 2)
+      {
+        b->data[b->len++] = 0xff;
+        ++sync_bytes;
+      }
+    }
+
+    switch (kind)
+    {
+    case CUT_SHORT:
+      /* Past the header, and before the end of line or delimiter. */
+      cut = (binary ? 4 : 5) + rand() % (len - (binary ? 5 : 7));
+      memcpy(b->data + b->len, frame, cut);
+      b->len += cut;
+      break;
+
+    case PAUSED:
+      cut = 1 + rand() % (len - 1);
+      memcpy(b->data + b->len, frame, cut);
+      b->len += cut;
+      b = new_burst(&frames_sender, end_burst(b) + idle_ns * 2 +
+                    rand() % idle_ns);
+      memcpy(b->data, frame + cut, len - cut);
+      b->len = len - cut;
+      break;
+
+    case GARBLED:
+      /*
+        The second driver sends ones from half way into a char, which
+        garble the chars under them into what they have in common, up to
+        two chars before the end of the frame.
+      */
+      cut = 1 + rand() % (len - 4);
+      c = new_burst(&collider, b->at_ns + (b->len + cut) * char_ns +
+                    char_ns / 2);
+      c->len = 1 + rand() % 2;
+      memset(c->data, 0xff, c->len);
+      /* Fall through. */
+    default:
+      memcpy(b->data + b->len, frame, len);
+      b->len += len;
+      break;
+    }
+    reopened = binary && (after_cut || (kind != INTACT && kind != TOO_LONG));
+    after_cut = binary && kind == CUT_SHORT;
+    if (b->len > CAPTURE_MAX_LEN)
+      b = new_burst(&frames_sender, end_burst(b));
+  }
+  plan_end_ns = end_burst(b);
+}
+
+
+static void
+send_main(void *arg)
+{
+  struct sender *s = (struct sender *)arg;
+  uint32_t i;
+
+  for (i = 0; i < s->num_bursts; ++i)
+  {
+    if (s->bursts[i].at_ns > sim_now())
+      sim_delay_ns(s->bursts[i].at_ns - sim_now());
+    sim_port_write(s->bursts[i].data, s->bursts[i].len);
+  }
+  if (s == &frames_sender)
+  {
+    /* Give the listener time to take the last frame. */
+    sim_delay_ns(10000000ULL);
+    done = true;
+  }
+}
+
+
+static void
+listener_main(void *)
+{
+  uint8_t id;
+
+  for (id = 1; id <= LISTENED; ++id)
+    labibus_listen(id);
+  for (;;)
+  {
+    labibus_get_stats(&stats);
+    _delay_ms(1);
+  }
+}
+
+
+static uint32_t
+compare(const char *what, uint32_t framer_count, uint32_t listener_count)
+{
+  printf("  %-12s %8u %8u%s\n", what, framer_count, listener_count,
+         framer_count == listener_count ? "" : "  MISMATCH");
+  return framer_count != listener_count;
+}
+
+
+static void
+count_record(void *, const struct capture_record *r, const uint8_t *)
+{
+  if (r->flags & CAPTURE_COMPLETE)
+    ++complete;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t num_frames = 20000, baud = 115200, seed = 1, mismatches = 0;
+  struct sim_wire_stats wire;
+  uint64_t chars_ns;
+  uint8_t kind;
+
+  if (argc > 1)
+    num_frames = atoi(argv[1]);
+  if (argc > 2)
+    baud = atoi(argv[2]);
+  if (argc > 3)
+    seed = atoi(argv[3]);
+  if (num_frames < 1 || num_frames > MAX_FRAMES || baud < 1200)
+  {
+    fprintf(stderr, "Usage: %s [frames(1-%u) [baud [seed]]]\n", argv[0],
+            MAX_FRAMES);
+    return 1;
+  }
+
+  sim_init(baud);
+  char_ns = sim_char_time();
+  chars_ns = RCV_IDLE_CHARS * char_ns;
+  idle_ns = chars_ns > RCV_IDLE_US * 1000ULL ? chars_ns
+    : RCV_IDLE_US * 1000ULL;
+  srand(seed);
+  plan(num_frames);
+
+  capture_init(&framer, baud, count_record, NULL);
+  sim_add_node("listener", SIM_NODE_AVR, listener_main, NULL);
+  sim_add_node("sender", SIM_NODE_HOST, send_main, &frames_sender);
+  sim_add_node("collider", SIM_NODE_HOST, send_main, &collider);
+  sim_add_node("capture", SIM_NODE_HOST, sim_capture_node, &framer);
+  while (!done)
+    sim_run(sim_now() + 100000000ULL);
+  capture_flush(&framer);
+  sim_get_wire_stats(&wire);
+
+  printf("sent:   %u frames at %u baud in %.3f s, ", num_frames, baud,
+         plan_end_ns / 1e9);
+  for (kind = 0; kind < NUM_KINDS; ++kind)
+    printf("%s%u+%u %s", kind ? ", " : "", kinds[kind][0], kinds[kind][1],
+           kind_names[kind]);
+  printf(" (text+binary)\n");
+  printf("        %u garbage and %u sync bytes, %u chars on the wire, "
+         "%u collisions\n", garbage_bytes, sync_bytes, wire.chars,
+         wire.collisions);
+  printf("  %-12s %8s %8s\n", "", "framer", "listener");
+  mismatches += compare("frames", framer.frames, stats.frames);
+  mismatches += compare("too long", framer.too_long, stats.too_long);
+  mismatches += compare("aborted", framer.aborted, stats.aborted);
+  mismatches += compare("complete", complete, stats.crc_errors);
+  /* Anything else means the listener did not see what the framer saw. */
+  mismatches += compare("addressed", framer.frames, stats.addressed);
+  mismatches += compare("dropped", 0, stats.dropped);
+  mismatches += compare("overruns", 0, stats.data_overruns);
+  printf("%u mismatches\n", mismatches);
+  sim_shutdown();
+  return mismatches ? 1 : 0;
+}
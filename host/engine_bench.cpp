@@ -0,0 +1,455 @@
+/*
+  Benchmark of the multi-bus master engine (master_engine.h) on pty pairs.
+
+  Each bus is a simulated RS485 bus (sim_bus.h) in a process of its own,
+  with a number of slave nodes running the Labibus library, with poll
+  intervals of 1 and 2 s in turn, and a bridge node that passes the bytes
+  between the wire and one end of a pty pair, with virtual time kept in step
+  with real time. The master engine drives the other ends of all the ptys,
+  from one event loop, or with threads, from that many engines with a share
+  of the buses each.
+
+  Runs for the given time (real, not virtual), and reports the polls, their
+  latency (end of request to first byte of reply, including the bridge), and
+  the CPU time, wakeups and events of the engine. With more buses than CPUs,
+  the latency is mostly the simulation of the buses, and the response
+  timeout is raised in proportion.
+
+  Usage: engine_bench [buses [slaves [seconds [threads [baud [format]]]]]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "Labibus.h"
+#include "sim_hal.h"
+#include "sim_bus.h"
+#include "master.h"
+#include "master_engine.h"
+
+
+#define MAX_BUSES 128
+#define MAX_THREADS 16
+
+#define SLAVE_CHANNELS(id) ((id) % 4 == 0 ? 2 : 1)
+#define SLAVE_INTERVAL(id) ((id) % 2 + 1)
+/*
+  How long the bridge waits (in virtual time) for the first byte of a reply
+  after the turnaround, and for each next one, in chars.
+*/
+#define BRIDGE_FIRST_NS 2000000ULL
+#define BRIDGE_GAP_CHARS 3
+/* How often virtual time is brought up to real time otherwise. */
+#define BRIDGE_IDLE_NS 10000000L
+
+struct slave {
+  uint8_t id;
+  char name[16];
+};
+
+static uint16_t num_buses = 8;
+static uint8_t num_slaves = 8;
+static uint32_t seconds = 10;
+static uint8_t num_threads = 1;
+static uint32_t baud = LABIBUS_BAUD;
+static bool use_binary;
+static uint16_t turnaround_us = 1000;
+
+static pid_t children[MAX_BUSES];
+/* Each bus writes a byte to this pipe once its bridge runs. */
+static int ready_pipe[2];
+static struct engine engines[MAX_THREADS];
+static uint64_t run_until;
+
+static struct {
+  uint32_t values, value_errors;
+} stats[MAX_THREADS];
+
+
+static uint64_t
+real_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void
+slave_main(void *arg)
+{
+  struct slave *s = (struct slave *)arg;
+  const char *descriptions[2] = { "Simulated temperature",
+                                  "Simulated humidity" };
+  const char *units[2] = { "degree C", "%rel" };
+  float vals[2] = { (float)s->id, s->id + 50.0f };
+
+  if (SLAVE_CHANNELS(s->id) == 1)
+    labibus_init(s->id, SLAVE_INTERVAL(s->id), descriptions[0], units[0], 3);
+  else
+    labibus_init_channels(s->id, SLAVE_INTERVAL(s->id), 2, descriptions,
+                          units, 3);
+  labibus_set_turnaround(turnaround_us);
+  for (;;)
+  {
+    if (SLAVE_CHANNELS(s->id) == 2)
+      labibus_set_sensor_values(s->id, vals);
+    else
+      labibus_set_sensor_value(s->id, vals[0]);
+    _delay_ms(50);
+    vals[0] += 0.125f;
+    vals[1] += 0.125f;
+  }
+}
+
+
+/* Wait until the given virtual time has come in real time. */
+static void
+wait_real(uint64_t t0, uint64_t t)
+{
+  struct timespec ts;
+
+  t += t0;
+  ts.tv_sec = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+
+/* Pass what the wire has up to the given virtual time to the pty. */
+static void
+forward_until(int fd, uint64_t t)
+{
+  uint8_t buf[256];
+  uint16_t len = 0;
+  int c;
+
+  while ((c = sim_port_read(t, NULL, NULL)) >= 0)
+    if (len < sizeof(buf))
+      buf[len++] = c;
+  if (len && write(fd, buf, len) < 0 && errno != EAGAIN)
+    _exit(0);
+}
+
+
+/*
+  Pass bytes between the pty and the wire, with virtual time following real
+  time. For a request, virtual time runs ahead through the reply, which is
+  then handed over at the right times: the first byte when it has arrived,
+  and the rest when the reply has. Stepping the simulation in real time
+  instead would take far more CPU time than the engine under test. What
+  comes after that, such as late slots of a range request, is passed on
+  every BRIDGE_IDLE_NS.
+*/
+static void
+bridge_main(void *arg)
+{
+  int fd = *(int *)arg;
+  uint64_t t0 = real_now() - sim_now(), real, stamp, first = 0, last = 0;
+  uint64_t char_time = sim_char_time();
+  struct pollfd pfd;
+  struct timespec ts;
+  uint8_t buf[256], reply[2 * MASTER_MAX_REPLY];
+  uint16_t len;
+  ssize_t n;
+  int c;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  if (write(ready_pipe[1], "", 1) < 0)
+    return;
+  for (;;)
+  {
+    real = real_now() - t0;
+    if (sim_now() < real)
+      forward_until(fd, real);
+    ts.tv_sec = 0;
+    ts.tv_nsec = BRIDGE_IDLE_NS;
+    if (ppoll(&pfd, 1, &ts, NULL) <= 0)
+      continue;
+    n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+    {
+      if (n == 0 || errno != EAGAIN)
+        _exit(0);
+      continue;
+    }
+    real = real_now() - t0;
+    if (sim_now() < real)
+      forward_until(fd, real);
+    sim_port_write(buf, n);
+
+    len = 0;
+    stamp = sim_now() + (uint64_t)turnaround_us * 1000 + BRIDGE_FIRST_NS;
+    while ((c = sim_port_read(stamp, &stamp, NULL)) >= 0)
+    {
+      last = stamp + char_time;
+      if (!len)
+        first = last;
+      if (len < sizeof(reply))
+        reply[len++] = c;
+      stamp = last + BRIDGE_GAP_CHARS * char_time;
+    }
+    if (!len)
+      continue;
+    wait_real(t0, first);
+    if (write(fd, reply, 1) < 0)
+      _exit(0);
+    if (len > 1)
+    {
+      wait_real(t0, last);
+      if (write(fd, reply + 1, len - 1) < 0)
+        _exit(0);
+    }
+  }
+}
+
+
+/* The process of one simulated bus. */
+static void
+run_bus(int fd)
+{
+  struct slave *slaves;
+  uint8_t i;
+
+  sim_init(baud);
+  slaves = (struct slave *)calloc(num_slaves, sizeof(*slaves));
+  for (i = 0; i < num_slaves; ++i)
+  {
+    slaves[i].id = i + 1;
+    snprintf(slaves[i].name, sizeof(slaves[i].name), "slave%u", i + 1);
+    sim_add_node(slaves[i].name, SIM_NODE_AVR, slave_main, &slaves[i]);
+  }
+  sim_add_node("bridge", SIM_NODE_HOST, bridge_main, &fd);
+  sim_run(SIM_NEVER);
+  _exit(0);
+}
+
+
+static void
+on_values(struct engine *e, struct engine_port *,
+          const struct master_device *d)
+{
+  float steps = (d->values[0] - d->id) * 8;
+  uint8_t t = e - engines;
+
+  ++stats[t].values;
+  if (steps < 0 || steps != floorf(steps) ||
+      (d->channels == 2 && d->values[1] != d->values[0] + 50.0f))
+    ++stats[t].value_errors;
+}
+
+
+static void *
+engine_thread(void *arg)
+{
+  engine_run((struct engine *)arg, run_until);
+  return NULL;
+}
+
+
+static double
+cpu_seconds(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+
+static void
+report(double run, double cpu)
+{
+  struct master_device_stats sum;
+  const struct master_device *d;
+  struct engine_port *p;
+  uint64_t latency_sum = 0, latency_max = 0, wakeups = 0, events = 0;
+  uint32_t latencies = 0, devices = 0, values = 0, value_errors = 0;
+  uint32_t bad_frames = 0, worst_devices = 128, found;
+  uint16_t t, i, id;
+
+  memset(&sum, 0, sizeof(sum));
+  for (t = 0; t < num_threads; ++t)
+  {
+    wakeups += engines[t].wakeups;
+    events += engines[t].events;
+    values += stats[t].values;
+    value_errors += stats[t].value_errors;
+    for (i = 0; i < engines[t].num_ports; ++i)
+    {
+      p = engines[t].ports[i];
+      found = 0;
+      for (id = 0; id < 128; ++id)
+      {
+        d = &p->m.devices[id];
+        if (!d->present)
+          continue;
+        ++found;
+        sum.polls += d->stats.polls;
+        sum.replies += d->stats.replies;
+        sum.timeouts += d->stats.timeouts;
+        sum.bad += d->stats.bad;
+        sum.late += d->stats.late;
+        sum.missed += d->stats.missed;
+        if (d->stats.max_late > sum.max_late)
+          sum.max_late = d->stats.max_late;
+      }
+      devices += found;
+      if (found < worst_devices)
+        worst_devices = found;
+      latencies += p->stats.latencies;
+      latency_sum += p->stats.latency_sum;
+      if (p->stats.latency_max > latency_max)
+        latency_max = p->stats.latency_max;
+      bad_frames += p->stats.bad_frames;
+    }
+  }
+
+  printf("%u buses of %u slaves, %u baud, %u s, %u thread%s, %s\n",
+         num_buses, num_slaves, baud, seconds, num_threads,
+         num_threads > 1 ? "s" : "", use_binary ? "binary" : "text");
+  printf("discovery:  %u devices (at least %u per bus)\n", devices,
+         worst_devices);
+  printf("polls:      %u (%u replies, %u timeouts, %u bad), %u late "
+         "(%.2f ms max), %u missed, %.1f polls/s\n", sum.polls, sum.replies,
+         sum.timeouts, sum.bad, sum.late, sum.max_late / 1e6, sum.missed,
+         sum.polls / run);
+  if (latencies)
+    printf("latency:    %.1f us mean, %.1f us max\n",
+           latency_sum / 1e3 / latencies, latency_max / 1e3);
+  printf("values:     %u, %u implausible, %u bad frames\n", values,
+         value_errors, bad_frames);
+  printf("engine:     %.1f%% CPU, %.0f wakeups/s, %.0f events/s, "
+         "%.1f us CPU per poll\n", cpu / run * 100, wakeups / run,
+         events / run, sum.polls ? cpu * 1e6 / sum.polls : 0.0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  pthread_t threads[MAX_THREADS];
+  struct engine_port *p;
+  char name[64];
+  int master_fd, slave_fd, fd;
+  double cpu;
+  uint64_t start;
+  long ncpu;
+  uint16_t b, t;
+
+  if (argc > 1)
+    num_buses = atoi(argv[1]);
+  if (argc > 2)
+    num_slaves = atoi(argv[2]);
+  if (argc > 3)
+    seconds = atoi(argv[3]);
+  if (argc > 4)
+    num_threads = atoi(argv[4]);
+  if (argc > 5)
+    baud = atoi(argv[5]);
+  if (argc > 6)
+    use_binary = strcmp(argv[6], "binary") == 0;
+  if (num_buses < 1 || num_buses > MAX_BUSES || num_slaves < 1 ||
+      num_slaves > 127 || num_threads < 1 || num_threads > MAX_THREADS ||
+      num_threads > num_buses ||
+      (argc > 6 && !use_binary && strcmp(argv[6], "text") != 0))
+  {
+    fprintf(stderr, "Usage: %s [buses(1-%u) [slaves(1-127) [seconds "
+            "[threads(1-%u) [baud [text|binary]]]]]]\n", argv[0], MAX_BUSES,
+            MAX_THREADS);
+    return 1;
+  }
+
+  for (t = 0; t < num_threads; ++t)
+  {
+    if (engine_init(&engines[t]) < 0)
+    {
+      perror("epoll");
+      return 1;
+    }
+    engines[t].on_values = on_values;
+  }
+  /* The buses are processes of their own, forked before any threads. */
+  if (pipe(ready_pipe) < 0)
+  {
+    perror("pipe");
+    return 1;
+  }
+  for (b = 0; b < num_buses; ++b)
+  {
+    if (openpty(&master_fd, &slave_fd, name, NULL, NULL) < 0)
+    {
+      perror("openpty");
+      return 1;
+    }
+    children[b] = fork();
+    if (children[b] == 0)
+    {
+      close(slave_fd);
+      run_bus(master_fd);
+    }
+    close(master_fd);
+    fd = master_open_tty(name, baud, false);
+    close(slave_fd);
+    if (fd < 0)
+    {
+      perror(name);
+      return 1;
+    }
+    snprintf(name, sizeof(name), "bus%u", b);
+    p = engine_add_port(&engines[b % num_threads], fd, name, baud,
+                        turnaround_us);
+    if (!p)
+    {
+      perror("engine_add_port");
+      return 1;
+    }
+    p->m.use_binary = use_binary;
+    /* The simulated buses share the CPUs, and take longer to reply when
+       there are more of them than CPUs. */
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_buses > ncpu)
+      p->m.timeout = p->m.timeout * num_buses / ncpu;
+  }
+
+  /* Start once all the buses are up, to find all slaves. */
+  for (b = 0; b < num_buses; ++b)
+    if (read(ready_pipe[0], name, 1) != 1)
+    {
+      perror("ready");
+      return 1;
+    }
+
+  cpu = cpu_seconds();
+  start = real_now();
+  run_until = start + seconds * 1000000000ULL;
+  for (t = 0; t < num_threads; ++t)
+    pthread_create(&threads[t], NULL, engine_thread, &engines[t]);
+  for (t = 0; t < num_threads; ++t)
+    pthread_join(threads[t], NULL);
+  cpu = cpu_seconds() - cpu;
+
+  for (b = 0; b < num_buses; ++b)
+  {
+    kill(children[b], SIGKILL);
+    waitpid(children[b], NULL, 0);
+  }
+  report((real_now() - start) / 1e9, cpu);
+  for (t = 0; t < num_threads; ++t)
+    engine_close(&engines[t]);
+  return 0;
+}
@@ -0,0 +1,267 @@
+/*
+  Labibus bus capture, from a serial port with an RS485 adapter that only
+  listens (or a pty), into a capture file (capture.h); and a printout of
+  capture files.
+
+  Receive errors are read in-band (PARMRK), so that frames broken by them
+  are flagged. The times are those the bytes came from the serial port,
+  each back-dated by the char times of the bytes that came with it after
+  it; adapters that hand over bytes in bursts blur them by their latency.
+
+  The printout lists each record with its start time, what it is, its flags
+  (C complete, S after a sync byte, E receive error, I cut short by a
+  pause, L too long), the latency of replies after their request, and the
+  bytes, with those not printable in hex.
+
+  Usage: labibus_capture [-b baud] [-r seconds] device file
+         labibus_capture -p file
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+
+static volatile sig_atomic_t stop;
+static FILE *out;
+static uint32_t records;
+
+
+static uint64_t
+now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Listen only, with receive errors marked in the data. */
+static int
+tty_open(const char *path, uint32_t baud)
+{
+  int fd = master_open_tty(path, baud, true);
+
+  if (fd < 0)
+    fprintf(stderr, "%s at %u baud: %s\n", path, baud, strerror(errno));
+  return fd;
+}
+
+
+static void
+write_record(void *, const struct capture_record *r, const uint8_t *data)
+{
+  if (capture_write(out, r, data) < 0)
+  {
+    perror("write");
+    stop = 1;
+  }
+  ++records;
+}
+
+
+static void
+on_signal(int)
+{
+  stop = 1;
+}
+
+
+static int
+capture(const char *device, const char *file, uint32_t baud,
+        uint32_t seconds)
+{
+  struct capture_framer f;
+  struct pollfd pfd;
+  uint8_t buf[256], bytes[256], errors[256];
+  uint64_t start, end, t, char_us = (10 * 1000000 + baud / 2) / baud;
+  uint8_t mark = 0;
+  ssize_t n, i;
+  int k, len;
+
+  pfd.fd = tty_open(device, baud);
+  if (pfd.fd < 0)
+    return 1;
+  pfd.events = POLLIN;
+  out = fopen(file, "wb");
+  if (!out || capture_write_header(out, baud) < 0)
+  {
+    perror(file);
+    return 1;
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  capture_init(&f, baud, write_record, NULL);
+
+  start = now_us();
+  end = seconds ? start + seconds * 1000000ULL : ~(uint64_t)0;
+  while (!stop && now_us() < end)
+  {
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    n = read(pfd.fd, buf, sizeof(buf));
+    t = now_us() - start;
+    if (n <= 0)
+      continue;
+    /* Undo the marking: 0xff 0xff is 0xff, 0xff 0 c is c with an error. */
+    for (i = 0, len = 0; i < n; ++i)
+    {
+      if (mark == 0 && buf[i] == 0xff)
+        mark = 1;
+      else if (mark == 1 && buf[i] == 0)
+        mark = 2;
+      else
+      {
+        bytes[len] = buf[i];
+        errors[len++] = mark == 2 ? CAPTURE_FE : 0;
+        mark = 0;
+      }
+    }
+    for (k = 0; k < len; ++k)
+      capture_feed(&f, bytes[k], errors[k],
+                   t > (len - 1 - k) * char_us ? t - (len - 1 - k) * char_us
+                   : 0);
+  }
+  capture_flush(&f);
+  fclose(out);
+  printf("%u records in %.1f s\n", records, (now_us() - start) / 1e6);
+  return 0;
+}
+
+
+static void
+print_bytes(const uint8_t *data, uint16_t len)
+{
+  uint16_t i;
+
+  for (i = 0; i < len; ++i)
+  {
+    if (data[i] >= ' ' && data[i] < 0x7f && data[i] != '\\')
+      putchar(data[i]);
+    else
+      printf("\\%02x", data[i]);
+  }
+}
+
+
+static int
+print(const char *file)
+{
+  struct capture_record r, req;
+  struct capture_frame info;
+  uint8_t data[CAPTURE_MAX_LEN];
+  uint32_t baud, frames = 0, complete = 0, garbage = 0, errors = 0, n = 0;
+  uint32_t latencies = 0;
+  int64_t latency, latency_sum = 0, latency_max = 0;
+  bool have_req = false;
+  char flags[6], *p;
+  FILE *in = fopen(file, "rb");
+
+  if (!in || !capture_read_header(in, &baud))
+  {
+    fprintf(stderr, "%s: not a capture\n", file);
+    return 1;
+  }
+  while (capture_read(in, &r, data))
+  {
+    ++n;
+    p = flags;
+    if (r.flags & CAPTURE_COMPLETE)
+      *p++ = 'C';
+    if (r.flags & CAPTURE_SYNC)
+      *p++ = 'S';
+    if (r.flags & CAPTURE_ERROR)
+      *p++ = 'E';
+    if (r.flags & CAPTURE_IDLE)
+      *p++ = 'I';
+    if (r.flags & CAPTURE_TOO_LONG)
+      *p++ = 'L';
+    *p = '\0';
+    errors += (r.flags & CAPTURE_ERROR) != 0;
+    printf("%12.6f ", r.start_us / 1e6);
+    if (r.kind == CAPTURE_GARBAGE)
+    {
+      ++garbage;
+      printf("garbage       %-5s        ", flags);
+    }
+    else if (!capture_frame_info(&r, data, &info))
+    {
+      ++frames;
+      printf("%-6s ?      %-5s        ",
+             r.kind == CAPTURE_TEXT ? "text" : "binary", flags);
+    }
+    else
+    {
+      ++frames;
+      complete += (r.flags & CAPTURE_COMPLETE) != 0;
+      printf("%-6s %c%02x:%c %-5s ", r.kind == CAPTURE_TEXT ? "text" :
+             "binary", info.reply ? '!' : '?', info.id, info.type, flags);
+      if (info.reply && have_req)
+      {
+        latency = capture_latency_us(&req, &r, baud);
+        printf("%6lld ", (long long)latency);
+        ++latencies;
+        latency_sum += latency;
+        if (latency > latency_max)
+          latency_max = latency;
+        /* Only the first reply after a request. */
+        have_req = false;
+      }
+      else
+        printf("       ");
+      if (!info.reply)
+      {
+        req = r;
+        have_req = true;
+      }
+    }
+    print_bytes(data, r.len);
+    putchar('\n');
+  }
+  fclose(in);
+  printf("# %u baud, %u records: %u frames (%u complete), %u garbage, "
+         "%u with receive errors", baud, n, frames, complete, garbage,
+         errors);
+  if (latencies)
+    printf(", reply latency %.1f us mean, %lld us max",
+           (double)latency_sum / latencies, (long long)latency_max);
+  printf("\n");
+  return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t baud = LABIBUS_BAUD, seconds = 0;
+  bool print_only = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:r:p")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b': baud = atoi(optarg); break;
+    case 'r': seconds = atoi(optarg); break;
+    case 'p': print_only = true; break;
+    default: optind = argc + 1; break;
+    }
+  }
+  if (print_only && optind == argc - 1)
+    return print(argv[optind]);
+  if (print_only || optind != argc - 2)
+  {
+    fprintf(stderr, "Usage: %s [-b baud] [-r seconds] device file\n"
+            "       %s -p file\n", argv[0], argv[0]);
+    return 1;
+  }
+  return capture(argv[optind], argv[optind + 1], baud, seconds);
+}
@@ -0,0 +1,440 @@
+/*
+  Labibus master daemon, for a serial port with an RS485 adapter (or a pty).
+
+  Discovers the devices on the bus, lists them, and polls them as scheduled
+  by the master library (master.h), printing each value as it comes:
+    <seconds> <id> <channel> <value> <unit> <description>
+  On SIGINT or SIGTERM, or after the given run time, it prints the poll
+  statistics of each device and exits.
+
+  Given several serial ports, one bus on each, it drives them all from one
+  event loop with the master engine (master_engine.h), which discovers with
+  slotted discovery only. Each device is listed as it first replies, and
+  each line of values and statistics has the number of the port (from 0, in
+  the order given) before the ID.
+
+  With -d, the values go into the time-series store of each device in the
+  directory (master_store.h) instead, with times in ns since the epoch. The
+  stores of identical devices with the same ID on several buses go in
+  subdirectories named by the number of the port.
+
+  Usage: labibus_master [-b baud] [-t turnaround_us] [-B] [-s] [-u max_util]
+                        [-r seconds] [-d dir [-c capacity]] device...
+    -B  poll the devices that support it with binary frames
+    -s  discover by scanning all IDs, instead of slotted discovery (with one
+        port only)
+    -c  records in each new store (default a week at 1 s)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "master.h"
+#include "master_engine.h"
+#include "master_store.h"
+
+
+struct tty {
+  int fd;
+  uint8_t buf[256];
+  int len, pos;
+  uint64_t stamp;
+};
+
+static volatile sig_atomic_t stop;
+static uint64_t start;
+
+/* The stores of the devices on a bus. */
+struct bus {
+  struct store stores[128];
+  /* Stores open, and devices whose store failed to open. */
+  bool store_open[128], store_failed[128];
+  /* Devices listed, with the engine. */
+  bool listed[128];
+};
+
+static uint32_t baud = LABIBUS_BAUD, turnaround_us = 1000, seconds;
+static double max_utilization = 0.9;
+static bool binary, slotted = true;
+
+static const char *store_dir;
+static uint32_t store_capacity = STORE_DEFAULT_CAPACITY;
+static struct bus *buses;
+/* CLOCK_REALTIME less CLOCK_MONOTONIC, for the times in the stores. */
+static uint64_t epoch_offset;
+
+
+static uint64_t
+tty_now(void *)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void
+tty_write(void *ctx, const uint8_t *buf, uint16_t len)
+{
+  struct tty *t = (struct tty *)ctx;
+  ssize_t n;
+
+  /* Anything still coming in belongs to no reply of ours. */
+  tcflush(t->fd, TCIFLUSH);
+  t->len = t->pos = 0;
+  while (len > 0)
+  {
+    n = write(t->fd, buf, len);
+    if (n < 0 && errno != EINTR && errno != EAGAIN)
+      return;
+    if (n > 0)
+    {
+      buf += n;
+      len -= n;
+    }
+  }
+  tcdrain(t->fd);
+}
+
+
+static int
+tty_read(void *ctx, uint64_t deadline, uint64_t *stamp)
+{
+  struct tty *t = (struct tty *)ctx;
+  struct pollfd pfd;
+  uint64_t now;
+  ssize_t n;
+
+  while (t->pos == t->len)
+  {
+    now = tty_now(ctx);
+    if (now >= deadline || stop)
+      return -1;
+    pfd.fd = t->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, (deadline - now + 999999) / 1000000) <= 0)
+      continue;
+    n = read(t->fd, t->buf, sizeof(t->buf));
+    if (n <= 0)
+      continue;
+    t->len = n;
+    t->pos = 0;
+    t->stamp = tty_now(ctx);
+  }
+  if (stamp)
+    *stamp = t->stamp;
+  return t->buf[t->pos++];
+}
+
+
+static void
+tty_sleep_until(void *, uint64_t t)
+{
+  struct timespec ts;
+
+  ts.tv_sec = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+
+static int
+tty_open(struct tty *t, const char *path, uint32_t baud)
+{
+  t->fd = master_open_tty(path, baud, false);
+  if (t->fd < 0)
+  {
+    fprintf(stderr, "%s at %u baud: %s\n", path, baud, strerror(errno));
+    return -1;
+  }
+  t->len = t->pos = 0;
+  return 0;
+}
+
+
+/*
+  Open the store of a device on a bus. Identical devices with the same ID
+  on several buses have theirs in a directory for each bus but the first.
+*/
+static int
+open_store(struct bus *b, const struct master_device *d)
+{
+  char dir[4096];
+
+  if (store_open_device(&b->stores[d->id], store_dir, d, store_capacity) == 0)
+    return 0;
+  if ((errno != EEXIST && errno != EWOULDBLOCK) || b == buses)
+    return -1;
+  snprintf(dir, sizeof(dir), "%s/%u", store_dir, (unsigned)(b - buses));
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return -1;
+  return store_open_device(&b->stores[d->id], dir, d, store_capacity);
+}
+
+
+static void
+store_values(struct bus *b, const struct master_device *d)
+{
+  if (!b->store_open[d->id] && !b->store_failed[d->id])
+  {
+    if (open_store(b, d) < 0)
+    {
+      fprintf(stderr, "Store of %u in %s: %s\n", d->id, store_dir,
+              strerror(errno));
+      b->store_failed[d->id] = true;
+      return;
+    }
+    b->store_open[d->id] = true;
+  }
+  if (b->store_open[d->id])
+    store_append(&b->stores[d->id], d->value_time + epoch_offset, d->values);
+}
+
+
+/* List the channels of a device, after the port number, if any. */
+static void
+list_device(const char *port, const struct master_device *d)
+{
+  uint8_t c;
+
+  for (c = 0; c < d->channels; ++c)
+    printf("# %s%u %u every %u s%s: %s (%s)\n", port, d->id, c,
+           d->interval_s, d->binary ? ", binary" : "", d->description[c],
+           d->unit[c]);
+}
+
+
+/* Store or print the values of a device, after the port number, if any. */
+static void
+put_values(struct bus *b, const char *port, const struct master_device *d)
+{
+  uint8_t c;
+
+  if (store_dir)
+  {
+    store_values(b, d);
+    return;
+  }
+  for (c = 0; c < d->channels; ++c)
+    printf("%.3f %s%u %u %g %s %s\n", (d->value_time - start) / 1e9, port,
+           d->id, c, d->values[c], d->unit[c], d->description[c]);
+  fflush(stdout);
+}
+
+
+static void
+on_values(struct master *, const struct master_device *d)
+{
+  put_values(&buses[0], "", d);
+}
+
+
+static void
+on_port_values(struct engine *, struct engine_port *p,
+               const struct master_device *d)
+{
+  struct bus *b = &buses[p->index];
+  char port[8];
+
+  snprintf(port, sizeof(port), "%u ", p->index);
+  if (!b->listed[d->id])
+  {
+    list_device(port, d);
+    b->listed[d->id] = true;
+  }
+  put_values(b, port, d);
+}
+
+
+static void
+print_stats(struct bus *b, const char *port, const struct master *m)
+{
+  const struct master_device *d;
+  uint16_t id;
+
+  for (id = 0; id < 128; ++id)
+  {
+    d = &m->devices[id];
+    if (d->present)
+      printf("# %s%u: %u polls, %u replies, %u timeouts, %u bad, %u late "
+             "(%.2f ms max), %u missed\n", port, id, d->stats.polls,
+             d->stats.replies, d->stats.timeouts, d->stats.bad,
+             d->stats.late, d->stats.max_late / 1e6, d->stats.missed);
+    if (b->store_open[id])
+      store_close(&b->stores[id]);
+  }
+}
+
+
+static void
+on_signal(int)
+{
+  stop = 1;
+}
+
+
+/* Run until the end time, or a signal, in slices to notice it. */
+static uint64_t
+run_end(void)
+{
+  return seconds ? tty_now(NULL) + seconds * 1000000000ULL : ~(uint64_t)0;
+}
+
+
+/* Discover and poll the bus on a serial port, with the master library. */
+static int
+run_bus(const char *path)
+{
+  struct tty tty;
+  struct master_port port = {
+    &tty, tty_now, tty_write, tty_read, tty_sleep_until
+  };
+  static struct master m;
+  uint64_t end, slice;
+  uint16_t id;
+
+  if (tty_open(&tty, path, baud) < 0)
+    return 1;
+  master_init(&m, &port, baud, turnaround_us);
+  m.use_binary = binary;
+  m.max_utilization = max_utilization;
+  m.on_values = on_values;
+  printf("# %u devices\n", master_discover(&m, slotted));
+  for (id = 0; id < 128; ++id)
+    if (m.devices[id].present)
+      list_device("", &m.devices[id]);
+  master_admit(&m);
+  printf("# %.1f%% of the bus, intervals stretched by %.2f\n",
+         m.utilization * 100, m.stretch);
+  fflush(stdout);
+
+  end = run_end();
+  while (!stop && tty_now(NULL) < end)
+  {
+    slice = tty_now(NULL) + 100000000ULL;
+    master_run(&m, slice < end ? slice : end);
+  }
+  print_stats(&buses[0], "", &m);
+  return 0;
+}
+
+
+/* Discover and poll the buses on several serial ports, with the engine. */
+static int
+run_buses(char *paths[], uint16_t n)
+{
+  struct engine e;
+  struct engine_port *p;
+  uint64_t end, slice;
+  char port[8];
+  uint16_t i, id, devices;
+  int fd;
+
+  if (engine_init(&e) < 0)
+  {
+    perror("epoll");
+    return 1;
+  }
+  e.on_values = on_port_values;
+  for (i = 0; i < n; ++i)
+  {
+    fd = master_open_tty(paths[i], baud, false);
+    if (fd < 0)
+    {
+      fprintf(stderr, "%s at %u baud: %s\n", paths[i], baud, strerror(errno));
+      return 1;
+    }
+    p = engine_add_port(&e, fd, paths[i], baud, turnaround_us);
+    if (!p)
+    {
+      fprintf(stderr, "%s: %s\n", paths[i], strerror(errno));
+      return 1;
+    }
+    p->m.use_binary = binary;
+    p->m.max_utilization = max_utilization;
+    printf("# %u: %s\n", i, paths[i]);
+  }
+  fflush(stdout);
+
+  end = run_end();
+  while (!stop && tty_now(NULL) < end)
+  {
+    slice = tty_now(NULL) + 100000000ULL;
+    engine_run(&e, slice < end ? slice : end);
+  }
+  for (i = 0; i < n; ++i)
+  {
+    p = e.ports[i];
+    for (devices = 0, id = 0; id < 128; ++id)
+      devices += p->m.devices[id].present;
+    printf("# %u: %u devices, %.1f%% of the bus, %u frames, %u bad, "
+           "%.0f us mean latency\n", i, devices,
+           p->m.utilization * 100, p->stats.frames, p->stats.bad_frames,
+           p->stats.latencies ? p->stats.latency_sum / 1e3 /
+           p->stats.latencies : 0.0);
+    snprintf(port, sizeof(port), "%u ", i);
+    print_stats(&buses[i], port, &p->m);
+    close(p->fd);
+  }
+  engine_close(&e);
+  return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  uint16_t num_ports;
+  struct timespec ts;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:t:Bsu:r:d:c:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b': baud = atoi(optarg); break;
+    case 't': turnaround_us = atoi(optarg); break;
+    case 'B': binary = true; break;
+    case 's': slotted = false; break;
+    case 'u': max_utilization = atof(optarg); break;
+    case 'r': seconds = atoi(optarg); break;
+    case 'd': store_dir = optarg; break;
+    case 'c': store_capacity = atoi(optarg); break;
+    default: optind = argc + 1; break;
+    }
+  }
+  num_ports = optind < argc ? argc - optind : 0;
+  if (num_ports < 1 || num_ports > ENGINE_MAX_PORTS ||
+      (num_ports > 1 && !slotted) || max_utilization <= 0 ||
+      max_utilization > 1 || store_capacity < 1)
+  {
+    fprintf(stderr, "Usage: %s [-b baud] [-t turnaround_us] [-B] [-s] "
+            "[-u max_util(0-1)] [-r seconds] [-d dir [-c capacity]] "
+            "device...\n", argv[0]);
+    return 1;
+  }
+  buses = (struct bus *)calloc(num_ports, sizeof(*buses));
+  if (!buses)
+  {
+    perror("calloc");
+    return 1;
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  start = tty_now(NULL);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  epoch_offset = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - start;
+  if (num_ports == 1)
+    return run_bus(argv[optind]);
+  return run_buses(argv + optind, num_ports);
+}
@@ -0,0 +1,578 @@
+/*
+  Replay of a bus capture (capture.h) on the simulated RS485 bus, into the
+  Labibus library built for the host, to reproduce what a bus did offline.
+
+  By default, the requests of the capture are sent to slave nodes set up as
+  the devices of the capture: with the descriptions, units and intervals of
+  their discovery replies, and serving the values of their poll replies, in
+  turn. Each request goes out at its time in the capture (the pauses
+  shortened by the speed factor), but not before the replies to the last one
+  are over, as long as they took in the capture. The replies are compared
+  with those of the capture, for content and latency.
+
+  With -l, everything in the capture is sent as it was instead, garbage
+  included, to listener nodes listening to all devices that replied to
+  polls, which report what they made of it. Receive errors can not be
+  reproduced; those bytes go out as they were received.
+
+  With -o, the replayed bus is captured in turn.
+
+  The simulation is deterministic: a replay gives the same results each
+  time, so that it can be run before and after a change to the library.
+
+  Usage: labibus_replay [-s speed] [-t turnaround_us] [-l] [-o capture]
+                        capture
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Labibus.h"
+#include "sim_hal.h"
+#include "sim_bus.h"
+#include "master.h"
+#include "capture.h"
+
+
+struct entry {
+  struct capture_record r;
+  uint8_t data[CAPTURE_MAX_LEN];
+};
+
+/* A device of the capture, as a slave or listened to. */
+struct device {
+  struct master_device d;
+  uint8_t decimals;
+  /* The values of its poll replies, and the next one to serve. */
+  float (*values)[MAX_CHANNELS];
+  uint32_t num_values, next_value;
+  char name[16];
+};
+
+struct listener {
+  uint8_t ids[MAX_DEVICES];
+  uint8_t num_ids;
+  char name[16];
+  uint32_t values;
+  struct labibus_stats stats;
+};
+
+static struct entry *entries;
+static uint32_t num_entries;
+static uint32_t baud;
+static double speed = 1.0;
+static uint16_t turnaround_us = 1000;
+static bool listen_mode;
+
+static struct device devices[128];
+static struct listener listeners[128];
+static uint8_t num_listeners;
+static volatile bool done;
+
+static struct capture_framer out_framer;
+static FILE *out;
+
+/* Replies to the request being replayed. */
+static struct entry replies[256];
+static uint16_t num_replies;
+
+static struct {
+  uint32_t requests, captured, replayed, identical, missing;
+  uint32_t latencies;
+  int64_t captured_sum, captured_max, replayed_sum, replayed_max;
+  int64_t worse_max;
+  uint32_t written, poll_replies;
+} stats;
+
+
+static bool
+load(const char *file)
+{
+  FILE *in = fopen(file, "rb");
+  uint32_t size = 0;
+
+  if (!in || !capture_read_header(in, &baud))
+    return false;
+  for (;;)
+  {
+    if (num_entries == size)
+    {
+      size = size ? 2 * size : 1024;
+      entries = (struct entry *)realloc(entries, size * sizeof(*entries));
+    }
+    if (!capture_read(in, &entries[num_entries].r, entries[num_entries].data))
+      break;
+    ++num_entries;
+  }
+  fclose(in);
+  return num_entries > 0;
+}
+
+
+/* The values of a text poll reply, one per '|' before the CRC. */
+static uint8_t
+text_channels(const uint8_t *body, int len)
+{
+  uint8_t n = 0;
+  int i;
+
+  for (i = 5; i < len - 4; ++i)
+    n += body[i] == '|';
+  return n;
+}
+
+
+/* The decimals of a text poll reply, from its first value. */
+static uint8_t
+text_decimals(const uint8_t *body, int len)
+{
+  uint8_t n = 0;
+  int i;
+
+  for (i = 5; i < len - 4 && body[i] != '.' && body[i] != '|'; ++i)
+    ;
+  if (i < len - 4 && body[i] == '.')
+    for (++i; i < len - 4 && body[i] >= '0' && body[i] <= '9'; ++i)
+      ++n;
+  return n;
+}
+
+
+/* Set up the devices of the capture from their replies. */
+static void
+find_devices(void)
+{
+  struct capture_frame info;
+  struct device *dev;
+  uint8_t body[CAPTURE_MAX_LEN];
+  uint32_t i, size;
+  int len;
+  bool binary;
+
+  for (i = 0; i < 128; ++i)
+    devices[i].d.id = i;
+  for (i = 0; i < num_entries; ++i)
+  {
+    len = capture_frame_body(&entries[i].r, entries[i].data, body);
+    if (len < 0 || !capture_frame_info(&entries[i].r, entries[i].data,
+                                       &info) || !info.reply)
+      continue;
+    dev = &devices[info.id];
+    binary = entries[i].r.kind == CAPTURE_BINARY;
+    if (info.type == 'D' && !binary)
+    {
+      if (!dev->d.present && master_check_reply(body, len, info.id, 'D') &&
+          master_parse_discover(&dev->d, body, len))
+        dev->d.present = true;
+      continue;
+    }
+    if (info.type != 'P' && info.type != 'I')
+      continue;
+    if (binary ? !master_check_binary_reply(body, len, info.id, 'P') :
+        !master_check_reply(body, len, info.id, 'P'))
+      continue;
+    if (!dev->d.channels)
+      dev->d.channels = binary ?
+        (info.type == 'P' ? (len - 4) / 4 : (len - 5) / 4) :
+        text_channels(body, len);
+    if (!dev->num_values)
+      dev->decimals = !binary ? text_decimals(body, len) :
+        info.type == 'I' ? body[2] : dev->decimals;
+    if (!master_parse_poll(&dev->d, body, len))
+      continue;
+    if (dev->num_values % 256 == 0)
+    {
+      size = dev->num_values + 256;
+      dev->values = (float (*)[MAX_CHANNELS])realloc(dev->values,
+                                                    size * sizeof(*dev->values));
+    }
+    memcpy(dev->values[dev->num_values++], dev->d.values,
+           sizeof(dev->values[0]));
+    ++stats.poll_replies;
+  }
+
+  /* Devices only seen polled get made-up descriptions. */
+  for (i = 0; i < 128; ++i)
+  {
+    dev = &devices[i];
+    if (!dev->d.channels || dev->d.channels > MAX_CHANNELS)
+      continue;
+    if (!dev->d.present)
+    {
+      dev->d.present = true;
+      snprintf(dev->d.description[0], sizeof(dev->d.description[0]),
+               "Replayed %u", i);
+    }
+    if (!dev->d.interval_s)
+      dev->d.interval_s = 1;
+    snprintf(dev->name, sizeof(dev->name), "slave%u", i);
+  }
+}
+
+
+static void
+slave_main(void *arg)
+{
+  struct device *dev = (struct device *)arg;
+  struct master_device *d = &dev->d;
+  const char *descriptions[MAX_CHANNELS], *units[MAX_CHANNELS];
+  uint8_t c;
+
+  for (c = 0; c < d->channels; ++c)
+  {
+    descriptions[c] = d->description[c];
+    units[c] = d->unit[c];
+  }
+  if (d->channels == 1)
+    labibus_init(d->id, d->interval_s, descriptions[0], units[0],
+                 dev->decimals);
+  else
+    labibus_init_channels(d->id, d->interval_s, d->channels, descriptions,
+                          units, dev->decimals);
+  labibus_set_turnaround(turnaround_us);
+  for (;;)
+  {
+    if (dev->next_value < dev->num_values)
+    {
+      if (d->channels == 1)
+        labibus_set_sensor_value(d->id, dev->values[dev->next_value][0]);
+      else
+        labibus_set_sensor_values(d->id, dev->values[dev->next_value]);
+    }
+    labibus_wait_for_poll(d->id);
+    if (dev->next_value + 1 < dev->num_values)
+      ++dev->next_value;
+  }
+}
+
+
+static void
+listener_main(void *arg)
+{
+  struct listener *l = (struct listener *)arg;
+  float values[MAX_CHANNELS];
+  uint8_t i;
+
+  for (i = 0; i < l->num_ids; ++i)
+    labibus_listen_channels(l->ids[i], devices[l->ids[i]].d.channels,
+                            devices[l->ids[i]].decimals);
+  for (;;)
+  {
+    for (i = 0; i < l->num_ids; ++i)
+      if (labibus_check_data(l->ids[i]) &&
+          labibus_get_data_channels(l->ids[i], values))
+        ++l->values;
+    labibus_get_stats(&l->stats);
+    _delay_ms(1);
+  }
+}
+
+
+/* Listeners for all devices that replied to polls, as many as fit in each. */
+static void
+add_listeners(void)
+{
+  struct listener *l = NULL;
+  uint8_t slots = 0, id;
+
+  for (id = 0; id < 128; ++id)
+  {
+    if (!devices[id].num_values)
+      continue;
+    if (!l || slots + devices[id].d.channels > MAX_DEVICES)
+    {
+      l = &listeners[num_listeners++];
+      snprintf(l->name, sizeof(l->name), "listener%u", num_listeners);
+      slots = 0;
+    }
+    l->ids[l->num_ids++] = id;
+    slots += devices[id].d.channels;
+  }
+  for (id = 0; id < num_listeners; ++id)
+    sim_add_node(listeners[id].name, SIM_NODE_AVR, listener_main,
+                 &listeners[id]);
+}
+
+
+static void
+keep_reply(void *, const struct capture_record *r, const uint8_t *data)
+{
+  struct capture_frame info;
+
+  if (num_replies == sizeof(replies) / sizeof(replies[0]) ||
+      (capture_frame_info(r, data, &info) && !info.reply))
+    return;
+  replies[num_replies].r = *r;
+  memcpy(replies[num_replies].data, data, r->len);
+  ++num_replies;
+}
+
+
+static bool
+is_request(const struct entry *e)
+{
+  struct capture_frame info;
+
+  return e->r.kind != CAPTURE_GARBAGE &&
+    (!capture_frame_info(&e->r, e->data, &info) || !info.reply);
+}
+
+
+/* The virtual time of a time in the capture. */
+static uint64_t
+replay_time(uint64_t t0, uint64_t time_us)
+{
+  return t0 + (uint64_t)((time_us - entries[0].r.start_us) * 1000 / speed);
+}
+
+
+static void
+wait_until(uint64_t t)
+{
+  if (t > sim_now())
+    sim_delay_ns(t - sim_now());
+}
+
+
+/* Compare the replies to a request with those in the capture. */
+static void
+compare_replies(const struct entry *req, const struct entry *captured,
+                uint32_t num_captured, const struct capture_record *sent)
+{
+  struct capture_frame info;
+  int64_t a, b;
+  uint32_t i, n = 0;
+
+  for (i = 0; i < num_captured; ++i)
+  {
+    if (!capture_frame_info(&captured[i].r, captured[i].data, &info) ||
+        !info.reply)
+      continue;
+    ++stats.captured;
+    if (n >= num_replies)
+    {
+      ++stats.missing;
+      continue;
+    }
+    if (n == 0)
+    {
+      a = capture_latency_us(&req->r, &captured[i].r, baud);
+      b = capture_latency_us(sent, &replies[0].r, baud);
+      ++stats.latencies;
+      stats.captured_sum += a;
+      stats.replayed_sum += b;
+      if (a > stats.captured_max)
+        stats.captured_max = a;
+      if (b > stats.replayed_max)
+        stats.replayed_max = b;
+      if (b - a > stats.worse_max)
+        stats.worse_max = b - a;
+    }
+    if (replies[n].r.len == captured[i].r.len &&
+        memcmp(replies[n].data, captured[i].data, captured[i].r.len) == 0)
+      ++stats.identical;
+    ++n;
+  }
+  stats.replayed += num_replies;
+}
+
+
+static void
+replay_requests(void *)
+{
+  struct capture_framer f;
+  struct capture_record sent;
+  uint64_t t0 = sim_now(), deadline, stamp, hold;
+  uint64_t idle_ns, char_ns = sim_char_time();
+  uint32_t i, j;
+  uint8_t errors;
+  int c;
+
+  capture_init(&f, baud, keep_reply, NULL);
+  idle_ns = f.idle_us * 1000 + char_ns;
+  for (i = 0; i < num_entries; i = j)
+  {
+    /* The request, and what came after it up to the next one. */
+    for (j = i + 1; j < num_entries && !is_request(&entries[j]); ++j)
+      ;
+    if (!is_request(&entries[i]))
+      continue;
+
+    wait_until(replay_time(t0, entries[i].r.start_us));
+    sent.start_us = sim_now() / 1000;
+    sim_port_write(entries[i].data, entries[i].r.len);
+    sent.end_us = (sim_now() - char_ns) / 1000;
+    ++stats.requests;
+
+    /* Keep the replies as long as they were in the capture. */
+    hold = sim_now();
+    if (j > i + 1)
+      hold += (entries[j - 1].r.end_us - entries[i].r.end_us) * 1000 +
+        idle_ns;
+    deadline = j < num_entries ?
+      replay_time(t0, entries[j].r.start_us) : hold;
+    if (deadline < hold)
+      deadline = hold;
+    num_replies = 0;
+    while ((c = sim_port_read(deadline, &stamp, &errors)) >= 0)
+    {
+      capture_feed(&f, c, errors, stamp / 1000);
+      if (deadline < stamp + idle_ns)
+        deadline = stamp + idle_ns;
+    }
+    capture_flush(&f);
+    compare_replies(&entries[i], &entries[i + 1], j - i - 1, &sent);
+  }
+  done = true;
+}
+
+
+static void
+replay_all(void *)
+{
+  uint64_t t0 = sim_now();
+  const uint8_t sync = 0xff;
+  uint32_t i;
+
+  for (i = 0; i < num_entries; ++i)
+  {
+    wait_until(replay_time(t0, entries[i].r.start_us));
+    if (entries[i].r.flags & CAPTURE_SYNC)
+      sim_port_write(&sync, 1);
+    sim_port_write(entries[i].data, entries[i].r.len);
+    ++stats.written;
+  }
+  /* Give the listeners time to take the last values. */
+  sim_delay_ns(10000000ULL);
+  done = true;
+}
+
+
+static void
+write_record(void *, const struct capture_record *r, const uint8_t *data)
+{
+  capture_write(out, r, data);
+}
+
+
+static void
+report(double virtual_s)
+{
+  struct listener *l;
+  struct labibus_stats sum;
+  uint32_t values = 0, devs = 0, i;
+
+  for (i = 0; i < 128; ++i)
+    devs += devices[i].d.channels > 0 && devices[i].d.channels <= MAX_CHANNELS;
+  printf("capture:    %u baud, %u records over %.3f s, %u devices, "
+         "%u poll replies\n", baud, num_entries,
+         (entries[num_entries - 1].r.end_us - entries[0].r.start_us) / 1e6,
+         devs, stats.poll_replies);
+  printf("replay:     at %.2fx, %.3f s of virtual time, %s\n", speed,
+         virtual_s, listen_mode ? "to listeners" : "requests to slaves");
+  if (!listen_mode)
+  {
+    printf("replies:    %u requests, %u replies captured, %u replayed, "
+           "%u identical, %u missing\n", stats.requests, stats.captured,
+           stats.replayed, stats.identical, stats.missing);
+    if (stats.latencies)
+      printf("latency:    captured %.1f us mean, %lld us max; replayed "
+             "%.1f us mean, %lld us max; at worst %lld us slower\n",
+             (double)stats.captured_sum / stats.latencies,
+             (long long)stats.captured_max,
+             (double)stats.replayed_sum / stats.latencies,
+             (long long)stats.replayed_max, (long long)stats.worse_max);
+    return;
+  }
+  memset(&sum, 0, sizeof(sum));
+  for (i = 0; i < num_listeners; ++i)
+  {
+    l = &listeners[i];
+    values += l->values;
+    sum.frames += l->stats.frames;
+    sum.addressed += l->stats.addressed;
+    sum.crc_errors += l->stats.crc_errors;
+    sum.too_long += l->stats.too_long;
+    sum.dropped += l->stats.dropped;
+    sum.aborted += l->stats.aborted;
+  }
+  printf("listeners:  %u, %u records sent, %u frames seen, %u addressed, "
+         "%u CRC errors, %u too long, %u dropped, %u aborted\n",
+         num_listeners, stats.written, sum.frames, sum.addressed,
+         sum.crc_errors, sum.too_long, sum.dropped, sum.aborted);
+  printf("values:     %u of %u poll replies\n", values, stats.poll_replies);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *out_file = NULL;
+  uint64_t start;
+  uint8_t id;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:t:lo:")) != -1)
+  {
+    switch (opt)
+    {
+    case 's': speed = atof(optarg); break;
+    case 't': turnaround_us = atoi(optarg); break;
+    case 'l': listen_mode = true; break;
+    case 'o': out_file = optarg; break;
+    default: optind = argc + 1; break;
+    }
+  }
+  if (optind != argc - 1 || speed <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-s speed] [-t turnaround_us] [-l] "
+            "[-o capture] capture\n", argv[0]);
+    return 1;
+  }
+  if (!load(argv[optind]))
+  {
+    fprintf(stderr, "%s: not a capture, or empty\n", argv[optind]);
+    return 1;
+  }
+
+  sim_init(baud);
+  find_devices();
+  if (listen_mode)
+  {
+    add_listeners();
+    sim_add_node("replay", SIM_NODE_HOST, replay_all, NULL);
+  }
+  else
+  {
+    for (id = 0; id < 128; ++id)
+      if (devices[id].d.channels && devices[id].d.channels <= MAX_CHANNELS)
+        sim_add_node(devices[id].name, SIM_NODE_AVR, slave_main,
+                     &devices[id]);
+    sim_add_node("replay", SIM_NODE_HOST, replay_requests, NULL);
+  }
+  if (out_file)
+  {
+    out = fopen(out_file, "wb");
+    if (!out || capture_write_header(out, baud) < 0)
+    {
+      perror(out_file);
+      return 1;
+    }
+    capture_init(&out_framer, baud, write_record, NULL);
+    sim_add_node("capture", SIM_NODE_HOST, sim_capture_node, &out_framer);
+  }
+
+  start = sim_now();
+  while (!done)
+    sim_run(sim_now() + 100000000ULL);
+  if (out)
+  {
+    capture_flush(&out_framer);
+    fclose(out);
+  }
+  report((sim_now() - start) / 1e9);
+  sim_shutdown();
+  return 0;
+}
@@ -0,0 +1,842 @@
+/*
+  Labibus master, see master.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "master.h"
+#include "Labibus_crc.h"
+
+
+/* Poll interval for devices that announce none. */
+#define DEFAULT_INTERVAL_S 1
+
+
+uint8_t
+master_dec2hex(uint8_t x)
+{
+  return x <= 9 ? x + '0' : x + ('a' - 10);
+}
+
+
+uint8_t
+master_hex2dec(uint8_t c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - ('a' - 10);
+  if (c >= 'A' && c <= 'F')
+    return c - ('A' - 10);
+  return MASTER_NOT_HEX;
+}
+
+
+int
+master_hex_byte(const uint8_t *p)
+{
+  uint8_t hi = master_hex2dec(p[0]), lo = master_hex2dec(p[1]);
+
+  return hi == MASTER_NOT_HEX || lo == MASTER_NOT_HEX ? -1 : (hi << 4) | lo;
+}
+
+
+/* COBS-encode a body, between frame delimiters. */
+uint8_t
+master_cobs_frame(const uint8_t *body, uint8_t len, uint8_t *frame)
+{
+  uint8_t i, idx = 2, code_idx = 1, code = 1;
+
+  frame[0] = 0;
+  for (i = 0; i < len; ++i)
+  {
+    if (body[i] == 0)
+    {
+      frame[code_idx] = code;
+      code_idx = idx++;
+      code = 1;
+    }
+    else
+    {
+      frame[idx++] = body[i];
+      ++code;
+    }
+  }
+  frame[code_idx] = code;
+  frame[idx++] = 0;
+  return idx;
+}
+
+
+int
+master_cobs_decode(uint8_t *buf, uint8_t len)
+{
+  uint8_t i = 0, out = 0, code, j;
+
+  while (i < len)
+  {
+    code = buf[i++];
+    if (code == 0 || i + code - 1 > len)
+      return -1;
+    for (j = 1; j < code; ++j)
+      buf[out++] = buf[i++];
+    if (code != 0xff && i < len)
+      buf[out++] = 0;
+  }
+  return out;
+}
+
+
+/* Append the CRC of buf[0..len) in hex, and the end of line. */
+static uint8_t
+append_crc(uint8_t *buf, uint8_t len)
+{
+  uint16_t crc = crc16_buf(buf, len);
+  uint8_t i;
+
+  for (i = 0; i < 4; ++i)
+    buf[len++] = master_dec2hex((crc >> (12 - 4*i)) & 0xf);
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+  return len;
+}
+
+
+/* Frame a binary body of len bytes, after adding its CRC. */
+static uint8_t
+binary_frame(uint8_t *body, uint8_t len, uint8_t *buf)
+{
+  uint16_t crc = crc16_buf(body, len);
+
+  body[len] = crc >> 8;
+  body[len+1] = crc & 0xff;
+  return master_cobs_frame(body, len + 2, buf);
+}
+
+
+uint8_t
+master_request(uint8_t *buf, uint8_t id, uint8_t type, bool binary)
+{
+  uint8_t body[4];
+
+  if (binary)
+  {
+    body[0] = id;
+    body[1] = type;
+    return binary_frame(body, 2, buf);
+  }
+  buf[0] = '?';
+  buf[1] = master_dec2hex(id >> 4);
+  buf[2] = master_dec2hex(id & 0xf);
+  buf[3] = ':';
+  buf[4] = type;
+  buf[5] = '|';
+  return append_crc(buf, 6);
+}
+
+
+uint8_t
+master_range_request(uint8_t *buf, uint8_t type, uint8_t lo, uint8_t hi,
+                     uint16_t slot_us, bool binary)
+{
+  uint8_t body[7];
+  uint8_t i;
+
+  if (binary)
+  {
+    body[0] = lo;
+    body[1] = type;
+    body[2] = hi;
+    body[3] = slot_us & 0xff;
+    body[4] = slot_us >> 8;
+    return binary_frame(body, 5, buf);
+  }
+  buf[0] = '?';
+  buf[1] = master_dec2hex(lo >> 4);
+  buf[2] = master_dec2hex(lo & 0xf);
+  buf[3] = ':';
+  buf[4] = type;
+  buf[5] = master_dec2hex(hi >> 4);
+  buf[6] = master_dec2hex(hi & 0xf);
+  for (i = 0; i < 4; ++i)
+    buf[7+i] = master_dec2hex((slot_us >> (12 - 4*i)) & 0xf);
+  buf[11] = '|';
+  return append_crc(buf, 12);
+}
+
+
+bool
+master_check_reply(const uint8_t *buf, uint8_t len, uint8_t id, uint8_t type)
+{
+  uint16_t crc;
+  uint8_t i;
+
+  if (len < 10 || buf[0] != '!' || buf[len-5] != '|' ||
+      buf[1] != master_dec2hex(id >> 4) ||
+      buf[2] != master_dec2hex(id & 0xf) || buf[4] != type)
+    return false;
+  crc = crc16_buf(buf, len-4);
+  for (i = 0; i < 4; ++i)
+    if (buf[len-4+i] != master_dec2hex((crc >> (12 - 4*i)) & 0xf))
+      return false;
+  return true;
+}
+
+
+bool
+master_check_binary_reply(const uint8_t *buf, uint8_t len, uint8_t id,
+                          uint8_t type)
+{
+  uint16_t crc;
+
+  /* Fixed-point values come in 'I' replies to polls. */
+  if (len < 4 || buf[0] != (id | 0x80) ||
+      (buf[1] != type && !(type == 'P' && buf[1] == 'I')))
+    return false;
+  crc = crc16_buf(buf, len-2);
+  return buf[len-2] == (crc >> 8) && buf[len-1] == (crc & 0xff);
+}
+
+
+void
+master_init(struct master *m, const struct master_port *port, uint32_t baud,
+            uint32_t turnaround_us)
+{
+  uint16_t id;
+
+  memset(m, 0, sizeof(*m));
+  m->port = *port;
+  m->baud = baud;
+  m->turnaround_us = turnaround_us;
+  m->timeout = 10000000ULL;
+  m->max_utilization = 0.9;
+  m->stretch = 1.0;
+  for (id = 0; id < 128; ++id)
+    m->devices[id].id = id;
+}
+
+
+/*
+  Feed a received byte to the frame being collected in m->reply. Returns 1
+  when a frame is complete (binary frames decoded, without the delimiters;
+  text frames without the end of line), 0 otherwise.
+
+  Binary frames are the bytes between zero delimiters; the sync byte is
+  outside them. Frames that are not replies, such as the echo of a request
+  on an adapter that hears itself, are skipped.
+*/
+static int
+collect(struct master *m, int c, bool binary, bool *in_frame)
+{
+  uint8_t tmp[MASTER_MAX_REPLY];
+  int n;
+
+  if (binary)
+  {
+    if (c == 0)
+    {
+      if (!*in_frame || m->reply_len == 0)
+      {
+        *in_frame = true;
+        m->reply_len = 0;
+        return 0;
+      }
+      memcpy(tmp, m->reply, m->reply_len);
+      n = master_cobs_decode(tmp, m->reply_len);
+      *in_frame = false;
+      if (n > 0 && !(tmp[0] & 0x80))
+      {
+        m->reply_len = 0;
+        return 0;
+      }
+      if (n < 0)
+        n = 0;
+      memcpy(m->reply, tmp, n);
+      m->reply_len = n;
+      return 1;
+    }
+    if (!*in_frame)
+      return 0;
+  }
+  else
+  {
+    if (c == '!')
+    {
+      *in_frame = true;
+      m->reply_len = 0;
+    }
+    if (!*in_frame || c == '\r')
+      return 0;
+    if (c == '\n')
+    {
+      *in_frame = false;
+      return 1;
+    }
+  }
+  if (m->reply_len < sizeof(m->reply))
+    m->reply[m->reply_len++] = c;
+  return 0;
+}
+
+
+/* Note a latency in the latencies of a device or of the bus. */
+static void
+note_latency(struct master_latency *l, uint64_t latency)
+{
+  uint32_t sorted[MASTER_LATENCY_SAMPLES];
+  uint32_t x;
+  uint8_t i, j;
+
+  l->samples_us[l->next] = latency / 1000;
+  l->next = (l->next + 1) % MASTER_LATENCY_SAMPLES;
+  if (l->count < MASTER_LATENCY_SAMPLES)
+    ++l->count;
+  /* Sort just far enough down to find the rank. */
+  memcpy(sorted, l->samples_us, l->count * sizeof(sorted[0]));
+  for (i = 0; i < MASTER_LATENCY_RANK && i < l->count; ++i)
+    for (j = i + 1; j < l->count; ++j)
+      if (sorted[j] > sorted[i])
+      {
+        x = sorted[i];
+        sorted[i] = sorted[j];
+        sorted[j] = x;
+      }
+  l->high = (uint64_t)sorted[i - 1] * 1000;
+}
+
+
+void
+master_note_latency(struct master *m, struct master_device *d,
+                    uint64_t latency)
+{
+  note_latency(&d->latency, latency);
+  note_latency(&m->latency, latency);
+}
+
+
+uint64_t
+master_device_timeout(const struct master *m, const struct master_device *d)
+{
+  uint64_t t, margin;
+
+  if (d->absent || d->silent >= MASTER_SILENT_POLLS)
+  {
+    if (m->latency.count < MASTER_LATENCY_MIN_SAMPLES)
+      return m->timeout;
+    t = m->latency.high + MASTER_CHARS_NS(m, 1);
+  }
+  else
+  {
+    if (d->latency.count < MASTER_LATENCY_MIN_SAMPLES)
+      return m->timeout;
+    margin = d->latency.high / 4;
+    if (margin < MASTER_CHARS_NS(m, MASTER_TIMEOUT_MARGIN_CHARS))
+      margin = MASTER_CHARS_NS(m, MASTER_TIMEOUT_MARGIN_CHARS);
+    t = d->latency.high + margin;
+  }
+  return t < m->timeout ? t : m->timeout;
+}
+
+
+int
+master_transact(struct master *m, uint8_t id, uint8_t type, bool binary,
+                uint64_t *latency)
+{
+  uint8_t req[16];
+  uint64_t req_end, first = 0, stamp = 0;
+  uint64_t timeout = master_device_timeout(m, &m->devices[id]);
+  bool in_frame = false, ok;
+  int c;
+
+  m->port.write(m->port.ctx, req, master_request(req, id, type, binary));
+  req_end = m->port.now(m->port.ctx);
+  m->reply_len = 0;
+  do
+  {
+    c = m->port.read(m->port.ctx,
+                     first ? stamp + m->timeout : req_end + timeout, &stamp);
+    if (c < 0)
+      return MASTER_TIMEOUT;
+    if (!first)
+      first = stamp;
+  } while (!collect(m, c, binary, &in_frame));
+
+  if (binary)
+    ok = master_check_binary_reply(m->reply, m->reply_len, id, type);
+  else
+    ok = master_check_reply(m->reply, m->reply_len, id, type);
+  if (!ok)
+    return MASTER_BAD;
+  master_note_latency(m, &m->devices[id], first - req_end);
+  if (latency)
+    *latency = first - req_end;
+  return MASTER_OK;
+}
+
+
+uint16_t
+master_slot_us(const struct master *m, uint16_t chars)
+{
+  return ((uint32_t)chars*10*1000000 + m->baud - 1) / m->baud +
+    MASTER_SLOT_MARGIN_US;
+}
+
+
+uint8_t
+master_range(struct master *m, uint8_t type, uint8_t lo, uint8_t hi,
+             uint16_t slot_us, bool binary, master_range_fn fn, void *arg,
+             uint32_t *bad)
+{
+  uint8_t req[20];
+  uint8_t *r = m->reply;
+  uint64_t end;
+  uint8_t reply_type = type == 'E' ? 'E' : 'P';
+  bool in_frame = false, ok;
+  int c, id, prev = -1;
+  uint8_t good = 0;
+
+  m->port.write(m->port.ctx, req,
+                master_range_request(req, type, lo, hi, slot_us, binary));
+  end = m->port.now(m->port.ctx) + (uint64_t)m->turnaround_us*1000 +
+    (uint64_t)(hi - lo + 1)*slot_us*1000;
+  m->reply_len = 0;
+  while ((c = m->port.read(m->port.ctx, end, NULL)) >= 0)
+  {
+    if (!collect(m, c, binary, &in_frame))
+      continue;
+    /* The replies come in slot order. */
+    if (binary)
+      id = m->reply_len > 1 ? r[0] & 0x7f : -1;
+    else
+      id = m->reply_len > 2 ? master_hex_byte(r + 1) : -1;
+    ok = id >= lo && id <= hi && id > prev;
+    if (ok)
+    {
+      prev = id;
+      if (binary)
+        ok = master_check_binary_reply(r, m->reply_len, id, reply_type);
+      else
+        ok = master_check_reply(r, m->reply_len, id, reply_type);
+      if (ok && reply_type == 'E')
+        ok = master_parse_presence(&m->devices[id], r, m->reply_len);
+    }
+    if (!ok)
+    {
+      if (bad)
+        ++*bad;
+      continue;
+    }
+    ++good;
+    if (fn)
+      fn(m, id, arg);
+  }
+  return good;
+}
+
+
+/*
+  Copy a field of a text reply, from p up to the next '|', unquoting "\xx",
+  into out (of size bytes). Returns the start of the next field.
+*/
+static const uint8_t *
+unquote_field(const uint8_t *p, const uint8_t *end, char *out, uint16_t size)
+{
+  uint16_t n = 0;
+  uint8_t c;
+
+  while (p < end && *p != '|')
+  {
+    c = *p++;
+    if (c == '\\' && end - p >= 2 && master_hex_byte(p) >= 0)
+    {
+      c = master_hex_byte(p);
+      p += 2;
+    }
+    if (n + 1 < size)
+      out[n++] = c;
+  }
+  out[n] = '\0';
+  return p < end ? p + 1 : end;
+}
+
+
+bool
+master_parse_presence(struct master_device *d, const uint8_t *buf,
+                      uint8_t len)
+{
+  int hi, lo;
+
+  if (buf[0] != '!')
+  {
+    if (len != 6)
+      return false;
+    d->presence_crc = (buf[2] << 8) | buf[3];
+  }
+  else
+  {
+    if (len < 10 || (hi = master_hex_byte(buf + 5)) < 0 ||
+        (lo = master_hex_byte(buf + 7)) < 0)
+      return false;
+    d->presence_crc = (hi << 8) | lo;
+  }
+  d->present = true;
+  return true;
+}
+
+
+bool
+master_parse_discover(struct master_device *d, const uint8_t *buf,
+                      uint8_t len)
+{
+  const uint8_t *p = buf + 5, *end = buf + len - 4;
+  const uint8_t *q;
+  uint8_t fields = 0, c;
+
+  if (len < 10 || buf[4] != 'D')
+    return false;
+  d->interval_s = strtoul((const char *)p, NULL, 10);
+  p = (const uint8_t *)memchr(p, '|', end - p);
+  if (!p)
+    return false;
+  ++p;
+  for (q = p; q < end; ++q)
+    fields += *q == '|';
+  /* Pairs of description and unit, and the "b" field if supported. */
+  d->binary = fields % 2 == 1 && end - p >= 2 && end[-2] == 'b' &&
+    end[-3] == '|';
+  c = fields / 2;
+  d->channels = c > MAX_CHANNELS ? MAX_CHANNELS : c;
+  for (c = 0; c < d->channels; ++c)
+  {
+    p = unquote_field(p, end, d->description[c], sizeof(d->description[c]));
+    p = unquote_field(p, end, d->unit[c], sizeof(d->unit[c]));
+  }
+  /* What presence replies announce, to know when this one is still good. */
+  d->known = d->channels > 0;
+  d->discover_crc = crc16_buf(buf, len - 4);
+  return d->known;
+}
+
+
+bool
+master_parse_poll(struct master_device *d, const uint8_t *buf, uint8_t len)
+{
+  const uint8_t *r = buf;
+  const char *p, *end;
+  uint8_t n, c;
+  int32_t fixed;
+  double scale;
+  char *next;
+
+  if (len < 4)
+    return false;
+  if (r[0] == '!')
+  {
+    p = (const char *)r + 5;
+    end = (const char *)r + len - 4;
+    for (c = 0; c < d->channels && p < end; ++c)
+    {
+      d->values[c] = strtof(p, &next);
+      if (next == p || *next != '|')
+        return false;
+      p = next + 1;
+    }
+    return c == d->channels && p == end;
+  }
+  if (r[1] == 'P')
+  {
+    n = (len - 4) / 4;
+    if (n != d->channels || len != 4 + 4*n)
+      return false;
+    /* Both ends are little endian. */
+    memcpy(d->values, r + 2, 4*n);
+    return true;
+  }
+  n = (len - 5) / 4;
+  if (len < 5 || n != d->channels || len != 5 + 4*n)
+    return false;
+  scale = pow(10.0, -(double)r[2]);
+  for (c = 0; c < n; ++c)
+  {
+    memcpy(&fixed, r + 3 + 4*c, 4);
+    d->values[c] = fixed * scale;
+  }
+  return true;
+}
+
+
+/* Worst-case time of a poll transaction, before one has been measured. */
+static uint64_t
+estimate_cost(const struct master *m, const struct master_device *d,
+              bool binary)
+{
+  uint16_t chars;
+
+  if (binary)
+    /* Request frame, sync byte, and 'I' frame with decimals and values. */
+    chars = 7 + 1 + (5 + 4*d->channels) + 3;
+  else
+    /* Request, sync byte, "!ii:P", values with '|', CRC and end of line. */
+    chars = 12 + 1 + 5 + d->channels * (POLL_FRAME_SIZE - 5) + 6;
+  return MASTER_CHARS_NS(m, chars) + (uint64_t)m->turnaround_us * 1000;
+}
+
+
+void
+master_add_device(struct master *m, struct master_device *d)
+{
+  d->present = true;
+  d->absent = false;
+  d->silent = 0;
+  if (!d->interval_s)
+    d->interval_s = DEFAULT_INTERVAL_S;
+  d->cost = estimate_cost(m, d, m->use_binary && d->binary);
+  d->release = 0;
+}
+
+
+bool
+master_discovery_cached(const struct master_device *d)
+{
+  return d->present && d->known && d->discover_crc == d->presence_crc;
+}
+
+
+uint8_t
+master_discover(struct master *m, bool slotted)
+{
+  struct master_device *d;
+  uint8_t found = 0;
+  uint16_t id;
+
+  if (slotted)
+    master_range(m, 'E', 0, 127,
+                 master_slot_us(m, MASTER_PRESENCE_TEXT_CHARS), false, NULL,
+                 NULL, NULL);
+  for (id = 0; id < 128; ++id)
+  {
+    d = &m->devices[id];
+    if (slotted && master_discovery_cached(d))
+    {
+      master_add_device(m, d);
+      ++found;
+      continue;
+    }
+    if ((slotted && !d->present) ||
+        master_transact(m, id, 'D', false, NULL) != MASTER_OK ||
+        !master_parse_discover(d, m->reply, m->reply_len))
+    {
+      d->present = false;
+      d->absent = true;
+      continue;
+    }
+    master_add_device(m, d);
+    ++found;
+  }
+  return found;
+}
+
+
+void
+master_admit(struct master *m)
+{
+  struct master_device *d;
+  uint64_t now = m->port.now(m->port.ctx);
+  double u = 0.0;
+  uint16_t id;
+
+  for (id = 0; id < 128; ++id)
+  {
+    d = &m->devices[id];
+    if (d->present)
+      u += (double)d->cost / (d->interval_s * 1e9);
+  }
+  m->stretch = u > m->max_utilization ? u / m->max_utilization : 1.0;
+  m->utilization = u / m->stretch;
+  for (id = 0; id < 128; ++id)
+  {
+    d = &m->devices[id];
+    if (!d->present)
+      continue;
+    d->period = (uint64_t)(d->interval_s * 1e9 * m->stretch);
+    /* The first poll is due right away. */
+    if (!d->release)
+      d->release = now;
+  }
+  m->next_admission = now + MASTER_ADMIT_NS;
+}
+
+
+struct master_device *
+master_next_job(struct master *m, uint64_t now, uint64_t *wake)
+{
+  struct master_device *d, *job = NULL;
+  uint64_t skipped;
+  uint16_t id;
+
+  *wake = ~(uint64_t)0;
+  for (id = 0; id < 128; ++id)
+  {
+    d = &m->devices[id];
+    if (!d->present)
+      continue;
+    if (d->release > now)
+    {
+      if (d->release < *wake)
+        *wake = d->release;
+      continue;
+    }
+    /* Whole intervals that passed without a poll are given up. */
+    skipped = (now - d->release) / d->period;
+    if (skipped)
+    {
+      d->stats.missed += skipped;
+      d->release += skipped * d->period;
+    }
+    if (!job || d->release + d->period < job->release + job->period)
+      job = d;
+  }
+  if (job)
+    *wake = now;
+  return job;
+}
+
+
+void
+master_job_done(struct master_device *d, int result, uint64_t start,
+                uint64_t now)
+{
+  uint64_t deadline = d->release + d->period;
+  uint64_t t = now - start;
+
+  ++d->stats.polls;
+  if (result == MASTER_TIMEOUT)
+  {
+    if (d->silent < 255)
+      ++d->silent;
+  }
+  else
+    d->silent = 0;
+  if (result == MASTER_OK)
+  {
+    ++d->stats.replies;
+    d->value_time = now;
+    /* Follow longer transactions at once, and shorter ones slowly. */
+    if (t > d->cost)
+      d->cost = t;
+    else
+      d->cost -= (d->cost - t) / 8;
+  }
+  else if (result == MASTER_TIMEOUT)
+    ++d->stats.timeouts;
+  else
+    ++d->stats.bad;
+  if (now > deadline)
+  {
+    ++d->stats.late;
+    if (now - deadline > d->stats.max_late)
+      d->stats.max_late = now - deadline;
+  }
+  d->release += d->period;
+}
+
+
+void
+master_run(struct master *m, uint64_t until)
+{
+  struct master_device *d;
+  uint64_t now, wake;
+  int result;
+
+  for (;;)
+  {
+    now = m->port.now(m->port.ctx);
+    if (now >= until)
+      return;
+    if (now >= m->next_admission)
+      master_admit(m);
+    d = master_next_job(m, now, &wake);
+    if (!d)
+    {
+      m->port.sleep_until(m->port.ctx, wake < until ? wake : until);
+      continue;
+    }
+    result = master_transact(m, d->id, 'P', m->use_binary && d->binary,
+                             NULL);
+    if (result == MASTER_OK && !master_parse_poll(d, m->reply, m->reply_len))
+      result = MASTER_BAD;
+    master_job_done(d, result, now, m->port.now(m->port.ctx));
+    if (result == MASTER_OK && m->on_values)
+      m->on_values(m, d);
+  }
+}
+
+
+static speed_t
+tty_speed(uint32_t baud)
+{
+  switch (baud)
+  {
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  case 230400: return B230400;
+  case 460800: return B460800;
+  case 500000: return B500000;
+  case 921600: return B921600;
+  case 1000000: return B1000000;
+  default: return B0;
+  }
+}
+
+
+int
+master_open_tty(const char *path, uint32_t baud, bool listen)
+{
+  struct termios tio;
+  speed_t speed = tty_speed(baud);
+  int fd, err;
+
+  if (speed == B0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  fd = open(path, (listen ? O_RDONLY : O_RDWR) | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+    return -1;
+  if (tcgetattr(fd, &tio) < 0)
+    goto fail;
+  cfmakeraw(&tio);
+  if (listen)
+  {
+    /* Receive errors marked in the data, see master.h. */
+    tio.c_iflag |= INPCK | PARMRK;
+    tio.c_iflag &= ~(IGNPAR | IGNBRK | BRKINT | ISTRIP);
+  }
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  if (tcsetattr(fd, TCSANOW, &tio) < 0)
+    goto fail;
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+
+fail:
+  err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+}
@@ -0,0 +1,288 @@
+/*
+  Labibus master, for a Linux host driving one RS485 bus.
+
+  The master discovers the devices on the bus, with a slotted discovery
+  ('E') followed by a discovery request ('D') to each device found, and then
+  polls each device at the poll interval from its discovery reply. Polls are
+  scheduled earliest deadline first: every interval, a poll of the device is
+  due, by the end of the interval. Whatever polls are due go out back to
+  back, each request as soon as the previous reply has ended; in between, the
+  master sleeps until the next one is due.
+
+  Admission control checks that the bus has the capacity for all the polls,
+  from the time each transaction takes at the baud rate (estimated before the
+  first poll, and measured after). If the polls would take more than
+  max_utilization of the bus time, all intervals are stretched by the same
+  factor, so that every device still gets its share, only less often.
+
+  The bus is reached through a struct master_port, so the same master runs
+  on a serial port (see labibus_master.cpp) or on the simulated bus (see
+  sim_master_port in sim_bus.h).
+
+  The frame helpers (master_request() to master_check_binary_reply()) speak
+  the framing of Labibus.cpp, and are usable without a struct master.
+*/
+
+#ifndef LABIBUS_MASTER_H
+#define LABIBUS_MASTER_H
+
+#include <stdint.h>
+
+#include "Labibus.h"
+
+
+/* Largest reply, with framing. */
+#define MASTER_MAX_REPLY (MAX_REQ + 8)
+
+/* Time on the wire of chars at the baud rate of a master, in ns. */
+#define MASTER_CHARS_NS(m, chars)                               \
+  ((uint64_t)(chars) * 10 * 1000000000ULL / (m)->baud)
+
+/*
+  Presence replies, "!ii:Edddd|cccc\r\n" and 'E' frames, in chars with the
+  sync byte. The slots of slotted discovery take that, plus a margin.
+*/
+#define MASTER_PRESENCE_TEXT_CHARS 17
+#define MASTER_PRESENCE_BINARY_CHARS 10
+#define MASTER_SLOT_MARGIN_US 30
+
+/* How often the intervals are admitted again, with measured times. */
+#define MASTER_ADMIT_NS 10000000000ULL
+
+/*
+  Adaptive response timeouts. The latency of the replies of each device
+  (end of request to first byte) is kept for the last
+  MASTER_LATENCY_SAMPLES replies, and so is that of all replies on the bus.
+  Once a device has replied MASTER_LATENCY_MIN_SAMPLES times, it is waited
+  for up to the MASTER_LATENCY_RANK-th highest of its latencies (about the
+  94th percentile), plus a quarter of that, and at least
+  MASTER_TIMEOUT_MARGIN_CHARS char times. IDs known to be absent (no reply
+  to the last discovery, or MASTER_SILENT_POLLS polls in a row without one)
+  are waited for up to the same percentile of the bus, plus one char time:
+  by then, the reply would have begun. Until there are enough latencies,
+  and at most, the timeout of the master applies.
+*/
+#define MASTER_LATENCY_SAMPLES 16
+#define MASTER_LATENCY_RANK 2
+#define MASTER_LATENCY_MIN_SAMPLES 4
+#define MASTER_TIMEOUT_MARGIN_CHARS 4
+#define MASTER_SILENT_POLLS 2
+
+/*
+  Access to the bus, with times in nanoseconds on the clock of the port.
+  write() returns once the data is on the wire. read() returns the next
+  byte received, or -1 if none arrives before the deadline; if stamp is not
+  NULL, it is set to the time the byte arrived.
+*/
+struct master_port {
+  void *ctx;
+  uint64_t (*now)(void *ctx);
+  void (*write)(void *ctx, const uint8_t *buf, uint16_t len);
+  int (*read)(void *ctx, uint64_t deadline, uint64_t *stamp);
+  void (*sleep_until)(void *ctx, uint64_t t);
+};
+
+struct master_latency {
+  /* The last latencies, in us, and how many of them there are. */
+  uint32_t samples_us[MASTER_LATENCY_SAMPLES];
+  uint8_t count, next;
+  /* The MASTER_LATENCY_RANK-th highest of them, in ns. */
+  uint64_t high;
+};
+
+struct master_device_stats {
+  uint32_t polls, replies, timeouts, bad;
+  /* Polls that completed after their deadline, and the worst lateness. */
+  uint32_t late;
+  uint64_t max_late;
+  /* Intervals in which the device could not be polled at all. */
+  uint32_t missed;
+};
+
+struct master_device {
+  bool present;
+  /* No reply to the last discovery request. */
+  bool absent;
+  bool binary;
+  uint8_t id;
+  uint8_t channels;
+  /* CRC of the discovery reply, from slotted discovery. */
+  uint16_t presence_crc;
+  /* CRC of the discovery reply parsed into the device, if known is set. */
+  bool known;
+  uint16_t discover_crc;
+  /* The poll interval announced, in seconds. */
+  uint16_t interval_s;
+  /* The poll interval scheduled, after admission control. */
+  uint64_t period;
+  /* Time a poll transaction takes, estimated or measured. */
+  uint64_t cost;
+  /* Release of the next poll, which is due by release + period. */
+  uint64_t release;
+  /* Latency of its replies, and polls in a row without a reply. */
+  struct master_latency latency;
+  uint8_t silent;
+  char description[MAX_CHANNELS][MAX_DESCRIPTION + 1];
+  char unit[MAX_CHANNELS][MAX_UNIT + 1];
+  /* The values of the last poll reply, and when it came. */
+  float values[MAX_CHANNELS];
+  uint64_t value_time;
+  struct master_device_stats stats;
+};
+
+struct master {
+  struct master_port port;
+  uint32_t baud;
+  /* The turnaround of the slaves, see labibus_set_turnaround(). */
+  uint32_t turnaround_us;
+  /*
+    How long to wait for the first byte of a reply, at most (see above),
+    and between bytes.
+  */
+  uint64_t timeout;
+  /* Latency of all replies, for IDs known to be absent. */
+  struct master_latency latency;
+  /* Poll devices that support it with binary frames. */
+  bool use_binary;
+  double max_utilization;
+  /* Bus time the polls take at their scheduled intervals, and the factor
+     by which the announced intervals were stretched to get there. */
+  double utilization;
+  double stretch;
+  /* Called with each poll reply, after the values have been stored. */
+  void (*on_values)(struct master *m, const struct master_device *d);
+  void *arg;
+  /* Time of the next admission check, with measured transaction times. */
+  uint64_t next_admission;
+  struct master_device devices[128];
+  /* The last good reply; binary replies COBS-decoded. */
+  uint8_t reply[MASTER_MAX_REPLY];
+  uint8_t reply_len;
+};
+
+/* Results of master_transact(). */
+#define MASTER_OK 0
+#define MASTER_TIMEOUT -1
+#define MASTER_BAD -2
+
+
+extern void master_init(struct master *m, const struct master_port *port,
+                        uint32_t baud, uint32_t turnaround_us);
+
+/*
+  Find the devices on the bus and read their discovery replies. With
+  slotted false, every ID is asked with a discovery request instead of one
+  slotted discovery; with slotted true, only the devices whose discovery
+  reply is not cached are. Returns the number of devices found.
+*/
+extern uint8_t master_discover(struct master *m, bool slotted);
+
+/*
+  Whether the discovery reply parsed into a device found by slotted
+  discovery is still the one it announced, so that it need not be asked for
+  it again.
+*/
+extern bool master_discovery_cached(const struct master_device *d);
+
+/* Set the scheduled intervals of the devices found, see above. */
+extern void master_admit(struct master *m);
+
+/*
+  Send a request ('P', 'D', 'C', ...) and wait for the reply, which is left
+  in m->reply, up to the timeout of the device. The latency (end of the
+  request to the first byte of the reply) is noted for the device, and
+  stored through latency if not NULL.
+*/
+extern int master_transact(struct master *m, uint8_t id, uint8_t type,
+                           bool binary, uint64_t *latency);
+
+/*
+  Send a range poll ('R') or slotted discovery ('E') for devices lo to hi,
+  with slots of slot_us, and collect the replies. For each good reply, left
+  in m->reply, fn is called if not NULL; presence replies also mark the
+  device present, with its presence_crc. Returns the number of good replies,
+  and adds the bad ones to *bad if not NULL.
+*/
+typedef void (*master_range_fn)(struct master *m, uint8_t id, void *arg);
+extern uint8_t master_range(struct master *m, uint8_t type, uint8_t lo,
+                            uint8_t hi, uint16_t slot_us, bool binary,
+                            master_range_fn fn, void *arg, uint32_t *bad);
+/* Slot for replies of the given length in chars, at the baud rate. */
+extern uint16_t master_slot_us(const struct master *m, uint16_t chars);
+
+/*
+  Earliest deadline first scheduling. master_next_job() returns the device
+  to poll now, or NULL if none is due, with the time the next one is due in
+  *wake. master_job_done() records the outcome of the poll of d, started at
+  start, and counts polls in a row without a reply.
+*/
+extern struct master_device *master_next_job(struct master *m, uint64_t now,
+                                             uint64_t *wake);
+extern void master_job_done(struct master_device *d, int result,
+                            uint64_t start, uint64_t now);
+
+/*
+  Parse a reply (as left in m->reply) into the device: the description,
+  units and binary support of a discovery reply, or the values of a poll
+  reply. Returns false if it does not parse.
+*/
+extern bool master_parse_discover(struct master_device *d,
+                                  const uint8_t *buf, uint8_t len);
+/* Likewise a presence reply, which marks the device present. */
+extern bool master_parse_presence(struct master_device *d,
+                                  const uint8_t *buf, uint8_t len);
+extern bool master_parse_poll(struct master_device *d, const uint8_t *buf,
+                              uint8_t len);
+/*
+  Add a device whose discovery reply has been parsed, with an estimate of
+  its poll time, to be scheduled from the next master_admit().
+*/
+extern void master_add_device(struct master *m, struct master_device *d);
+
+/*
+  How long to wait for the first byte of a reply of the device, see above;
+  and note the latency of one of its replies.
+*/
+extern uint64_t master_device_timeout(const struct master *m,
+                                      const struct master_device *d);
+extern void master_note_latency(struct master *m, struct master_device *d,
+                                uint64_t latency);
+
+/* Poll the devices, as scheduled, until the given time. */
+extern void master_run(struct master *m, uint64_t until);
+
+
+/* Frame helpers. The request functions return the length of the frame. */
+/* The value of a hex digit, or MASTER_NOT_HEX; of two, or -1. */
+#define MASTER_NOT_HEX 0xff
+extern uint8_t master_hex2dec(uint8_t c);
+extern int master_hex_byte(const uint8_t *p);
+extern uint8_t master_dec2hex(uint8_t x);
+extern uint8_t master_request(uint8_t *buf, uint8_t id, uint8_t type,
+                              bool binary);
+extern uint8_t master_range_request(uint8_t *buf, uint8_t type, uint8_t lo,
+                                    uint8_t hi, uint16_t slot_us,
+                                    bool binary);
+extern uint8_t master_cobs_frame(const uint8_t *body, uint8_t len,
+                                 uint8_t *frame);
+/* Decode a frame (without delimiters) in place; -1 if it is not valid. */
+extern int master_cobs_decode(uint8_t *buf, uint8_t len);
+/*
+  Check a text reply (from '!' up to the CRC) or a decoded binary reply,
+  from the given device and of the given type (or 'I' for 'P').
+*/
+extern bool master_check_reply(const uint8_t *buf, uint8_t len, uint8_t id,
+                               uint8_t type);
+extern bool master_check_binary_reply(const uint8_t *buf, uint8_t len,
+                                      uint8_t id, uint8_t type);
+
+/*
+  Open a serial port (or pty) in raw, non-blocking mode, 8N1 at the baud
+  rate. With listen set, it is opened read-only, and receive errors are
+  marked in the data (PARMRK): a 0xff byte comes as 0xff 0xff, and a byte
+  with a framing or parity error as 0xff 0 and the byte. Returns the file
+  descriptor, or -1 with errno set (EINVAL for an unsupported baud rate).
+*/
+extern int master_open_tty(const char *path, uint32_t baud, bool listen);
+
+#endif  /* LABIBUS_MASTER_H */
@@ -0,0 +1,314 @@
+/*
+  Benchmark of the master library (master.h) on the simulated RS485 bus.
+
+  Runs a number of slave nodes, each serving one sensor with the Labibus
+  library, with poll intervals of 1, 2, 5 and 10 s in turn, and the master,
+  which discovers them and polls each at its interval, earliest deadline
+  first, for the given amount of virtual time. Reports the admission (the
+  bus utilization of the polls, and how much the intervals had to be
+  stretched to fit), and for each interval how many polls were made, how
+  far apart, and how many came late or were missed.
+
+  Every fourth slave has two channels, and every fifth has a description
+  that needs quoting. The master checks the descriptions and units it
+  discovered, and that the values it polls are plausible: the slaves ramp
+  them up from their ID in steps of 1/8, with the second channel 50 above
+  the first.
+
+  With enough slaves at a low baud rate, the polls do not fit on the bus,
+  eg. "master_bench 100 60 9600".
+
+  Discovery is run twice. With "scan" discovery, the master asks every ID
+  for its discovery reply: the second time, the IDs found absent are given
+  up on soon after a reply would have begun, as learned from the latencies
+  of the replies (see master.h). With slotted discovery, the second time
+  only takes the slotted discovery request, as the discovery replies are
+  cached. Reports the time of both, and the timeouts learned.
+
+  With a capture file, all that goes over the wire is recorded into it
+  (capture.h), eg. for labibus_replay.
+
+  Usage: master_bench [nodes [seconds [baud [turnaround_us [format
+                      [max_utilization [slotted|scan [capture_file]]]]]]]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Labibus.h"
+#include "sim_hal.h"
+#include "sim_bus.h"
+#include "master.h"
+#include "capture.h"
+
+
+struct slave {
+  uint8_t id;
+  char name[16];
+  char description[40];
+};
+
+#define SLAVE_CHANNELS(id) ((id) % 4 == 0 ? 2 : 1)
+#define CLASSES 4
+static const uint16_t intervals[CLASSES] = { 1, 2, 5, 10 };
+#define SLAVE_INTERVAL(id) intervals[(id) % CLASSES]
+
+static uint8_t num_slaves;
+static uint32_t baud = LABIBUS_BAUD;
+static uint16_t turnaround_us = 1000;
+static bool use_binary;
+static double max_utilization = 0.9;
+static bool scan;
+static uint32_t seconds = 60;
+static struct slave *slaves;
+
+static struct master bus;
+static struct capture_framer capture;
+static FILE *capture_file;
+
+static struct {
+  uint32_t discovered, description_errors;
+  uint64_t discover_time, rediscover_time, run_start;
+  uint32_t values, value_errors;
+} stats;
+
+
+static void
+write_record(void *, const struct capture_record *r, const uint8_t *data)
+{
+  capture_write(capture_file, r, data);
+}
+
+
+static void
+slave_main(void *arg)
+{
+  struct slave *s = (struct slave *)arg;
+  const char *descriptions[2] = { s->description, "Simulated humidity" };
+  const char *units[2] = { "degree C", "%rel" };
+  float vals[2] = { (float)s->id, s->id + 50.0f };
+
+  if (SLAVE_CHANNELS(s->id) == 1)
+    labibus_init(s->id, SLAVE_INTERVAL(s->id), s->description, "degree C",
+                 3);
+  else
+    labibus_init_channels(s->id, SLAVE_INTERVAL(s->id), 2, descriptions,
+                          units, 3);
+  labibus_set_turnaround(turnaround_us);
+  for (;;)
+  {
+    if (SLAVE_CHANNELS(s->id) == 2)
+      labibus_set_sensor_values(s->id, vals);
+    else
+      labibus_set_sensor_value(s->id, vals[0]);
+    _delay_ms(5);
+    vals[0] += 0.125f;
+    vals[1] += 0.125f;
+  }
+}
+
+
+static void
+on_values(struct master *, const struct master_device *d)
+{
+  float steps = (d->values[0] - d->id) * 8;
+
+  ++stats.values;
+  if (steps < 0 || steps != floorf(steps) ||
+      (d->channels == 2 && d->values[1] != d->values[0] + 50.0f))
+    ++stats.value_errors;
+}
+
+
+/* Check what the master discovered against what the slaves serve. */
+static void
+check_discovery(void)
+{
+  const struct master_device *d;
+  uint8_t i;
+
+  for (i = 0; i < num_slaves; ++i)
+  {
+    d = &bus.devices[slaves[i].id];
+    if (!d->present || d->channels != SLAVE_CHANNELS(d->id) ||
+        d->interval_s != SLAVE_INTERVAL(d->id) ||
+        strcmp(d->description[0], slaves[i].description) != 0 ||
+        strcmp(d->unit[0], "degree C") != 0 ||
+        (d->channels == 2 && strcmp(d->unit[1], "%rel") != 0))
+      ++stats.description_errors;
+  }
+}
+
+
+static void
+master_main(void *)
+{
+  uint64_t start;
+
+  master_init(&bus, &sim_master_port, baud, turnaround_us);
+  bus.use_binary = use_binary;
+  bus.max_utilization = max_utilization;
+  bus.on_values = on_values;
+  /* Give the slaves time to start up and get a first value. */
+  sim_delay_ns(20000000ULL);
+
+  start = sim_now();
+  stats.discovered = master_discover(&bus, !scan);
+  stats.discover_time = sim_now() - start;
+  start = sim_now();
+  stats.discovered = master_discover(&bus, !scan);
+  stats.rediscover_time = sim_now() - start;
+  check_discovery();
+  master_admit(&bus);
+  stats.run_start = sim_now();
+  master_run(&bus, SIM_NEVER);
+}
+
+
+static void
+report(void)
+{
+  struct master_device_stats cls[CLASSES];
+  uint32_t devices[CLASSES];
+  const struct master_device *d;
+  struct master_device absent;
+  double run = (sim_now() - stats.run_start) / 1e9;
+  uint64_t max_period[CLASSES], timeout, min_timeout = ~(uint64_t)0;
+  uint64_t max_timeout = 0;
+  uint8_t i, c;
+
+  memset(cls, 0, sizeof(cls));
+  memset(devices, 0, sizeof(devices));
+  memset(max_period, 0, sizeof(max_period));
+  for (i = 0; i < num_slaves; ++i)
+  {
+    d = &bus.devices[slaves[i].id];
+    if (!d->present)
+      continue;
+    c = d->id % CLASSES;
+    ++devices[c];
+    cls[c].polls += d->stats.polls;
+    cls[c].replies += d->stats.replies;
+    cls[c].timeouts += d->stats.timeouts;
+    cls[c].bad += d->stats.bad;
+    cls[c].late += d->stats.late;
+    cls[c].missed += d->stats.missed;
+    if (d->stats.max_late > cls[c].max_late)
+      cls[c].max_late = d->stats.max_late;
+    if (d->period > max_period[c])
+      max_period[c] = d->period;
+    timeout = master_device_timeout(&bus, d);
+    if (timeout < min_timeout)
+      min_timeout = timeout;
+    if (timeout > max_timeout)
+      max_timeout = timeout;
+  }
+  memset(&absent, 0, sizeof(absent));
+  absent.absent = true;
+
+  printf("admission:  %.1f%% of the bus, intervals stretched by %.2f "
+         "(limit %.0f%%)\n", bus.utilization * 100, bus.stretch,
+         bus.max_utilization * 100);
+  if (max_timeout)
+    printf("timeouts:   %.2f to %.2f ms for the devices, %.2f ms for absent "
+           "IDs (at most %.2f ms)\n", min_timeout / 1e6, max_timeout / 1e6,
+           master_device_timeout(&bus, &absent) / 1e6, bus.timeout / 1e6);
+  for (c = 0; c < CLASSES; ++c)
+  {
+    if (!devices[c])
+      continue;
+    printf("%2u s:       %u devices every %.2f s, %u polls %.2f s apart "
+           "(%u replies, %u timeouts, %u bad), %u late (%.2f ms max), "
+           "%u missed\n", intervals[c], devices[c], max_period[c] / 1e9,
+           cls[c].polls, cls[c].polls ? run * devices[c] / cls[c].polls : 0,
+           cls[c].replies, cls[c].timeouts, cls[c].bad, cls[c].late,
+           cls[c].max_late / 1e6, cls[c].missed);
+  }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  struct sim_wire_stats ws;
+  uint8_t i;
+
+  num_slaves = 32;
+  if (argc > 1)
+    num_slaves = atoi(argv[1]);
+  if (argc > 2)
+    seconds = atoi(argv[2]);
+  if (argc > 3)
+    baud = atoi(argv[3]);
+  if (argc > 4)
+    turnaround_us = atoi(argv[4]);
+  if (argc > 5)
+    use_binary = strcmp(argv[5], "binary") == 0;
+  if (argc > 6)
+    max_utilization = atof(argv[6]);
+  if (argc > 7)
+    scan = strcmp(argv[7], "scan") == 0;
+  if (num_slaves < 1 || num_slaves > 127 ||
+      (argc > 5 && !use_binary && strcmp(argv[5], "text") != 0) ||
+      max_utilization <= 0 || max_utilization > 1 ||
+      (argc > 7 && !scan && strcmp(argv[7], "slotted") != 0))
+  {
+    fprintf(stderr, "Usage: %s [nodes(1-127) [seconds [baud "
+            "[turnaround_us [text|binary [max_utilization(0-1) "
+            "[slotted|scan [capture_file]]]]]]]]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 8)
+  {
+    capture_file = fopen(argv[8], "wb");
+    if (!capture_file || capture_write_header(capture_file, baud) < 0)
+    {
+      perror(argv[8]);
+      return 1;
+    }
+    capture_init(&capture, baud, write_record, NULL);
+  }
+
+  sim_init(baud);
+  slaves = (struct slave *)calloc(num_slaves, sizeof(*slaves));
+  for (i = 0; i < num_slaves; ++i)
+  {
+    slaves[i].id = i + 1;
+    snprintf(slaves[i].name, sizeof(slaves[i].name), "slave%u", i + 1);
+    if (slaves[i].id % 5 == 0)
+      snprintf(slaves[i].description, sizeof(slaves[i].description),
+               "Tank %u | level?\\", i + 1);
+    else
+      snprintf(slaves[i].description, sizeof(slaves[i].description),
+               "Simulated temperature %u", i + 1);
+    sim_add_node(slaves[i].name, SIM_NODE_AVR, slave_main, &slaves[i]);
+  }
+  sim_add_node("master", SIM_NODE_HOST, master_main, NULL);
+  if (capture_file)
+    sim_add_node("capture", SIM_NODE_HOST, sim_capture_node, &capture);
+  sim_run((uint64_t)seconds * 1000000000ULL);
+  sim_get_wire_stats(&ws);
+  if (capture_file)
+  {
+    capture_flush(&capture);
+    fclose(capture_file);
+  }
+
+  printf("%u nodes, %u baud, %u us turnaround, %u s simulated, %s\n",
+         num_slaves, baud, turnaround_us, seconds,
+         use_binary ? "binary" : "text");
+  printf("discovery:  %u devices in %.2f ms", stats.discovered,
+         stats.discover_time / 1e6);
+  printf(", again in %.2f ms, %u description errors\n",
+         stats.rediscover_time / 1e6, stats.description_errors);
+  report();
+  printf("values:     %u, %u implausible\n", stats.values,
+         stats.value_errors);
+  printf("wire:       %u chars, %.1f%% busy, %u collisions\n", ws.chars,
+         ws.chars * 10.0 / baud / seconds * 100, ws.collisions);
+
+  sim_shutdown();
+  return 0;
+}
@@ -0,0 +1,550 @@
+/*
+  Labibus multi-bus master engine, see master_engine.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "master_engine.h"
+
+
+/* States of a port. */
+#define PORT_START 0      /* Not started yet. */
+#define PORT_ENUMERATE 1  /* Collecting the replies to slotted discovery. */
+#define PORT_DISCOVER 2   /* Waiting for a discovery reply. */
+#define PORT_IDLE 3       /* Waiting for the next poll to be due. */
+#define PORT_POLL 4       /* Waiting for a poll reply. */
+
+/* The epoll data of a port: its index, and whether it is the timer. */
+#define EVENT_TIMER 1
+
+
+uint64_t
+engine_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint64_t
+port_now(void *)
+{
+  return engine_now();
+}
+
+
+int
+engine_init(struct engine *e)
+{
+  memset(e, 0, sizeof(*e));
+  e->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  return e->epoll_fd < 0 ? -1 : 0;
+}
+
+
+void
+engine_close(struct engine *e)
+{
+  uint16_t i;
+
+  for (i = 0; i < e->num_ports; ++i)
+  {
+    close(e->ports[i]->timer_fd);
+    free(e->ports[i]);
+  }
+  close(e->epoll_fd);
+  e->num_ports = 0;
+}
+
+
+struct engine_port *
+engine_add_port(struct engine *e, int fd, const char *name, uint32_t baud,
+                uint32_t turnaround_us)
+{
+  static const struct master_port no_port = {
+    NULL, port_now, NULL, NULL, NULL
+  };
+  struct engine_port *p;
+  struct epoll_event ev;
+
+  if (e->num_ports == ENGINE_MAX_PORTS)
+  {
+    errno = ENOSPC;
+    return NULL;
+  }
+  p = (struct engine_port *)calloc(1, sizeof(*p));
+  if (!p)
+    return NULL;
+  master_init(&p->m, &no_port, baud, turnaround_us);
+  snprintf(p->name, sizeof(p->name), "%s", name);
+  p->index = e->num_ports;
+  p->fd = fd;
+  p->epoll_fd = e->epoll_fd;
+  p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (p->timer_fd < 0)
+    goto fail;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  ev.events = EPOLLIN;
+  ev.data.u64 = (uint64_t)p->index << 1;
+  if (epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    goto fail;
+  ev.data.u64 |= EVENT_TIMER;
+  if (epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, p->timer_fd, &ev) < 0)
+  {
+    epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    goto fail;
+  }
+  e->ports[e->num_ports++] = p;
+  return p;
+
+fail:
+  if (p->timer_fd >= 0)
+    close(p->timer_fd);
+  free(p);
+  return NULL;
+}
+
+
+static void
+arm_timer(struct engine_port *p, uint64_t at)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  /* Zero would disarm it. */
+  if (!at)
+    at = 1;
+  its.it_value.tv_sec = at / 1000000000ULL;
+  its.it_value.tv_nsec = at % 1000000000ULL;
+  timerfd_settime(p->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+/* Wait for the port to be writable as well as readable, or not. */
+static void
+watch_output(struct engine_port *p, bool on)
+{
+  struct epoll_event ev;
+
+  ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.u64 = (uint64_t)p->index << 1;
+  epoll_ctl(p->epoll_fd, EPOLL_CTL_MOD, p->fd, &ev);
+}
+
+
+/*
+  Write what the port takes of the request being sent, and keep the rest
+  for when it is writable again, in place of what was kept before. Returns
+  the bytes written.
+*/
+static uint8_t
+write_request(struct engine_port *p, const uint8_t *req, uint8_t len)
+{
+  ssize_t n = write(p->fd, req, len);
+
+  if (n < 0)
+  {
+    if (errno != EAGAIN && errno != EINTR)
+    {
+      /* The request is lost: it times out. */
+      ++p->stats.bad_frames;
+      n = len;
+    }
+    else
+      n = 0;
+  }
+  if ((n < len) != (p->tx_len > 0))
+    watch_output(p, n < len);
+  memmove(p->tx, req + n, len - n);
+  p->tx_len = len - n;
+  return n;
+}
+
+
+/*
+  Send a request. The reply is due within the timeout after the request has
+  left the wire. A request normally fits in the output buffer of a serial
+  port, with no other request outstanding; if the port takes only part of
+  it, the rest goes out once the port is writable (port_writable()), and
+  the reply is due from then on.
+*/
+static void
+send_request(struct engine_port *p, const uint8_t *req, uint8_t len,
+             uint64_t timeout, uint64_t now)
+{
+  /* This replaces the end of an earlier request, if that never went out. */
+  write_request(p, req, len);
+  p->rx_len = 0;
+  p->start = now;
+  p->sent = now + MASTER_CHARS_NS(&p->m, len);
+  p->first = 0;
+  p->deadline = p->sent + timeout;
+  arm_timer(p, p->deadline);
+}
+
+
+static void
+send_to_device(struct engine_port *p, uint8_t id, uint8_t type, bool binary,
+               uint64_t now)
+{
+  uint8_t req[16];
+
+  p->id = id;
+  p->binary = binary;
+  send_request(p, req, master_request(req, id, type, binary),
+               master_device_timeout(&p->m, &p->m.devices[id]), now);
+}
+
+
+/* The latency of the reply being handled. */
+static uint64_t
+reply_latency(const struct engine_port *p)
+{
+  /* The request may leave sooner than estimated, on a pty. */
+  return p->first > p->sent ? p->first - p->sent : 0;
+}
+
+
+static void schedule(struct engine_port *p, uint64_t now);
+
+/*
+  Ask the next device found, whose discovery reply is not cached, for it;
+  or start polling.
+*/
+static void
+discover_next(struct engine_port *p, uint64_t now)
+{
+  struct master_device *d;
+
+  for (; p->next_id < 128; ++p->next_id)
+  {
+    d = &p->m.devices[p->next_id];
+    if (!d->present)
+      d->absent = true;
+    else if (master_discovery_cached(d))
+      master_add_device(&p->m, d);
+    else
+      break;
+  }
+  if (p->next_id == 128)
+  {
+    master_admit(&p->m);
+    schedule(p, now);
+    return;
+  }
+  p->state = PORT_DISCOVER;
+  send_to_device(p, p->next_id++, 'D', false, now);
+}
+
+
+/* Send the next poll that is due, or sleep until there is one. */
+static void
+schedule(struct engine_port *p, uint64_t now)
+{
+  uint64_t wake;
+
+  if (now >= p->m.next_admission)
+    master_admit(&p->m);
+  p->job = master_next_job(&p->m, now, &wake);
+  if (!p->job)
+  {
+    p->state = PORT_IDLE;
+    arm_timer(p, wake);
+    return;
+  }
+  p->state = PORT_POLL;
+  send_to_device(p, p->job->id, 'P', p->m.use_binary && p->job->binary,
+                 now);
+}
+
+
+static void
+start(struct engine_port *p, uint64_t now)
+{
+  uint16_t slot_us = master_slot_us(&p->m, MASTER_PRESENCE_TEXT_CHARS);
+  uint8_t req[ENGINE_MAX_REQUEST];
+
+  p->state = PORT_ENUMERATE;
+  p->next_id = 0;
+  send_request(p, req, master_range_request(req, 'E', 0, 127, slot_us, false),
+               p->m.timeout, now);
+  /* Collect the replies of all slots, the last one up to the timeout. */
+  p->deadline = p->sent + (uint64_t)p->m.turnaround_us * 1000 +
+    128ULL * slot_us * 1000 + p->m.timeout;
+  arm_timer(p, p->deadline);
+}
+
+
+/* End the poll in progress. */
+static void
+poll_done(struct engine *e, struct engine_port *p, int result, uint64_t now)
+{
+  uint64_t latency = reply_latency(p);
+
+  master_job_done(p->job, result, p->start, now);
+  if (result == MASTER_OK)
+  {
+    master_note_latency(&p->m, p->job, latency);
+    ++p->stats.latencies;
+    p->stats.latency_sum += latency;
+    if (latency > p->stats.latency_max)
+      p->stats.latency_max = latency;
+    if (e->on_values)
+      e->on_values(e, p, p->job);
+  }
+  schedule(p, now);
+}
+
+
+/* A frame has come in, text from '!' or a decoded binary body. */
+static void
+handle_frame(struct engine *e, struct engine_port *p, const uint8_t *buf,
+             uint8_t len, uint64_t now)
+{
+  struct master_device *d;
+  bool ok;
+  int id;
+
+  ++p->stats.frames;
+  if (p->state == PORT_DISCOVER || p->state == PORT_POLL)
+  {
+    if (p->binary && p->state == PORT_POLL)
+      id = len > 0 ? buf[0] & 0x7f : -1;
+    else
+      id = len > 2 ? master_hex_byte(buf + 1) : -1;
+    if (id != p->id)
+    {
+      /* A late reply to an earlier request: keep waiting for ours. */
+      ++p->stats.bad_frames;
+      return;
+    }
+  }
+  switch (p->state)
+  {
+  case PORT_ENUMERATE:
+    id = len > 2 ? master_hex_byte(buf + 1) : -1;
+    if (id < 0 || id > 127 || !master_check_reply(buf, len, id, 'E') ||
+        !master_parse_presence(&p->m.devices[id], buf, len))
+      ++p->stats.bad_frames;
+    return;
+
+  case PORT_DISCOVER:
+    d = &p->m.devices[p->id];
+    if (master_check_reply(buf, len, p->id, 'D') &&
+        master_parse_discover(d, buf, len))
+    {
+      master_add_device(&p->m, d);
+      master_note_latency(&p->m, d, reply_latency(p));
+    }
+    else
+    {
+      ++p->stats.bad_frames;
+      d->present = false;
+      d->absent = true;
+    }
+    discover_next(p, now);
+    return;
+
+  case PORT_POLL:
+    if (p->binary)
+      ok = master_check_binary_reply(buf, len, p->id, 'P');
+    else
+      ok = master_check_reply(buf, len, p->id, 'P');
+    if (ok)
+      ok = master_parse_poll(p->job, buf, len);
+    if (!ok)
+      ++p->stats.bad_frames;
+    poll_done(e, p, ok ? MASTER_OK : MASTER_BAD, now);
+    return;
+
+  default:
+    /* Nothing was asked for. */
+    ++p->stats.bad_frames;
+  }
+}
+
+
+/*
+  Find the complete frames in the receive buffer, and handle them where they
+  are. Text frames run from '!' (the last one, if a broken frame left an
+  earlier one) to the end of line; binary frames are between zero
+  delimiters, with the sync byte outside, and are decoded in place. Frames
+  that are not replies, such as the echo of a request on an adapter that
+  hears itself, are skipped. What is left of a frame is kept for the next
+  read.
+*/
+static void
+scan_rx(struct engine *e, struct engine_port *p, uint64_t now)
+{
+  uint8_t *b = p->rx;
+  uint8_t *s, *q, *end;
+  uint16_t start = 0;
+  bool binary = p->state == PORT_POLL && p->binary;
+  int n;
+
+  while (start < p->rx_len)
+  {
+    s = (uint8_t *)memchr(b + start, binary ? 0 : '!', p->rx_len - start);
+    if (!s)
+    {
+      start = p->rx_len;
+      break;
+    }
+    end = (uint8_t *)memchr(s + 1, binary ? 0 : '\n',
+                            b + p->rx_len - (s + 1));
+    if (!end)
+    {
+      start = s - b;
+      break;
+    }
+    start = end + 1 - b;
+    if (binary)
+    {
+      /* The closing delimiter of a frame is not the opening one of the
+         next: each frame has its own. */
+      n = master_cobs_decode(s + 1, end - (s + 1));
+      if (n > 0 && !(s[1] & 0x80))
+        continue;
+      handle_frame(e, p, s + 1, n < 0 ? 0 : n, now);
+    }
+    else
+    {
+      while ((q = (uint8_t *)memchr(s + 1, '!', end - (s + 1))))
+        s = q;
+      handle_frame(e, p, s, end - s - (end[-1] == '\r'), now);
+    }
+    /* Handling a frame may have sent the next request, which starts over
+       with an empty buffer. */
+    if (p->rx_len == 0)
+      return;
+    binary = p->state == PORT_POLL && p->binary;
+  }
+  memmove(b, b + start, p->rx_len - start);
+  p->rx_len -= start;
+}
+
+
+static void
+port_readable(struct engine *e, struct engine_port *p, uint64_t now)
+{
+  ssize_t n;
+
+  for (;;)
+  {
+    if (p->rx_len == sizeof(p->rx))
+      /* Too long for any frame. */
+      p->rx_len = 0;
+    n = read(p->fd, p->rx + p->rx_len, sizeof(p->rx) - p->rx_len);
+    if (n <= 0)
+      break;
+    p->stats.bytes += n;
+    if (p->state == PORT_IDLE || p->state == PORT_START)
+      /* Nothing was asked for. */
+      continue;
+    p->rx_len += n;
+    if (!p->first)
+      p->first = now;
+    if (p->state != PORT_ENUMERATE)
+    {
+      /* Wait for the rest of the reply up to the timeout from here. */
+      p->deadline = now + p->m.timeout;
+      arm_timer(p, p->deadline);
+    }
+    scan_rx(e, p, now);
+  }
+}
+
+
+/* Send the rest of the request that a short write left, when it fits. */
+static void
+port_writable(struct engine_port *p, uint64_t now)
+{
+  uint8_t len = p->tx_len;
+  uint64_t delay;
+
+  if (!len || write_request(p, p->tx, len) != len)
+    return;
+  /* The request leaves the wire later than estimated, and so does the
+     reply: move the deadline by as much. */
+  delay = now + MASTER_CHARS_NS(&p->m, len);
+  if (delay > p->sent)
+  {
+    delay -= p->sent;
+    p->sent += delay;
+    p->deadline += delay;
+    arm_timer(p, p->deadline);
+  }
+}
+
+
+static void
+port_timer(struct engine *e, struct engine_port *p, uint64_t now)
+{
+  uint64_t expirations;
+
+  if (read(p->timer_fd, &expirations, sizeof(expirations)) < 0)
+    return;
+  switch (p->state)
+  {
+  case PORT_ENUMERATE:
+    p->next_id = 0;
+    discover_next(p, now);
+    break;
+  case PORT_DISCOVER:
+    p->m.devices[p->id].present = false;
+    p->m.devices[p->id].absent = true;
+    discover_next(p, now);
+    break;
+  case PORT_POLL:
+    poll_done(e, p, MASTER_TIMEOUT, now);
+    break;
+  case PORT_IDLE:
+    schedule(p, now);
+    break;
+  }
+}
+
+
+void
+engine_run(struct engine *e, uint64_t until)
+{
+  struct epoll_event events[64];
+  struct engine_port *p;
+  uint64_t now = engine_now();
+  int n, i;
+
+  for (i = 0; i < e->num_ports; ++i)
+    if (e->ports[i]->state == PORT_START)
+      start(e->ports[i], now);
+  while ((now = engine_now()) < until)
+  {
+    n = epoll_wait(e->epoll_fd, events, 64,
+                   (until - now + 999999) / 1000000);
+    ++e->wakeups;
+    now = engine_now();
+    for (i = 0; i < n; ++i)
+    {
+      p = e->ports[events[i].data.u64 >> 1];
+      ++e->events;
+      if (events[i].data.u64 & EVENT_TIMER)
+        port_timer(e, p, now);
+      else
+      {
+        if (events[i].events & EPOLLOUT)
+          port_writable(p, now);
+        if (events[i].events & ~EPOLLOUT)
+          port_readable(e, p, now);
+      }
+    }
+  }
+}
@@ -0,0 +1,100 @@
+/*
+  Labibus multi-bus master engine, for a Linux host driving several RS485
+  segments, each on its own serial port.
+
+  One event loop (epoll) drives any number of ports, without a thread per
+  port: each port is a state machine with a non-blocking file descriptor and
+  a timerfd, which fires at the end of a response timeout, or when the next
+  poll is due. Each port has a struct master (master.h) for its devices and
+  its earliest deadline first schedule, which work as in master_run(); the
+  ports start with slotted discovery.
+
+  Received bytes are parsed in place in the receive buffer of the port: a
+  frame is checked, COBS-decoded and parsed where it was read, not copied
+  into a reply buffer first.
+
+  To use several cores, give each thread an engine of its own with a share
+  of the ports; the engines share nothing.
+*/
+
+#ifndef LABIBUS_MASTER_ENGINE_H
+#define LABIBUS_MASTER_ENGINE_H
+
+#include <stdint.h>
+
+#include "master.h"
+
+
+#define ENGINE_MAX_PORTS 256
+/* The longest request, slotted discovery. */
+#define ENGINE_MAX_REQUEST 20
+
+struct engine_port_stats {
+  uint32_t frames, bad_frames;
+  uint64_t bytes;
+  /* Latency of the poll replies, end of request to first byte. */
+  uint32_t latencies;
+  uint64_t latency_sum, latency_max;
+};
+
+struct engine_port {
+  struct master m;
+  char name[32];
+  /* The index of the port in the engine. */
+  uint16_t index;
+  int fd, timer_fd, epoll_fd;
+  uint8_t state;
+  /*
+    The request in progress: when it was written, when it is off the wire,
+    when its reply is due, and when the first byte of the reply came.
+  */
+  uint8_t id;
+  bool binary;
+  uint64_t start, sent, deadline, first;
+  /* The device polled, or the next ID to ask for its description. */
+  struct master_device *job;
+  uint16_t next_id;
+  /* The end of the request that the port did not take yet. */
+  uint8_t tx[ENGINE_MAX_REQUEST];
+  uint8_t tx_len;
+  /* Received bytes not parsed yet. */
+  uint8_t rx[2 * MASTER_MAX_REPLY];
+  uint16_t rx_len;
+  struct engine_port_stats stats;
+};
+
+struct engine {
+  int epoll_fd;
+  struct engine_port *ports[ENGINE_MAX_PORTS];
+  uint16_t num_ports;
+  /* Called with each poll reply, after the values have been stored. */
+  void (*on_values)(struct engine *e, struct engine_port *p,
+                    const struct master_device *d);
+  void *arg;
+  /* Returns from epoll_wait(), and events handled. */
+  uint64_t wakeups, events;
+};
+
+
+/*
+  Returns -1 with errno set on failure. engine_close() frees the ports, but
+  leaves their file descriptors open.
+*/
+extern int engine_init(struct engine *e);
+extern void engine_close(struct engine *e);
+
+/*
+  Add a port, on a file descriptor open on a serial port (or pty) set up
+  with master_open_tty(). Returns NULL with errno set on failure. The
+  struct master of the port can be configured (use_binary,
+  max_utilization, timeout) until the engine first runs.
+*/
+extern struct engine_port *engine_add_port(struct engine *e, int fd,
+                                           const char *name, uint32_t baud,
+                                           uint32_t turnaround_us);
+
+/* Run the ports until the given time (CLOCK_MONOTONIC, in ns). */
+extern void engine_run(struct engine *e, uint64_t until);
+extern uint64_t engine_now(void);
+
+#endif  /* LABIBUS_MASTER_ENGINE_H */
@@ -0,0 +1,322 @@
+/*
+  Labibus master time-series store, see master_store.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "master_store.h"
+#include "Labibus_crc.h"
+
+
+/* Length of the readable part of a file name. */
+#define STORE_NAME_CHARS 80
+
+
+/* The key of a device: the description and unit of each channel. */
+static uint16_t
+device_key(char *buf, uint16_t size, const struct master_device *d,
+           bool with_id)
+{
+  uint16_t len = 0;
+  uint8_t c;
+
+  buf[0] = '\0';
+  for (c = 0; c < d->channels && len < size; ++c)
+    len += snprintf(buf + len, size - len, "%s%s,%s", c ? ";" : "",
+                    d->description[c], d->unit[c]);
+  if (with_id && len < size)
+    len += snprintf(buf + len, size - len, "@%u", d->id);
+  return len < size ? len : size - 1;
+}
+
+
+int
+store_path(char *buf, size_t size, const char *dir,
+           const struct master_device *d, bool with_id)
+{
+  char key[MAX_CHANNELS * (MAX_DESCRIPTION + MAX_UNIT + 2) + 8];
+  char name[STORE_NAME_CHARS + 1];
+  uint16_t len = device_key(key, sizeof(key), d, with_id), i;
+
+  /* A readable name, made unique by the CRC of the whole key. */
+  for (i = 0; i < len && i < STORE_NAME_CHARS; ++i)
+    name[i] = (key[i] >= 'a' && key[i] <= 'z') ||
+      (key[i] >= 'A' && key[i] <= 'Z') || (key[i] >= '0' && key[i] <= '9') ||
+      key[i] == '-' || key[i] == '.' ? key[i] : '_';
+  name[i] = '\0';
+  return snprintf(buf, size, "%s/%s-%04x.lbs", dir, name,
+                  (uint16_t)crc16_buf((const uint8_t *)key, len));
+}
+
+
+/* Map a store file of the given size, and find its columns. */
+static int
+map_store(struct store *s, size_t size)
+{
+  uint8_t c;
+
+  s->map = mmap(NULL, size, s->writer ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED, s->fd, 0);
+  if (s->map == MAP_FAILED)
+    return -1;
+  s->size = size;
+  s->h = (struct store_header *)s->map;
+  s->time = (uint64_t *)((uint8_t *)s->map + STORE_HEADER_SIZE);
+  for (c = 0; c < MAX_CHANNELS; ++c)
+    s->values[c] = (float *)(s->time + s->h->capacity) +
+      (size_t)c * s->h->capacity;
+  return 0;
+}
+
+
+static size_t
+store_size(uint32_t capacity, uint8_t channels)
+{
+  return STORE_HEADER_SIZE + (size_t)capacity * (8 + 4 * channels);
+}
+
+
+/* Whether the header is that of a complete store of the file size. */
+static bool
+header_valid(const struct store_header *h, size_t size)
+{
+  return memcmp(h->magic, STORE_MAGIC, sizeof(h->magic)) == 0 &&
+    h->capacity > 0 && h->channels > 0 && h->channels <= MAX_CHANNELS &&
+    size == store_size(h->capacity, h->channels);
+}
+
+
+int
+store_open_writer(struct store *s, const char *path,
+                  const struct master_device *d, uint32_t capacity)
+{
+  struct store_header *h;
+  struct stat st;
+  uint8_t c;
+  int err;
+
+  memset(s, 0, sizeof(*s));
+  s->writer = true;
+  s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (s->fd < 0)
+    return -1;
+  if (flock(s->fd, LOCK_EX | LOCK_NB) < 0 || fstat(s->fd, &st) < 0)
+    goto fail;
+
+  if (st.st_size == 0)
+  {
+    /* A new store: the magic goes in last, for readers to trust it. */
+    if (ftruncate(s->fd, store_size(capacity, d->channels)) < 0)
+      goto fail;
+    s->map = mmap(NULL, STORE_HEADER_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED)
+      goto fail;
+    h = (struct store_header *)s->map;
+    h->capacity = capacity;
+    h->channels = d->channels;
+    for (c = 0; c < d->channels; ++c)
+    {
+      memcpy(h->description[c], d->description[c], sizeof(h->description[c]));
+      memcpy(h->unit[c], d->unit[c], sizeof(h->unit[c]));
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, STORE_MAGIC, sizeof(h->magic));
+    munmap(s->map, STORE_HEADER_SIZE);
+    st.st_size = store_size(capacity, d->channels);
+  }
+  else if ((size_t)st.st_size < STORE_HEADER_SIZE)
+  {
+    errno = EEXIST;
+    goto fail;
+  }
+
+  if (map_store(s, st.st_size) < 0)
+    goto fail;
+  h = s->h;
+  if (!header_valid(h, st.st_size) || h->channels != d->channels)
+    goto other;
+  for (c = 0; c < d->channels; ++c)
+    if (strcmp(h->description[c], d->description[c]) != 0 ||
+        strcmp(h->unit[c], d->unit[c]) != 0)
+      goto other;
+  h->id = d->id;
+  /* A record the last writer did not finish is given up. */
+  h->writing = h->head;
+  return 0;
+
+other:
+  munmap(s->map, s->size);
+  errno = EEXIST;
+fail:
+  err = errno;
+  close(s->fd);
+  errno = err;
+  return -1;
+}
+
+
+int
+store_open_device(struct store *s, const char *dir,
+                  const struct master_device *d, uint32_t capacity)
+{
+  char path[4096];
+
+  store_path(path, sizeof(path), dir, d, false);
+  if (store_open_writer(s, path, d, capacity) == 0)
+    return 0;
+  if (errno != EEXIST && errno != EWOULDBLOCK)
+    return -1;
+  store_path(path, sizeof(path), dir, d, true);
+  return store_open_writer(s, path, d, capacity);
+}
+
+
+int
+store_open_reader(struct store *s, const char *path)
+{
+  struct stat st;
+  int err;
+
+  memset(s, 0, sizeof(*s));
+  s->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (s->fd < 0)
+    return -1;
+  if (fstat(s->fd, &st) < 0)
+    goto fail;
+  if ((size_t)st.st_size < STORE_HEADER_SIZE)
+  {
+    errno = EINVAL;
+    goto fail;
+  }
+  if (map_store(s, st.st_size) < 0)
+    goto fail;
+  if (!header_valid(s->h, st.st_size))
+  {
+    munmap(s->map, s->size);
+    errno = EINVAL;
+    goto fail;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return 0;
+
+fail:
+  err = errno;
+  close(s->fd);
+  errno = err;
+  return -1;
+}
+
+
+void
+store_close(struct store *s)
+{
+  munmap(s->map, s->size);
+  close(s->fd);
+}
+
+
+void
+store_append(struct store *s, uint64_t time, const float *values)
+{
+  struct store_header *h = s->h;
+  uint64_t i = h->head;
+  uint32_t slot = i % h->capacity;
+  uint8_t c;
+
+  /*
+    Readers of the record overwritten are to know before it changes. The
+    entries are stored atomically, if relaxed, as readers may be reading
+    them meanwhile.
+  */
+  __atomic_store_n(&h->writing, i + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&s->time[slot], time, __ATOMIC_RELAXED);
+  for (c = 0; c < h->channels; ++c)
+    __atomic_store(&s->values[c][slot], &values[c], __ATOMIC_RELAXED);
+  __atomic_store_n(&h->head, i + 1, __ATOMIC_RELEASE);
+}
+
+
+uint64_t
+store_head(const struct store *s)
+{
+  return __atomic_load_n(&s->h->head, __ATOMIC_ACQUIRE);
+}
+
+
+uint64_t
+store_tail(const struct store *s)
+{
+  uint64_t w = __atomic_load_n(&s->h->writing, __ATOMIC_ACQUIRE);
+
+  return w > s->h->capacity ? w - s->h->capacity : 0;
+}
+
+
+/*
+  The first record from lo to hi - 1 with a time of at least t, or hi. The
+  writer may be overwriting the records read; store_intact() tells.
+*/
+static uint64_t
+lower_bound(const struct store *s, uint64_t lo, uint64_t hi, uint64_t t)
+{
+  uint64_t mid;
+
+  while (lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if (__atomic_load_n(&s->time[mid % s->h->capacity],
+                        __ATOMIC_RELAXED) < t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+
+void
+store_query(const struct store *s, uint64_t from, uint64_t to,
+            struct store_range *r)
+{
+  uint32_t cap = s->h->capacity, slot;
+  uint64_t head = store_head(s), tail = store_tail(s), n;
+  uint8_t c, k;
+
+  memset(r, 0, sizeof(*r));
+  r->tail = tail;
+  /* The times only grow, so the records wanted are together. */
+  r->first = lower_bound(s, tail, head, from);
+  r->end = lower_bound(s, r->first, head, to);
+  for (n = r->first; n < r->end; n += r->len[k])
+  {
+    k = r->spans++;
+    slot = n % cap;
+    r->len[k] = r->end - n < cap - slot ? r->end - n : cap - slot;
+    r->time[k] = s->time + slot;
+    for (c = 0; c < s->h->channels; ++c)
+      r->values[k][c] = s->values[c] + slot;
+  }
+}
+
+
+/*
+  Whether none of the records from r->tail on were overwritten: those of the
+  range, and those the search for it read, which the range depends on.
+*/
+bool
+store_intact(const struct store *s, const struct store_range *r)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&s->h->writing, __ATOMIC_RELAXED) <=
+    r->tail + s->h->capacity;
+}
@@ -0,0 +1,122 @@
+/*
+  Labibus master time-series store: the values polled from each device, in
+  a memory-mapped file of its own, for dashboards and the like to read while
+  the master writes.
+
+  A store file holds a fixed number of records in a ring, in columns: after
+  a header of one page come the timestamps of all records, then the values
+  of each channel in turn. The master appends a record per poll reply,
+  which takes no system call and no formatting; the kernel writes the pages
+  back. The file is keyed by the descriptions and units of the channels of
+  the device, not by its bus ID, so that its history stays with the sensor.
+  Identical sensors on one bus get files keyed by their ID as well.
+
+  There is one writer per file (the file is locked while open for writing),
+  and any number of readers in other processes, without locks: the writer
+  publishes each record with a release store of the record count, and
+  readers look at the records in the mapping, not at copies. Since the
+  writer does not wait for readers, the oldest records of a range being read
+  may be overwritten meanwhile; store_intact() tells afterwards whether they
+  were.
+*/
+
+#ifndef LABIBUS_MASTER_STORE_H
+#define LABIBUS_MASTER_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "master.h"
+
+
+#define STORE_MAGIC "LBSTORE1"
+/* The size of the header, and so the offset of the timestamps. */
+#define STORE_HEADER_SIZE 4096
+/* A week of values every second. */
+#define STORE_DEFAULT_CAPACITY (7 * 24 * 3600UL)
+
+struct store_header {
+  char magic[8];
+  uint32_t capacity;
+  uint8_t channels;
+  uint8_t id;
+  char description[MAX_CHANNELS][MAX_DESCRIPTION + 1];
+  char unit[MAX_CHANNELS][MAX_UNIT + 1];
+  /*
+    The number of records written, and of records begun: record i is in
+    slot i % capacity. The writer bumps writing before it overwrites a
+    slot, and head once the record is in.
+  */
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t writing __attribute__((aligned(64)));
+};
+
+struct store {
+  int fd;
+  bool writer;
+  void *map;
+  size_t size;
+  struct store_header *h;
+  /* The columns, each of h->capacity entries. */
+  uint64_t *time;
+  float *values[MAX_CHANNELS];
+};
+
+/*
+  Records in a store, records first to end - 1, in up to two spans, as the
+  ring wraps: the len[k] records from time[k] and values[k][channel].
+  The search for them read records from tail on.
+*/
+struct store_range {
+  uint64_t tail, first, end;
+  uint8_t spans;
+  uint32_t len[2];
+  const uint64_t *time[2];
+  const float *values[2][MAX_CHANNELS];
+};
+
+
+/*
+  The path of the store of a device in a directory, with its ID in the key
+  if with_id. Returns the length, as snprintf().
+*/
+extern int store_path(char *buf, size_t size, const char *dir,
+                      const struct master_device *d, bool with_id);
+
+/*
+  Open the store of a device for writing, creating it with room for capacity
+  records if there is none; an existing store keeps its capacity. Fails
+  with EEXIST if the file is the store of other channels, and EWOULDBLOCK if
+  it is open for writing already. store_open_device() opens the store of a
+  device in a directory, keyed by its ID as well if the store without is
+  taken. Return -1 with errno set on failure.
+*/
+extern int store_open_writer(struct store *s, const char *path,
+                             const struct master_device *d,
+                             uint32_t capacity);
+extern int store_open_device(struct store *s, const char *dir,
+                             const struct master_device *d,
+                             uint32_t capacity);
+/* Open a store for reading. Returns -1 with errno set on failure. */
+extern int store_open_reader(struct store *s, const char *path);
+extern void store_close(struct store *s);
+
+/* Append a record: the time (in ns since the epoch) and the values. */
+extern void store_append(struct store *s, uint64_t time,
+                         const float *values);
+
+/*
+  Find the records with times from from up to (not including) to, as
+  pointers into the store. Once done with them, check store_intact(); if
+  it returns false, the writer has overwritten some of them, or some of the
+  records the search went by, and the query should be made again.
+*/
+extern void store_query(const struct store *s, uint64_t from, uint64_t to,
+                        struct store_range *r);
+extern bool store_intact(const struct store *s, const struct store_range *r);
+
+/* The records written so far, and the oldest of them kept. */
+extern uint64_t store_head(const struct store *s);
+extern uint64_t store_tail(const struct store *s);
+
+#endif  /* LABIBUS_MASTER_STORE_H */
@@ -0,0 +1,262 @@
+/*
+  Checks and times the number codec (Labibus_num.h) against the libc
+  functions it replaces.
+
+  num_format() must give the same text as the avr-libc dtostrf() (and
+  dtostre() for values too long for the poll frame) that poll replies used
+  to be encoded with. The reference for that is host printf(), which rounds
+  the exact value of the float to nearest, ties to even: to the decimals
+  when all of them are within the 7 significant digits, else to 7
+  significant digits and then padded with zeros. This is the rounding of
+  num_format(); avr-libc's own conversion is not checked here, as that
+  needs the AVR. num_parse() must give the same float as a correctly
+  rounded strtof(). Beyond the range where the codec is exact (values of
+  EXACT_FORMAT and more for num_format(), EXACT_PARSE and more for
+  num_parse()), they may be one off in the last digit or the last bit of
+  the float, and are counted apart.
+  Both are checked on a sweep of typical sensor values and on random bit
+  patterns, and then timed on the host. The fixed-point functions are checked
+  against snprintf() and for round trip, and num_parse() on their text
+  against strtof().
+
+  Usage: num_bench [random_values [decimals]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "Labibus.h"
+#include "Labibus_num.h"
+#include "sim_hal.h"
+
+
+#define MAX_TEXT (POLL_FRAME_SIZE - 6)
+/* Where the codec is exact, see Labibus_num.h. */
+#define EXACT_FORMAT 1e20f
+#define EXACT_PARSE 1e16f
+
+static uint8_t decimals = VALUE_DECIMALS;
+static uint32_t format_errors, parse_errors, checked, fixed_errors;
+static uint32_t format_near, parse_near;
+
+
+/* What encode_poll() used to send, by host printf(). */
+static void
+reference_format(float value, char *out)
+{
+  char sig[32];
+  int exp10;
+
+  /* The value rounded to 7 significant digits, and its decimal exponent. */
+  snprintf(sig, sizeof(sig), "%.6e", (double)value);
+  exp10 = isfinite(value) ? atoi(strchr(sig, 'e') + 1) : 0;
+  if (exp10 + 1 + decimals <= 7)
+    snprintf(out, 64, "%.*f", decimals, (double)value);
+  else
+    /* The double nearest to the 7 digits prints them, then zeros, in up to
+       15 significant digits, which is all that fits in MAX_TEXT. */
+    snprintf(out, 64, "%.*f", decimals, strtod(sig, NULL));
+  if (strlen(out) > MAX_TEXT)
+    snprintf(out, 64, "%.6e", (double)value);
+  /* A NaN is sent without its sign. */
+  if (isnan(value))
+    strcpy(out, "nan");
+}
+
+
+/* Do the texts differ by at most one in the 7th significant digit? */
+static bool
+one_digit_off(const char *ref, const char *out)
+{
+  char sig[32];
+  double unit;
+
+  snprintf(sig, sizeof(sig), "%.6e", strtod(ref, NULL));
+  unit = pow(10.0, atoi(strchr(sig, 'e') + 1) - 6);
+  return fabs(strtod(ref, NULL) - strtod(out, NULL)) <= unit * 1.5;
+}
+
+
+static void
+check(float value)
+{
+  char ref[64], out[64];
+  uint8_t len;
+  float a, b;
+
+  reference_format(value, ref);
+  len = num_format(value, decimals, out, MAX_TEXT);
+  out[len] = '\0';
+  ++checked;
+  if (strcmp(ref, out) != 0)
+  {
+    if (fabsf(value) >= EXACT_FORMAT && one_digit_off(ref, out))
+      ++format_near;
+    else if (++format_errors <= 10)
+      printf("format %.9g: printf \"%s\", num \"%s\"\n", value, ref, out);
+    return;
+  }
+  a = strtof(ref, NULL);
+  b = num_parse(ref);
+  if (memcmp(&a, &b, sizeof(a)) != 0 && !(a != a && b != b))
+  {
+    if (fabsf(a) >= EXACT_PARSE &&
+        (b == nextafterf(a, INFINITY) || b == nextafterf(a, -INFINITY)))
+      ++parse_near;
+    else if (++parse_errors <= 10)
+      printf("parse \"%s\": strtof %.9g, num %.9g\n", ref, a, b);
+  }
+}
+
+
+static void
+check_fixed(int32_t v, uint8_t d)
+{
+  char ref[32], out[32];
+  uint32_t u = v < 0 ? -(uint32_t)v : v;
+  uint32_t p = 1;
+  uint8_t i;
+  float a, b;
+
+  for (i = 0; i < d; ++i)
+    p *= 10;
+  if (d)
+    snprintf(ref, sizeof(ref), "%s%u.%0*u", v < 0 ? "-" : "", u / p, d,
+             u % p);
+  else
+    snprintf(ref, sizeof(ref), "%d", v);
+  out[num_format_fixed(v, d, out)] = '\0';
+  a = strtof(out, NULL);
+  b = num_parse(out);
+  if (strcmp(ref, out) != 0 || num_parse_fixed(out, d) != v ||
+      memcmp(&a, &b, sizeof(a)) != 0)
+  {
+    if (++fixed_errors <= 10)
+      printf("fixed %d/10^%u: ref \"%s\", num \"%s\", back %d, "
+             "float %.9g, strtof %.9g\n", v, d, ref, out,
+             num_parse_fixed(out, d), b, a);
+  }
+}
+
+
+static float
+random_float(void)
+{
+  uint32_t bits = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+  float f;
+
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+#define TIME_VALUES 4096
+
+static float values[TIME_VALUES];
+static char texts[TIME_VALUES][32];
+static volatile uint32_t sink;
+
+/* Time one of the alternatives, in ns per call. */
+#define TIME_LOOP(rounds, body)                                         \
+  ({                                                                    \
+    double t0 = now_ns();                                               \
+    for (uint32_t r = 0; r < (rounds); ++r)                             \
+      for (uint32_t i = 0; i < TIME_VALUES; ++i)                        \
+      {                                                                 \
+        body;                                                           \
+      }                                                                 \
+    (now_ns() - t0) / ((double)(rounds) * TIME_VALUES);                 \
+  })
+
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t n = 1000000, i;
+  uint32_t rounds = 50;
+  char buf[64];
+  float f;
+
+  if (argc > 1)
+    n = atoi(argv[1]);
+  if (argc > 2)
+    decimals = atoi(argv[2]);
+  if (decimals > NUM_FLOAT_DECIMALS)
+  {
+    fprintf(stderr, "Usage: %s [random_values [decimals(0-%d)]]\n",
+            argv[0], NUM_FLOAT_DECIMALS);
+    return 1;
+  }
+
+  /* Sensor-like values, steps of 1/1024 and of 0.001 around zero. */
+  for (i = 0; i <= 200000; ++i)
+  {
+    check((float)((int32_t)i - 100000) / 1024.0f);
+    check((float)((int32_t)i - 100000) * 0.001f);
+  }
+  /* Powers of ten and their neighbours, where rounding carries. */
+  for (f = 1e-12f; f < 1e38f; f *= 10.0f)
+  {
+    check(f);
+    check(-f);
+    check(nextafterf(f, 0.0f));
+    check(nextafterf(f, INFINITY));
+    check(f * 0.9999999f);
+    check(f * 9.9999995f);
+  }
+  check(0.0f);
+  check(-0.0f);
+  check(1.0f / 0.0f);
+  check(-1.0f / 0.0f);
+  check(0.0f / 0.0f);
+  srand(1);
+  for (i = 0; i < n; ++i)
+    check(random_float());
+  printf("checked %u values with %u decimals: %u format, %u parse "
+         "mismatches\n", checked, decimals, format_errors, parse_errors);
+  printf("        beyond the exact range: %u format, %u parse one off\n",
+         format_near, parse_near);
+
+  for (i = 0; i < n; ++i)
+    check_fixed(((int32_t)rand() << 1) ^ rand(), i % (NUM_MAX_DECIMALS + 1));
+  for (i = 0; i <= NUM_MAX_DECIMALS; ++i)
+  {
+    check_fixed(0, i);
+    check_fixed(-1, i);
+    check_fixed(INT32_MAX, i);
+    check_fixed(INT32_MIN, i);
+  }
+  printf("checked %u fixed-point values: %u mismatches\n", n + 40,
+         fixed_errors);
+
+  for (i = 0; i < TIME_VALUES; ++i)
+  {
+    values[i] = (float)(rand() % 200000 - 100000) / 1000.0f;
+    reference_format(values[i], texts[i]);
+  }
+  printf("format: num_format %.1f ns, snprintf %.1f ns\n",
+         TIME_LOOP(rounds,
+                   sink += num_format(values[i], decimals, buf, MAX_TEXT)),
+         TIME_LOOP(rounds,
+                   sink += snprintf(buf, sizeof(buf), "%.*f", decimals,
+                                    (double)values[i])));
+  printf("parse:  num_parse %.1f ns, strtof %.1f ns, atof %.1f ns\n",
+         TIME_LOOP(rounds, sink += (uint32_t)num_parse(texts[i])),
+         TIME_LOOP(rounds, sink += (uint32_t)strtof(texts[i], NULL)),
+         TIME_LOOP(rounds, sink += (uint32_t)atof(texts[i])));
+
+  return format_errors || parse_errors || fixed_errors ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+/*
+  Host stand-ins for <avr/pgmspace.h>. There is only one address space on the
+  host, so flash-resident data is just ordinary const data.
+*/
+
+#ifndef LABIBUS_HOST_PGMSPACE_H
+#define LABIBUS_HOST_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+
+#endif  /* LABIBUS_HOST_PGMSPACE_H */
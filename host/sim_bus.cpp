@@ -0,0 +1,895 @@
+/*
+  Discrete-event simulation of an RS485 bus with Labibus nodes.
+
+  Each node runs in its own thread, but only one thread (a node, or the
+  scheduler in sim_run()) runs at any time; control is handed over with a
+  semaphore per node. A node runs until it has to wait for the hardware
+  (sim_wait()), which hands control back to the scheduler. The scheduler then
+  advances virtual time to the next event (a character leaving a
+  transmitter, a timer compare match or wrap, or a delay expiring), applies
+  it, and resumes the nodes that it concerns.
+
+  Interrupts are level triggered as on the AVR: while a node waits with its
+  interrupt flag set and an interrupt source pending, the vector is called
+  (in the node's own thread) with the interrupt flag cleared.
+*/
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <queue>
+#include <vector>
+
+#include "sim_bus.h"
+#include "sim_hal.h"
+#include "master.h"
+#include "capture.h"
+
+
+/* Interrupt vectors, defined by the firmware with ISR(). */
+extern void sim_isr_serial_rx(void) __attribute__((weak));
+extern void sim_isr_serial_udre(void) __attribute__((weak));
+extern void sim_isr_serial_tx(void) __attribute__((weak));
+extern void sim_isr_bus_timer_compa(void) __attribute__((weak));
+extern void sim_isr_bus_timer_ovf(void) __attribute__((weak));
+
+
+#define AVR_RX_FIFO 2
+#define HOST_RX_FIFO 4096
+#define NODE_STACK_SIZE (256*1024)
+/* The bus timer runs at F_CPU/8. */
+#define TIMER_TICK_NS (8000000000ULL/F_CPU)
+
+enum sim_event_type { EV_SHIFT_DONE, EV_TIMER_COMPARE, EV_TIMER_OVERFLOW };
+
+struct sim_rx_char {
+  uint8_t c;
+  uint8_t errors;
+  uint64_t stamp;
+};
+
+struct sim_node {
+  const char *name;
+  enum sim_node_kind kind;
+  sim_node_fn fn;
+  void *arg;
+
+  /* Scheduling. */
+  pthread_t thread;
+  sem_t run;
+  uint8_t waiting;
+  uint8_t kicked;
+  uint8_t done;
+  uint64_t wake_at;
+
+  /* CPU global interrupt flag. */
+  uint8_t irq_on;
+
+  /* RS485 transceiver pins. RE is active low. */
+  uint8_t de, re;
+
+  /* UART. */
+  uint8_t rxen, txen, rxcie, udrie, txcie;
+  struct sim_rx_char *rx_fifo;
+  uint16_t rx_depth, rx_head, rx_count;
+  uint8_t udr, udr_full;
+  uint8_t shift, shifting, shift_driven, shift_corrupt;
+  uint8_t txc;
+
+  /* Bus timer compare unit. */
+  uint16_t ocr;
+  uint8_t ocie, ocf;
+  uint32_t ocr_gen;
+  /* Bus timer overflow. */
+  uint8_t toie, tov;
+};
+
+struct sim_event {
+  uint64_t time;
+  uint64_t seq;
+  struct sim_node *node;
+  enum sim_event_type type;
+  /* For timer events, the ocr_gen at scheduling; stale if it changed. */
+  uint32_t gen;
+
+  bool operator<(const sim_event &o) const
+  {
+    /* Earliest first, and in order of scheduling for equal times. */
+    if (time != o.time)
+      return time > o.time;
+    return seq > o.seq;
+  }
+};
+
+struct sim_exit {};
+
+static std::vector<struct sim_node *> nodes;
+static std::priority_queue<struct sim_event> events;
+static uint64_t event_seq;
+static uint64_t now;
+static uint64_t char_time;
+static sem_t sched_sem;
+static bool shutting_down;
+static struct sim_wire_stats wire_stats;
+/* Line noise: chars hit per million, and the state of its generator. */
+static uint32_t noise_ppm;
+static uint32_t noise_seed = 1;
+
+static thread_local struct sim_node *cur;
+
+
+void
+sim_init(uint32_t baud)
+{
+  /* 8N1: start bit, 8 data bits, stop bit. */
+  char_time = (10ULL*1000000000ULL + baud/2) / baud;
+  now = 0;
+  sem_init(&sched_sem, 0, 0);
+}
+
+
+void
+sim_set_noise(uint32_t per_million)
+{
+  noise_ppm = per_million;
+}
+
+
+uint64_t
+sim_now(void)
+{
+  return now;
+}
+
+
+uint64_t
+sim_char_time(void)
+{
+  return char_time;
+}
+
+
+const char *
+sim_node_name(void)
+{
+  return cur ? cur->name : "main";
+}
+
+
+void
+sim_get_wire_stats(struct sim_wire_stats *stats)
+{
+  *stats = wire_stats;
+}
+
+
+static struct sim_node *
+current_node(void)
+{
+  if (!cur)
+  {
+    fprintf(stderr, "sim: hardware access from outside a node\n");
+    abort();
+  }
+  return cur;
+}
+
+
+/* Scheduler side: let node n run until it waits again. */
+static void
+node_switch(struct sim_node *n)
+{
+  sem_post(&n->run);
+  sem_wait(&sched_sem);
+}
+
+
+/* Node side: hand control back to the scheduler until resumed. */
+static void
+node_yield(struct sim_node *n)
+{
+  n->waiting = 1;
+  sem_post(&sched_sem);
+  sem_wait(&n->run);
+  n->waiting = 0;
+  if (shutting_down)
+    throw sim_exit();
+}
+
+
+/* The highest priority pending interrupt vector, if any. */
+static void (*irq_pending(struct sim_node *n))(void)
+{
+  if (n->rxcie && n->rx_count > 0 && sim_isr_serial_rx)
+    return sim_isr_serial_rx;
+  if (n->udrie && !n->udr_full && sim_isr_serial_udre)
+    return sim_isr_serial_udre;
+  if (n->txcie && n->txc && sim_isr_serial_tx)
+    return sim_isr_serial_tx;
+  if (n->ocie && n->ocf && sim_isr_bus_timer_compa)
+    return sim_isr_bus_timer_compa;
+  if (n->toie && n->tov && sim_isr_bus_timer_ovf)
+    return sim_isr_bus_timer_ovf;
+  return NULL;
+}
+
+
+static void
+service_irqs(struct sim_node *n)
+{
+  void (*vector)(void);
+
+  while (n->irq_on && (vector = irq_pending(n)))
+  {
+    n->irq_on = 0;
+    /* Executing the TXC and timer vectors clears their flags. */
+    if (vector == sim_isr_serial_tx)
+      n->txc = 0;
+    else if (vector == sim_isr_bus_timer_compa)
+      n->ocf = 0;
+    else if (vector == sim_isr_bus_timer_ovf)
+      n->tov = 0;
+    vector();
+    /* reti */
+    n->irq_on = 1;
+  }
+}
+
+
+/*
+  Let virtual time pass for the current node until `until`, servicing
+  interrupts meanwhile. With on_event, return early as soon as anything
+  happens on the node (an interrupt, or a change in UART state), so the
+  caller can re-check the condition it is waiting for.
+*/
+static void
+sim_wait(uint64_t until, bool on_event)
+{
+  struct sim_node *n = current_node();
+
+  for (;;)
+  {
+    if (n->irq_on && irq_pending(n))
+    {
+      service_irqs(n);
+      if (on_event)
+        return;
+    }
+    if (now >= until)
+      return;
+    n->wake_at = until;
+    n->kicked = 0;
+    node_yield(n);
+    if (on_event && n->kicked && !(n->irq_on && irq_pending(n)))
+      return;
+  }
+}
+
+
+static void
+schedule(struct sim_node *n, uint64_t time, enum sim_event_type type)
+{
+  struct sim_event ev;
+
+  ev.time = time;
+  ev.seq = event_seq++;
+  ev.node = n;
+  ev.type = type;
+  ev.gen = n->ocr_gen;
+  events.push(ev);
+}
+
+
+/* Schedule the next time the bus timer of node n matches its OCR. */
+static void
+schedule_compare(struct sim_node *n)
+{
+  uint64_t tick = now / TIMER_TICK_NS;
+  uint16_t delta = n->ocr - (uint16_t)tick;
+
+  /* A match with the current count only comes around after a wrap. */
+  schedule(n, (tick + (delta ? delta : 0x10000)) * TIMER_TICK_NS,
+           EV_TIMER_COMPARE);
+}
+
+
+/* Schedule the next wrap of the bus timer of node n. */
+static void
+schedule_overflow(struct sim_node *n)
+{
+  uint64_t tick = now / TIMER_TICK_NS;
+
+  schedule(n, ((tick | 0xffff) + 1) * TIMER_TICK_NS, EV_TIMER_OVERFLOW);
+}
+
+
+static void
+start_shift(struct sim_node *n, uint8_t c)
+{
+  n->shift = c;
+  n->shifting = 1;
+  n->shift_corrupt = 0;
+  n->shift_driven = n->de;
+  if (n->shift_driven)
+  {
+    /* Two drivers on at the same time garble each other. */
+    for (struct sim_node *m : nodes)
+    {
+      if (m == n || !m->shifting || !m->shift_driven)
+        continue;
+      if (!m->shift_corrupt || !n->shift_corrupt)
+        ++wire_stats.collisions;
+      m->shift_corrupt = n->shift_corrupt = 1;
+      m->shift &= c;
+      n->shift &= m->shift;
+    }
+  }
+  schedule(n, now + char_time, EV_SHIFT_DONE);
+}
+
+
+static void
+deliver(struct sim_node *r, uint8_t c, uint8_t errors)
+{
+  struct sim_rx_char *e;
+
+  if (r->rx_count >= r->rx_depth)
+  {
+    /* Overrun: the new character is lost, flagged on the one before. */
+    r->rx_fifo[(r->rx_head + r->rx_count - 1) % r->rx_depth].errors |= SIM_DOR;
+    ++wire_stats.overruns;
+  }
+  else
+  {
+    e = &r->rx_fifo[(r->rx_head + r->rx_count) % r->rx_depth];
+    e->c = c;
+    e->errors = errors;
+    e->stamp = now - char_time;
+    ++r->rx_count;
+  }
+  r->kicked = 1;
+}
+
+
+static uint32_t
+noise_rand(void)
+{
+  noise_seed = noise_seed * 1103515245 + 12345;
+  return noise_seed >> 8;
+}
+
+
+/*
+  Deliver a char to receiver r through the line noise, which flips one of
+  its 10 bits now and then: a data bit goes unnoticed by the UART, a start or
+  stop bit gives a framing error.
+*/
+static void
+deliver_noisy(struct sim_node *r, uint8_t c, uint8_t errors)
+{
+  uint8_t bit;
+
+  if (noise_ppm && noise_rand() % 1000000 < noise_ppm)
+  {
+    ++wire_stats.noise;
+    bit = noise_rand() % 10;
+    if (bit >= 1 && bit <= 8)
+      c ^= 1 << (bit - 1);
+    else
+    {
+      c = noise_rand();
+      errors |= SIM_FE;
+    }
+  }
+  deliver(r, c, errors);
+}
+
+
+/* The character in the shift register of node n has left the wire. */
+static void
+shift_done(struct sim_node *n)
+{
+  n->shifting = 0;
+  if (n->shift_driven)
+  {
+    ++wire_stats.chars;
+    for (struct sim_node *r : nodes)
+    {
+      if (r->rxen && !r->re)
+        deliver_noisy(r, n->shift, n->shift_corrupt ? SIM_FE : 0);
+    }
+  }
+  if (n->udr_full)
+  {
+    n->udr_full = 0;
+    start_shift(n, n->udr);
+  }
+  else
+    n->txc = 1;
+  n->kicked = 1;
+}
+
+
+static void *
+node_main(void *arg)
+{
+  struct sim_node *n = (struct sim_node *)arg;
+
+  cur = n;
+  sem_wait(&n->run);
+  try
+  {
+    if (!shutting_down)
+    {
+      n->fn(n->arg);
+      /* Keep servicing interrupts after the program ends. */
+      sim_wait(SIM_NEVER, false);
+    }
+  }
+  catch (sim_exit &)
+  {
+  }
+  n->done = 1;
+  sem_post(&sched_sem);
+  return NULL;
+}
+
+
+struct sim_node *
+sim_add_node(const char *name, enum sim_node_kind kind,
+             sim_node_fn fn, void *arg)
+{
+  struct sim_node *n = (struct sim_node *)calloc(1, sizeof(*n));
+  pthread_attr_t attr;
+
+  n->name = name;
+  n->kind = kind;
+  n->fn = fn;
+  n->arg = arg;
+  n->rx_depth = kind == SIM_NODE_AVR ? AVR_RX_FIFO : HOST_RX_FIFO;
+  n->rx_fifo = (struct sim_rx_char *)calloc(n->rx_depth, sizeof(*n->rx_fifo));
+  n->irq_on = kind == SIM_NODE_HOST;
+  /* Pins float high until configured, so the receiver is off. */
+  n->re = 1;
+  n->txc = 0;
+  /* Start the node on the next scheduler round. */
+  n->waiting = 1;
+  n->kicked = 1;
+  if (kind == SIM_NODE_HOST)
+  {
+    /* An RS485 adapter is ready to use. */
+    n->re = 0;
+    n->rxen = n->txen = 1;
+  }
+  sem_init(&n->run, 0, 0);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, NODE_STACK_SIZE);
+  if (pthread_create(&n->thread, &attr, node_main, n))
+  {
+    perror("sim: pthread_create");
+    exit(1);
+  }
+  pthread_attr_destroy(&attr);
+  nodes.push_back(n);
+  return n;
+}
+
+
+void
+sim_run(uint64_t until)
+{
+  for (;;)
+  {
+    bool ran;
+    uint64_t next;
+
+    /* Run everything that can make progress at the current time. */
+    do
+    {
+      ran = false;
+      for (struct sim_node *n : nodes)
+      {
+        if (n->done || !n->waiting || (!n->kicked && n->wake_at > now))
+          continue;
+        node_switch(n);
+        ran = true;
+      }
+    } while (ran);
+
+    next = events.empty() ? SIM_NEVER : events.top().time;
+    for (struct sim_node *n : nodes)
+      if (!n->done && n->wake_at < next)
+        next = n->wake_at;
+    if (next > until)
+    {
+      if (until != SIM_NEVER)
+        now = until;
+      return;
+    }
+    now = next;
+    while (!events.empty() && events.top().time == now)
+    {
+      struct sim_event ev = events.top();
+      struct sim_node *n = ev.node;
+
+      events.pop();
+      if (ev.type == EV_SHIFT_DONE)
+        shift_done(n);
+      else if (ev.type == EV_TIMER_OVERFLOW)
+      {
+        n->tov = 1;
+        n->kicked = 1;
+        schedule_overflow(n);
+      }
+      else if (ev.gen == n->ocr_gen)
+      {
+        /* The counter wraps, so the match repeats every 65536 ticks. */
+        n->ocf = 1;
+        n->kicked = 1;
+        schedule_compare(n);
+      }
+    }
+  }
+}
+
+
+void
+sim_shutdown(void)
+{
+  shutting_down = true;
+  for (struct sim_node *n : nodes)
+  {
+    if (!n->done)
+      node_switch(n);
+    pthread_join(n->thread, NULL);
+  }
+}
+
+
+/* Interrupt flag. */
+
+uint8_t
+sim_irq_save(void)
+{
+  return current_node()->irq_on;
+}
+
+
+void
+sim_irq_restore(uint8_t sreg)
+{
+  if (sreg)
+    sim_sei();
+  else
+    sim_cli();
+}
+
+
+void
+sim_cli(void)
+{
+  current_node()->irq_on = 0;
+}
+
+
+void
+sim_sei(void)
+{
+  struct sim_node *n = current_node();
+
+  n->irq_on = 1;
+  service_irqs(n);
+}
+
+
+void
+sim_delay_ns(uint64_t ns)
+{
+  sim_wait(now + ns, false);
+}
+
+
+void
+cpu_relax(void)
+{
+  sim_wait(SIM_NEVER, true);
+}
+
+
+/* Pins. */
+
+void
+setup_rs485_pins(void)
+{
+}
+
+
+void
+rs485_receive_mode(void)
+{
+  struct sim_node *n = current_node();
+
+  n->de = 0;
+  n->re = 0;
+}
+
+
+void
+rs485_transmit_mode(void)
+{
+  struct sim_node *n = current_node();
+
+  n->re = 1;
+  n->de = 1;
+}
+
+
+/* UART. */
+
+void
+setup_serial(void)
+{
+  struct sim_node *n = current_node();
+
+  n->txen = 1;
+  n->rxen = 1;
+  n->rxcie = 1;
+}
+
+
+void
+serial_interrupt_rx_enable(void)
+{
+  current_node()->rxcie = 1;
+}
+
+
+void
+serial_interrupt_rx_disable(void)
+{
+  current_node()->rxcie = 0;
+}
+
+
+void
+serial_interrupt_udre_enable(void)
+{
+  current_node()->udrie = 1;
+}
+
+
+void
+serial_interrupt_udre_disable(void)
+{
+  current_node()->udrie = 0;
+}
+
+
+void
+serial_interrupt_txc_enable(void)
+{
+  current_node()->txcie = 1;
+}
+
+
+void
+serial_interrupt_txc_disable(void)
+{
+  current_node()->txcie = 0;
+}
+
+
+/* Busy-wait on UDRE, as for a polled transmitter. */
+static uint8_t
+serial_writeable(void)
+{
+  struct sim_node *n = current_node();
+
+  if (n->udr_full)
+    sim_wait(SIM_NEVER, true);
+  return !n->udr_full;
+}
+
+
+void
+serial_write(uint8_t c)
+{
+  struct sim_node *n = current_node();
+
+  if (!n->txen)
+    return;
+  if (!n->shifting)
+    start_shift(n, c);
+  else
+  {
+    n->udr = c;
+    n->udr_full = 1;
+  }
+}
+
+
+uint8_t
+serial_read(void)
+{
+  struct sim_node *n = current_node();
+  uint8_t c;
+
+  if (!n->rx_count)
+    return 0;
+  c = n->rx_fifo[n->rx_head].c;
+  n->rx_head = (n->rx_head + 1) % n->rx_depth;
+  --n->rx_count;
+  return c;
+}
+
+
+uint8_t
+serial_read_errors(void)
+{
+  struct sim_node *n = current_node();
+
+  return n->rx_count ? n->rx_fifo[n->rx_head].errors : 0;
+}
+
+
+void
+serial_clear_tx_complete(void)
+{
+  current_node()->txc = 0;
+}
+
+
+static void
+serial_wait_for_tx_complete(void)
+{
+  struct sim_node *n = current_node();
+
+  while (!n->txc)
+    sim_wait(SIM_NEVER, true);
+}
+
+
+/* Bus timer. */
+
+void
+setup_bus_timer(void)
+{
+  struct sim_node *n = current_node();
+
+  n->ocie = 0;
+  if (!n->toie)
+  {
+    n->toie = 1;
+    schedule_overflow(n);
+  }
+}
+
+
+uint16_t
+bus_timer_now(void)
+{
+  return (uint16_t)(now / TIMER_TICK_NS);
+}
+
+
+uint8_t
+bus_timer_overflow_pending(void)
+{
+  return current_node()->tov;
+}
+
+
+void
+bus_timer_alarm(uint16_t at)
+{
+  struct sim_node *n = current_node();
+
+  n->ocr = at;
+  n->ocf = 0;
+  n->ocie = 1;
+  ++n->ocr_gen;
+  schedule_compare(n);
+}
+
+
+void
+bus_timer_alarm_cancel(void)
+{
+  struct sim_node *n = current_node();
+
+  n->ocie = 0;
+  ++n->ocr_gen;
+}
+
+
+/* Host port. */
+
+void
+sim_port_write(const uint8_t *buf, uint16_t len)
+{
+  uint16_t i;
+
+  rs485_transmit_mode();
+  for (i = 0; i < len; ++i)
+  {
+    while (!serial_writeable())
+      ;
+    serial_write(buf[i]);
+    serial_clear_tx_complete();
+  }
+  serial_wait_for_tx_complete();
+  rs485_receive_mode();
+}
+
+
+int
+sim_port_read(uint64_t deadline, uint64_t *stamp, uint8_t *errors)
+{
+  struct sim_node *n = current_node();
+  struct sim_rx_char *e;
+
+  while (!n->rx_count)
+  {
+    if (now >= deadline)
+      return -1;
+    sim_wait(deadline, true);
+  }
+  e = &n->rx_fifo[n->rx_head];
+  if (stamp)
+    *stamp = e->stamp;
+  if (errors)
+    *errors = e->errors;
+  return serial_read();
+}
+
+
+static uint64_t
+master_port_now(void *)
+{
+  return now;
+}
+
+
+static void
+master_port_write(void *, const uint8_t *buf, uint16_t len)
+{
+  sim_port_write(buf, len);
+}
+
+
+static int
+master_port_read(void *, uint64_t deadline, uint64_t *stamp)
+{
+  return sim_port_read(deadline, stamp, NULL);
+}
+
+
+static void
+master_port_sleep_until(void *, uint64_t t)
+{
+  if (t > now)
+    sim_delay_ns(t - now);
+}
+
+
+const struct master_port sim_master_port = {
+  NULL, master_port_now, master_port_write, master_port_read,
+  master_port_sleep_until
+};
+
+
+void
+sim_capture_node(void *arg)
+{
+  struct capture_framer *f = (struct capture_framer *)arg;
+  uint64_t stamp;
+  uint8_t errors;
+  int c;
+
+  while ((c = sim_port_read(SIM_NEVER, &stamp, &errors)) >= 0)
+    capture_feed(f, c, errors, stamp / 1000);
+}
@@ -0,0 +1,99 @@
+/*
+  Simulated multi-drop RS485 bus for running Labibus on a Linux host.
+
+  Any number of nodes share one virtual wire. Each node has an AVR-like
+  UART, RS485 driver/receiver enable pins, and a global interrupt flag, and
+  runs its program in its own thread against the host HAL (sim_hal.h).
+  Characters take their real time on the wire at the configured baud rate
+  (8N1, 10 bits per character), overlapping transmissions from two drivers
+  are delivered as garbage with a framing error, and a receiver that does not
+  keep up loses characters with a data overrun, just like on hardware.
+
+  There are two kinds of nodes:
+
+    SIM_NODE_AVR   runs firmware, ie. the Labibus library. It has the two
+                   character receive FIFO of the AVR USART, and receives with
+                   the serial interrupt.
+
+    SIM_NODE_HOST  models a PC with an RS485 adapter (eg. the master). It
+                   uses the sim_port_*() functions below, and has a large
+                   receive buffer.
+
+  Virtual time is counted in nanoseconds from sim_init(). The simulation only
+  advances inside sim_run(), which must be called from the main thread (not
+  from a node).
+*/
+
+#ifndef LABIBUS_SIM_BUS_H
+#define LABIBUS_SIM_BUS_H
+
+#include <stdint.h>
+
+
+#define SIM_NEVER (~(uint64_t)0)
+
+/* Receive error flags, same bits as in the AVR UCSRnA register. */
+#define SIM_FE  0x10
+#define SIM_DOR 0x08
+#define SIM_UPE 0x04
+
+enum sim_node_kind { SIM_NODE_AVR, SIM_NODE_HOST };
+
+struct sim_node;
+typedef void (*sim_node_fn)(void *arg);
+
+struct sim_wire_stats {
+  uint32_t chars;
+  uint32_t collisions;
+  uint32_t overruns;
+  uint32_t noise;
+};
+
+
+extern void sim_init(uint32_t baud);
+/*
+  Add line noise: each char is garbled at each receiver with a probability
+  of per_million in a million, with a framing error if a start or stop bit
+  is hit.
+*/
+extern void sim_set_noise(uint32_t per_million);
+extern struct sim_node *sim_add_node(const char *name, enum sim_node_kind kind,
+                                     sim_node_fn fn, void *arg);
+extern void sim_run(uint64_t until);
+extern void sim_shutdown(void);
+extern void sim_get_wire_stats(struct sim_wire_stats *stats);
+
+/* These may be called from any node, and from the main thread. */
+extern uint64_t sim_now(void);
+extern uint64_t sim_char_time(void);
+extern const char *sim_node_name(void);
+
+/*
+  Port access for SIM_NODE_HOST nodes.
+
+  sim_port_write() enables the driver, sends the bytes, and returns when the
+  last stop bit has left the wire (with the driver disabled again).
+
+  sim_delay_ns() lets time pass for the calling node.
+
+  sim_port_read() returns the next received byte, or -1 if none arrives
+  before the deadline (an absolute virtual time). If stamp is non-NULL, it is
+  set to the time the byte's start bit appeared on the wire; if errors is
+  non-NULL, it receives the SIM_FE/SIM_DOR flags of the byte.
+*/
+extern void sim_port_write(const uint8_t *buf, uint16_t len);
+extern void sim_delay_ns(uint64_t ns);
+extern int sim_port_read(uint64_t deadline, uint64_t *stamp, uint8_t *errors);
+
+/* The host port as a master port (see master.h), for SIM_NODE_HOST nodes. */
+struct master_port;
+extern const struct master_port sim_master_port;
+
+/*
+  A SIM_NODE_HOST node that records all that goes over the wire, with the
+  framer of a capture (capture.h) given as arg, set up with capture_init().
+  Call capture_flush() on it once the simulation is over.
+*/
+extern void sim_capture_node(void *arg);
+
+#endif  /* LABIBUS_SIM_BUS_H */
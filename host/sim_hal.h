@@ -0,0 +1,143 @@
+/*
+  Host implementation of the Labibus hardware abstraction (Labibus_hal.h).
+
+  Every simulated node runs the library in its own thread, with its own copy
+  of the library state (NODE_LOCAL). The functions declared here act on the
+  UART, pins and interrupt flag of the node of the calling thread; they are
+  implemented in sim_bus.cpp.
+
+  Only one node runs at a time, and virtual time stands still while it does.
+  Time advances (and interrupts are delivered) only inside the calls that
+  would wait on real hardware: delays, polling of UART status flags,
+  cpu_relax(), and sei().
+*/
+
+#ifndef LABIBUS_SIM_HAL_H
+#define LABIBUS_SIM_HAL_H
+
+#include <stdint.h>
+
+#include "pgmspace.h"
+
+
+#define NODE_LOCAL thread_local
+
+/* Interrupt vectors are plain functions, called by the simulator. */
+#define ISR(vector) void vector(void)
+#define SERIAL_RX_vect sim_isr_serial_rx
+#define SERIAL_UDRE_vect sim_isr_serial_udre
+#define SERIAL_TX_vect sim_isr_serial_tx
+#define BUS_TIMER_COMPA_vect sim_isr_bus_timer_compa
+#define BUS_TIMER_OVF_vect sim_isr_bus_timer_ovf
+
+/* The simulated CPU clock, which drives the bus timer. */
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+#define BUS_TIMER_TICKS_PER_MS (F_CPU/8/1000)
+
+
+/* Interrupt masking, modelled on the AVR global interrupt flag. */
+extern uint8_t sim_irq_save(void);
+extern void sim_irq_restore(uint8_t sreg);
+extern void sim_cli(void);
+extern void sim_sei(void);
+
+#define cli() sim_cli()
+#define sei() sim_sei()
+
+static inline uint8_t
+sim_cli_ret(void)
+{
+  sim_cli();
+  return 1;
+}
+
+static inline uint8_t
+sim_sei_ret(void)
+{
+  sim_sei();
+  return 1;
+}
+
+static inline void
+sim_restore_param(const uint8_t *sreg)
+{
+  sim_irq_restore(*sreg);
+}
+
+static inline void
+sim_sei_param(const uint8_t *)
+{
+  sim_sei();
+}
+
+static inline void
+sim_cli_param(const uint8_t *)
+{
+  sim_cli();
+}
+
+/* Same semantics as the <util/atomic.h> macros. */
+#define ATOMIC_BLOCK(type) \
+  for (type, sim_todo = sim_cli_ret(); sim_todo; sim_todo = 0)
+#define NONATOMIC_BLOCK(type) \
+  for (type, sim_todo = sim_sei_ret(); sim_todo; sim_todo = 0)
+#define ATOMIC_RESTORESTATE \
+  uint8_t sim_sreg_save __attribute__((__cleanup__(sim_restore_param))) = \
+    sim_irq_save()
+#define ATOMIC_FORCEON \
+  uint8_t sim_sreg_save __attribute__((__cleanup__(sim_sei_param))) = 0
+#define NONATOMIC_RESTORESTATE ATOMIC_RESTORESTATE
+#define NONATOMIC_FORCEOFF \
+  uint8_t sim_sreg_save __attribute__((__cleanup__(sim_cli_param))) = 0
+
+
+/* Busy-wait delays advance virtual time. */
+extern void sim_delay_ns(uint64_t ns);
+
+static inline void
+_delay_us(double us)
+{
+  sim_delay_ns((uint64_t)(us * 1e3));
+}
+
+static inline void
+_delay_ms(double ms)
+{
+  sim_delay_ns((uint64_t)(ms * 1e6));
+}
+
+/* Waits for the next event (interrupt or UART state change) on this node. */
+extern void cpu_relax(void);
+
+
+extern void setup_rs485_pins(void);
+extern void rs485_receive_mode(void);
+extern void rs485_transmit_mode(void);
+extern void setup_serial(void);
+extern void serial_interrupt_rx_enable(void);
+extern void serial_interrupt_rx_disable(void);
+extern void serial_interrupt_udre_enable(void);
+extern void serial_interrupt_udre_disable(void);
+extern void serial_interrupt_txc_enable(void);
+extern void serial_interrupt_txc_disable(void);
+extern void serial_write(uint8_t c);
+extern uint8_t serial_read(void);
+extern uint8_t serial_read_errors(void);
+/* Receive error flags, the AVR UCSRnA bits (SIM_FE etc. in sim_bus.h). */
+#define SERIAL_FE 0x10
+#define SERIAL_DOR 0x08
+#define SERIAL_UPE 0x04
+extern void serial_clear_tx_complete(void);
+/* Time of one char on the wire, at the baud rate of the simulated bus. */
+extern uint64_t sim_char_time(void);
+#define SERIAL_CHAR_US ((uint32_t)((sim_char_time() + 999) / 1000))
+
+extern void setup_bus_timer(void);
+extern uint16_t bus_timer_now(void);
+extern uint8_t bus_timer_overflow_pending(void);
+extern void bus_timer_alarm(uint16_t at);
+extern void bus_timer_alarm_cancel(void);
+
+#endif  /* LABIBUS_SIM_HAL_H */
@@ -0,0 +1,340 @@
+/*
+  Benchmark of the master time-series store (master_store.h).
+
+  Appends a record every second of (made up) time to the stores of a number
+  of devices, and times that against printing the same values to a text log
+  as labibus_master does without a store. Then queries the last part of
+  each store, and times reading the values in place against parsing them
+  from the log.
+
+  Last, a reader thread queries random ranges of a small store, through a
+  mapping of its own, while the writer wraps it over and over, and checks
+  every value of the ranges that store_intact() says were not overwritten.
+  Torn records would show up as errors.
+
+  The stores go in a temporary directory, which is removed afterwards.
+
+  Usage: store_bench [devices [records [capacity [query_records]]]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "master.h"
+#include "master_store.h"
+
+
+#define BASE_TIME 1700000000000000000ULL
+#define SECOND 1000000000ULL
+/* Capacity of the store wrapped by the writer while the reader queries. */
+#define RACE_CAPACITY 1024
+#define RACE_RECORDS 20000000ULL
+
+static uint16_t num_devices = 300;
+static uint32_t num_records = 7200;
+static uint32_t capacity = 3600;
+static uint32_t query_records = 600;
+
+static char dir[] = "/tmp/store_bench.XXXXXX";
+static struct master_device *devices;
+
+static struct {
+  struct store writer, reader;
+  volatile bool done;
+  uint64_t queries, intact, records, errors;
+} race;
+
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* The value of a channel of a device at record i, exact in a float. */
+static float
+value(uint16_t dev, uint8_t c, uint64_t i)
+{
+  return (float)((dev * 7 + i + c * 50) % 1000000) / 8;
+}
+
+
+static void
+make_devices(void)
+{
+  struct master_device *d;
+  uint16_t i;
+
+  devices = (struct master_device *)calloc(num_devices, sizeof(*devices));
+  for (i = 0; i < num_devices; ++i)
+  {
+    d = &devices[i];
+    d->id = i % 127 + 1;
+    d->channels = i % 4 == 0 ? 2 : 1;
+    snprintf(d->description[0], sizeof(d->description[0]),
+             "Temperature %u", i);
+    strcpy(d->unit[0], "degree C");
+    snprintf(d->description[1], sizeof(d->description[1]), "Humidity %u", i);
+    strcpy(d->unit[1], "%rel");
+  }
+}
+
+
+static void
+bench_append(struct store *stores, FILE *log)
+{
+  uint64_t t, store_ns = 0, log_ns = 0, n = 0;
+  uint32_t i;
+  uint16_t dev;
+  uint8_t c;
+
+  for (i = 0; i < num_records; ++i)
+  {
+    for (dev = 0; dev < num_devices; ++dev)
+      for (c = 0; c < devices[dev].channels; ++c)
+        devices[dev].values[c] = value(dev, c, i);
+
+    t = now_ns();
+    for (dev = 0; dev < num_devices; ++dev)
+      store_append(&stores[dev], BASE_TIME + i * SECOND, devices[dev].values);
+    store_ns += now_ns() - t;
+
+    t = now_ns();
+    for (dev = 0; dev < num_devices; ++dev)
+      for (c = 0; c < devices[dev].channels; ++c)
+        fprintf(log, "%.3f %u %u %g %s %s\n", i + 0.0, devices[dev].id, c,
+                devices[dev].values[c], devices[dev].unit[c],
+                devices[dev].description[c]);
+    log_ns += now_ns() - t;
+    n += num_devices;
+  }
+  t = now_ns();
+  fflush(log);
+  log_ns += now_ns() - t;
+
+  printf("append:     %u records each of %u devices, store %.1f ns, "
+         "text log %.1f ns per record\n", num_records, num_devices,
+         (double)store_ns / n, (double)log_ns / n);
+}
+
+
+static void
+bench_query(const char *log_path)
+{
+  struct store_range r;
+  struct store s;
+  char path[4096], line[512], *p;
+  uint64_t t, from, store_ns, log_ns, n = 0, lines = 0, errors = 0;
+  double sum = 0, log_sum = 0, expected = 0, secs;
+  unsigned id, c;
+  uint16_t dev;
+  uint32_t i;
+  uint8_t k;
+  FILE *log;
+
+  /* The last query_records seconds of each store, by readers of their own,
+     as a dashboard would. */
+  from = BASE_TIME + (uint64_t)(num_records - query_records) * SECOND;
+  t = now_ns();
+  for (dev = 0; dev < num_devices; ++dev)
+  {
+    store_path(path, sizeof(path), dir, &devices[dev], false);
+    if (store_open_reader(&s, path) < 0)
+    {
+      perror(path);
+      exit(1);
+    }
+    store_query(&s, from, ~(uint64_t)0, &r);
+    for (k = 0; k < r.spans; ++k)
+      for (i = 0; i < r.len[k]; ++i)
+        sum += r.values[k][0][i];
+    n += r.end - r.first;
+    if (!store_intact(&s, &r))
+      ++errors;
+    store_close(&s);
+  }
+  store_ns = now_ns() - t;
+
+  /* The same from the text log, which has to be read through. */
+  t = now_ns();
+  log = fopen(log_path, "r");
+  while (log && fgets(line, sizeof(line), log))
+  {
+    ++lines;
+    secs = strtod(line, &p);
+    id = strtoul(p, &p, 10);
+    c = strtoul(p, &p, 10);
+    if (secs >= num_records - query_records && c == 0)
+      log_sum += strtof(p, &p);
+    (void)id;
+  }
+  if (log)
+    fclose(log);
+  log_ns = now_ns() - t;
+
+  for (dev = 0; dev < num_devices; ++dev)
+    for (i = num_records - query_records; i < num_records; ++i)
+      expected += value(dev, 0, i);
+  /* The log has the values to 6 digits, as labibus_master prints them. */
+  printf("query:      last %u s of each device, %lu records, store %.1f ns "
+         "per record (%.1f us per query), text log %.1f ns per record "
+         "(%lu lines parsed), store %s, log off by %.3g\n", query_records,
+         (unsigned long)n, (double)store_ns / n, store_ns / 1e3 / num_devices,
+         (double)log_ns / n, (unsigned long)lines,
+         sum == expected && !errors ? "exact" : "WRONG",
+         (log_sum - expected) / n);
+}
+
+
+static void *
+race_reader(void *)
+{
+  struct store_range r;
+  uint64_t head, tail, from, j, i;
+  unsigned seed = 1;
+  float v0, v1;
+  uint8_t k;
+  uint32_t errors;
+
+  while (!race.done)
+  {
+    head = store_head(&race.reader);
+    tail = store_tail(&race.reader);
+    if (head <= tail)
+      continue;
+    from = tail + rand_r(&seed) % (head - tail);
+    store_query(&race.reader, BASE_TIME + from * SECOND,
+                BASE_TIME + (from + 1 + rand_r(&seed) % 256) * SECOND, &r);
+    errors = 0;
+    j = r.first;
+    /* The writer may be storing the entries meanwhile, so load them as it
+       stores them. */
+    for (k = 0; k < r.spans; ++k)
+      for (i = 0; i < r.len[k]; ++i, ++j)
+      {
+        __atomic_load(&r.values[k][0][i], &v0, __ATOMIC_RELAXED);
+        __atomic_load(&r.values[k][1][i], &v1, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&r.time[k][i], __ATOMIC_RELAXED) !=
+            BASE_TIME + j * SECOND || v0 != value(0, 0, j) ||
+            v1 != value(0, 1, j))
+          ++errors;
+      }
+    ++race.queries;
+    if (!store_intact(&race.reader, &r))
+      continue;
+    ++race.intact;
+    race.records += r.end - r.first;
+    race.errors += errors;
+  }
+  return NULL;
+}
+
+
+static void
+bench_race(void)
+{
+  struct master_device *d = &devices[0];
+  char path[4096];
+  pthread_t reader;
+  float vals[MAX_CHANNELS];
+  uint64_t i, t;
+
+  snprintf(path, sizeof(path), "%s/race.lbs", dir);
+  if (store_open_writer(&race.writer, path, d, RACE_CAPACITY) < 0 ||
+      store_open_reader(&race.reader, path) < 0)
+  {
+    perror(path);
+    exit(1);
+  }
+  pthread_create(&reader, NULL, race_reader, NULL);
+  t = now_ns();
+  for (i = 0; i < RACE_RECORDS; ++i)
+  {
+    vals[0] = value(0, 0, i);
+    vals[1] = value(0, 1, i);
+    store_append(&race.writer, BASE_TIME + i * SECOND, vals);
+  }
+  t = now_ns() - t;
+  race.done = true;
+  pthread_join(reader, NULL);
+
+  printf("race:       %llu records through %u slots (%.1f ns each), "
+         "%lu queries, %lu intact with %lu records, %lu errors\n",
+         RACE_RECORDS, RACE_CAPACITY, (double)t / RACE_RECORDS,
+         (unsigned long)race.queries, (unsigned long)race.intact,
+         (unsigned long)race.records, (unsigned long)race.errors);
+  store_close(&race.reader);
+  store_close(&race.writer);
+  unlink(path);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  struct store *stores;
+  char path[4096], log_path[4096];
+  FILE *log;
+  uint16_t dev;
+
+  if (argc > 1)
+    num_devices = atoi(argv[1]);
+  if (argc > 2)
+    num_records = atoi(argv[2]);
+  if (argc > 3)
+    capacity = atoi(argv[3]);
+  if (argc > 4)
+    query_records = atoi(argv[4]);
+  if (num_devices < 1 || num_records < 1 || capacity < 1 ||
+      query_records < 1 || query_records > num_records ||
+      query_records > capacity)
+  {
+    fprintf(stderr, "Usage: %s [devices [records [capacity "
+            "[query_records(up to both)]]]]\n", argv[0]);
+    return 1;
+  }
+  if (!mkdtemp(dir))
+  {
+    perror(dir);
+    return 1;
+  }
+
+  make_devices();
+  stores = (struct store *)calloc(num_devices, sizeof(*stores));
+  for (dev = 0; dev < num_devices; ++dev)
+    if (store_open_device(&stores[dev], dir, &devices[dev], capacity) < 0)
+    {
+      perror("store_open_device");
+      return 1;
+    }
+  snprintf(log_path, sizeof(log_path), "%s/values.log", dir);
+  log = fopen(log_path, "w");
+  if (!log)
+  {
+    perror(log_path);
+    return 1;
+  }
+
+  bench_append(stores, log);
+  fclose(log);
+  bench_query(log_path);
+  bench_race();
+
+  for (dev = 0; dev < num_devices; ++dev)
+  {
+    store_close(&stores[dev]);
+    store_path(path, sizeof(path), dir, &devices[dev], false);
+    unlink(path);
+  }
+  unlink(log_path);
+  rmdir(dir);
+  return 0;
+}